@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace order_statistics {
+
+// An allocator, as used by `Tree` and `TreeNode`, is a copyable handle to a
+// source of memory. It has the following member functions:
+//
+// - `void *allocate(std::size_t size)` returns a block of at least `size`
+//   bytes aligned to `alignof(std::max_align_t)`, or throws.
+// - `void deallocate(void *block, std::size_t size)` returns a `block` that
+//   was obtained from `allocate(size)` on an equal allocator.
+// - `bool can_release_all() const` returns whether `release_all` may be
+//   called, i.e. whether no other allocator shares this one's memory.
+// - `void release_all()` deallocates every block obtained from this allocator
+//   at once. The behavior is undefined unless `can_release_all()`.
+//
+// Two allocators compare equal if each can deallocate the other's blocks.
+
+// `HeapAllocator` allocates every block from the global `operator new`.
+class HeapAllocator {
+ public:
+    void *allocate(std::size_t size);
+    void deallocate(void *block, std::size_t size);
+
+    bool can_release_all() const;
+    void release_all();
+
+    friend bool operator==(const HeapAllocator&, const HeapAllocator&) = default;
+};
+
+inline void *HeapAllocator::allocate(std::size_t size) {
+    return ::operator new(size);
+}
+
+inline void HeapAllocator::deallocate(void *block, std::size_t size) {
+    ::operator delete(block, size);
+}
+
+inline bool HeapAllocator::can_release_all() const {
+    return false;
+}
+
+inline void HeapAllocator::release_all() {
+    assert(!"HeapAllocator can't release all of its blocks at once");
+}
+
+namespace detail {
+
+// `Arena` carves blocks out of large slabs. Freed blocks go onto a free list
+// for their size class, from which later allocations of that class are
+// served. Blocks too large for any size class are allocated individually.
+// All memory is released when the `Arena` is destroyed or when `release_all`
+// is called.
+class Arena {
+ public:
+    // Sizes up to `max_small_size` are rounded up to a multiple of
+    // `granularity`. Larger sizes, up to `max_pooled_size`, are rounded up to
+    // a power of two.
+    static constexpr std::size_t granularity = alignof(std::max_align_t);
+    static constexpr std::size_t max_small_size = 256;
+    static constexpr std::size_t max_pooled_size = 64 * 1024;
+    static constexpr std::size_t slab_size = 4 * max_pooled_size;
+
+ private:
+    static constexpr std::size_t small_classes = max_small_size / granularity;
+    static constexpr std::size_t size_classes =
+        small_classes + std::countr_zero(max_pooled_size) - std::countr_zero(max_small_size);
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    // Blocks larger than `max_pooled_size` are prefixed by a `LargeBlock`, so
+    // that `release_all` can find them.
+    struct alignas(std::max_align_t) LargeBlock {
+        LargeBlock *prev;
+        LargeBlock *next;
+    };
+
+    FreeBlock *free_lists[size_classes] = {};
+    std::vector<void*> slabs;
+    // The unused remainder of the most recently allocated slab.
+    char *bump_begin = nullptr;
+    char *bump_end = nullptr;
+    LargeBlock *large_blocks = nullptr;
+
+ public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+
+    void *allocate(std::size_t size);
+    void deallocate(void *block, std::size_t size);
+    void release_all();
+
+    // Return the number of bytes that an allocation of `size` bytes actually
+    // occupies.
+    static std::size_t rounded_size(std::size_t size);
+
+ private:
+    static std::size_t size_class(std::size_t size);
+};
+
+inline Arena::~Arena() {
+    release_all();
+}
+
+inline std::size_t Arena::size_class(std::size_t size) {
+    assert(size > 0 && size <= max_pooled_size);
+    if (size <= max_small_size) {
+        return (size - 1) / granularity;
+    }
+    return small_classes + std::bit_width(size - 1) - std::countr_zero(max_small_size) - 1;
+}
+
+inline std::size_t Arena::rounded_size(std::size_t size) {
+    if (size <= max_small_size) {
+        return std::max(granularity, (size + granularity - 1) / granularity * granularity);
+    }
+    if (size <= max_pooled_size) {
+        return std::bit_ceil(size);
+    }
+    return size;
+}
+
+inline void *Arena::allocate(std::size_t size) {
+    if (size > max_pooled_size) {
+        void *const raw = ::operator new(sizeof(LargeBlock) + size);
+        LargeBlock *const block = new (raw) LargeBlock{nullptr, large_blocks};
+        if (large_blocks) {
+            large_blocks->prev = block;
+        }
+        large_blocks = block;
+        return block + 1;
+    }
+
+    FreeBlock *&free_list = free_lists[size_class(size)];
+    if (free_list) {
+        FreeBlock *const block = free_list;
+        free_list = block->next;
+        return block;
+    }
+
+    const std::size_t rounded = rounded_size(size);
+    if (std::size_t(bump_end - bump_begin) < rounded) {
+        // Whatever is left of the current slab is abandoned. Make room to
+        // remember the new slab first, so that it can't leak, and grow
+        // geometrically, as `push_back` would.
+        if (slabs.size() == slabs.capacity()) {
+            slabs.reserve(2 * slabs.size() + 1);
+        }
+        bump_begin = static_cast<char*>(::operator new(slab_size));
+        bump_end = bump_begin + slab_size;
+        slabs.push_back(bump_begin);
+    }
+    void *const block = bump_begin;
+    bump_begin += rounded;
+    return block;
+}
+
+inline void Arena::deallocate(void *block, std::size_t size) {
+    if (size > max_pooled_size) {
+        LargeBlock *const large = static_cast<LargeBlock*>(block) - 1;
+        if (large->prev) {
+            large->prev->next = large->next;
+        } else {
+            large_blocks = large->next;
+        }
+        if (large->next) {
+            large->next->prev = large->prev;
+        }
+        ::operator delete(large);
+        return;
+    }
+
+    FreeBlock *&free_list = free_lists[size_class(size)];
+    free_list = new (block) FreeBlock{free_list};
+}
+
+inline void Arena::release_all() {
+    for (void *const slab : slabs) {
+        ::operator delete(slab, slab_size);
+    }
+    slabs.clear();
+    bump_begin = bump_end = nullptr;
+    std::fill(std::begin(free_lists), std::end(free_lists), nullptr);
+    while (large_blocks) {
+        LargeBlock *const next = large_blocks->next;
+        ::operator delete(large_blocks);
+        large_blocks = next;
+    }
+}
+
+} // namespace detail
+
+// `ArenaAllocator` allocates blocks from an arena of large slabs that is
+// shared by all copies of the allocator. A default constructed
+// `ArenaAllocator` refers to a new arena. Nodes and value arrays are recycled
+// through per-size free lists, and a `Tree` that has the arena to itself can
+// free all of its memory at once.
+class ArenaAllocator {
+    std::shared_ptr<detail::Arena> arena;
+
+ public:
+    ArenaAllocator();
+
+    void *allocate(std::size_t size);
+    void deallocate(void *block, std::size_t size);
+
+    bool can_release_all() const;
+    void release_all();
+
+    friend bool operator==(const ArenaAllocator&, const ArenaAllocator&) = default;
+};
+
+inline ArenaAllocator::ArenaAllocator()
+: arena(std::make_shared<detail::Arena>()) {}
+
+inline void *ArenaAllocator::allocate(std::size_t size) {
+    return arena->allocate(size);
+}
+
+inline void ArenaAllocator::deallocate(void *block, std::size_t size) {
+    arena->deallocate(block, size);
+}
+
+inline bool ArenaAllocator::can_release_all() const {
+    return arena.use_count() == 1;
+}
+
+inline void ArenaAllocator::release_all() {
+    assert(can_release_all());
+    arena->release_all();
+}
+
+} // namespace order_statistics
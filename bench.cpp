@@ -0,0 +1,1239 @@
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "allocator.h"
+#include "bench.h"
+#include "btree.h"
+#include "kll-sketch.h"
+#include "kth-percentile.h"
+#include "sharded-recorder.h"
+#include "simd.h"
+#include "sliding-window.h"
+#include "snapshot.h"
+#include "tree.h"
+
+// Return `count` pseudo-random latencies, in microseconds, having a long tail.
+std::vector<unsigned> latencies(std::size_t count) {
+    std::mt19937 generator(count);
+    std::lognormal_distribution<double> distribution(6.0, 1.0);
+    std::vector<unsigned> result;
+    result.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        result.push_back(distribution(generator));
+    }
+    return result;
+}
+
+// Compare `SlidingWindowPercentile` against rebuilding a `Tree` from the
+// window's samples on every tick. Each tick inserts `tick` samples and then
+// queries p50 and p99 over the most recent `window` samples.
+void bench_sliding_window() {
+    constexpr std::size_t tick = 1'000;
+    constexpr std::size_t ticks = 100;
+    for (const std::size_t window : {10'000, 100'000}) {
+        const std::vector<unsigned> samples = latencies(window + tick * ticks);
+
+        const double incremental = seconds_to([&]() {
+            order_statistics::SlidingWindowPercentile<unsigned> percentiles(window);
+            std::size_t i = 0;
+            for (; i < window; ++i) {
+                percentiles.insert(samples[i]);
+            }
+            for (std::size_t t = 0; t < ticks; ++t) {
+                for (std::size_t end = i + tick; i < end; ++i) {
+                    percentiles.insert(samples[i]);
+                }
+                do_not_optimize(percentiles.percentile(50)[0]);
+                do_not_optimize(percentiles.percentile(99)[0]);
+            }
+        });
+        report("sliding_window/incremental", window, ticks, incremental);
+
+        const double rebuild = seconds_to([&]() {
+            std::deque<unsigned> recent(samples.begin(), samples.begin() + window);
+            std::size_t i = window;
+            for (std::size_t t = 0; t < ticks; ++t) {
+                for (std::size_t end = i + tick; i < end; ++i) {
+                    recent.pop_front();
+                    recent.push_back(samples[i]);
+                }
+                order_statistics::Tree<unsigned> tree;
+                for (const unsigned sample : recent) {
+                    tree.insert(sample);
+                }
+                do_not_optimize(tree.percentile(50)[0]);
+                do_not_optimize(tree.percentile(99)[0]);
+            }
+        });
+        report("sliding_window/rebuild", window, ticks, rebuild);
+    }
+}
+
+// Compare the cost of inserting `n` duplicate-heavy latencies and then
+// clearing the tree, using each allocator.
+template <typename Allocator>
+void bench_allocator(std::string_view name) {
+    for (const std::size_t n : {100'000, 1'000'000}) {
+        const std::vector<unsigned> samples = latencies(n);
+        order_statistics::Tree<unsigned, std::identity, Allocator> tree;
+        const double insert = seconds_to([&]() {
+            for (const unsigned sample : samples) {
+                tree.insert(sample);
+            }
+        });
+        report(std::string(name) + "/insert", n, n, insert);
+        const double clear = seconds_to([&]() {
+            tree.clear();
+        });
+        report(std::string(name) + "/clear", n, n, clear);
+    }
+}
+
+// Measure the basic operations of a `Tree` of `n` mostly distinct keys:
+// insertion, lookup by rank and by key, and destruction.
+void bench_tree() {
+    for (const std::size_t n : {1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        std::vector<std::uint64_t> keys(n);
+        std::mt19937_64 generator(n);
+        for (std::uint64_t& key : keys) {
+            key = generator();
+        }
+
+        auto tree = std::make_unique<order_statistics::Tree<std::uint64_t>>();
+        const double insert = seconds_to([&]() {
+            for (const std::uint64_t key : keys) {
+                tree->insert(key);
+            }
+        });
+        report("tree/insert", n, n, insert);
+
+        const double nth_element = seconds_to([&]() {
+            for (std::size_t i = 0; i < n; ++i) {
+                do_not_optimize(tree->nth_element(keys[i] % n));
+            }
+        });
+        report("tree/nth_element", n, n, nth_element);
+
+        const double rank = seconds_to([&]() {
+            for (const std::uint64_t key : keys) {
+                do_not_optimize(tree->rank(key));
+            }
+        });
+        report("tree/rank", n, n, rank);
+
+        const double equal_range = seconds_to([&]() {
+            for (const std::uint64_t key : keys) {
+                do_not_optimize(tree->equal_range(key).size());
+            }
+        });
+        report("tree/equal_range", n, n, equal_range);
+
+        const double dispose = seconds_to([&]() {
+            tree.reset();
+        });
+        report("tree/destroy", n, n, dispose);
+    }
+}
+
+// Measure the lookup throughput of a `Tree`-like order statistic tree of `n`
+// random keys having `n / 4` distinct values.
+template <typename OrderStatisticTree>
+void bench_lookups(std::string_view name, std::size_t n) {
+    std::vector<std::uint64_t> keys(n);
+    std::mt19937_64 generator(n);
+    for (std::uint64_t& key : keys) {
+        key = generator() % (n / 4);
+    }
+    OrderStatisticTree tree;
+    const double insert = seconds_to([&]() {
+        for (const std::uint64_t key : keys) {
+            tree.insert(key);
+        }
+    });
+    report(std::string(name) + "/insert", n, n, insert);
+
+    const double nth_element = seconds_to([&]() {
+        for (std::size_t i = 0; i < n; ++i) {
+            do_not_optimize(tree.nth_element(keys[i] * 4));
+        }
+    });
+    report(std::string(name) + "/nth_element", n, n, nth_element);
+
+    const double rank = seconds_to([&]() {
+        for (const std::uint64_t key : keys) {
+            do_not_optimize(tree.rank(key));
+        }
+    });
+    report(std::string(name) + "/rank", n, n, rank);
+
+    const double equal_range = seconds_to([&]() {
+        for (const std::uint64_t key : keys) {
+            do_not_optimize(tree.equal_range(key).size());
+        }
+    });
+    report(std::string(name) + "/equal_range", n, n, equal_range);
+}
+
+// Compare `BTree` against `Tree`.
+void bench_btree() {
+    for (const std::size_t n : {1'000'000, 10'000'000, 100'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        bench_lookups<order_statistics::Tree<std::uint64_t>>("btree/avl", n);
+        bench_lookups<order_statistics::BTree<std::uint64_t>>("btree/fanout_16", n);
+        bench_lookups<order_statistics::BTree<std::uint64_t, std::identity, 64>>("btree/fanout_64", n);
+    }
+}
+
+// Compare the node search kernels, for the specified `Key` type, against
+// `std::lower_bound` on a node-sized array of keys, and then measure
+// `BTree<Key>` rank and percentile queries.
+template <typename Key>
+void bench_simd(std::string_view name) {
+    constexpr std::size_t fanout = 16;
+    constexpr std::size_t searches = 10'000'000;
+    Key keys[fanout];
+    for (std::size_t i = 0; i < fanout; ++i) {
+        keys[i] = Key(i * 10);
+    }
+    std::vector<Key> targets(1024);
+    std::mt19937 generator(fanout);
+    for (Key& target : targets) {
+        target = Key(generator() % (fanout * 10));
+    }
+
+    const auto search = [&](auto&& count_below) {
+        return seconds_to([&]() {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < searches; ++i) {
+                total += count_below(targets[i % targets.size()]);
+            }
+            do_not_optimize(total);
+        });
+    };
+    report(std::string(name) + "/kernel/simd", fanout, searches, search([&](const Key& key) {
+        return order_statistics::detail::count_below<false>(keys, fanout, key);
+    }));
+    report(std::string(name) + "/kernel/scalar", fanout, searches, search([&](const Key& key) {
+        return order_statistics::detail::count_below_scalar<false>(keys, fanout, key);
+    }));
+    report(std::string(name) + "/kernel/lower_bound", fanout, searches, search([&](const Key& key) {
+        return std::lower_bound(keys, keys + fanout, key) - keys;
+    }));
+
+    const std::size_t n = std::min<std::size_t>(1'000'000, max_problem_size());
+    std::vector<Key> values(n);
+    for (Key& value : values) {
+        value = Key(generator() % n);
+    }
+    order_statistics::BTree<Key> tree;
+    for (const Key& value : values) {
+        tree.insert(value);
+    }
+    report(std::string(name) + "/btree/rank", n, n, seconds_to([&]() {
+        for (const Key& value : values) {
+            do_not_optimize(tree.rank(value));
+        }
+    }));
+    report(std::string(name) + "/btree/percentile", n, n, seconds_to([&]() {
+        for (std::size_t i = 0; i < n; ++i) {
+            do_not_optimize(tree.percentile(i % 100 + 1)[0]);
+        }
+    }));
+}
+
+// Compare building a `Tree` of `n` latencies by inserting them one at a time
+// against bulk loading them, both from unsorted and from sorted input.
+void bench_assign() {
+    for (const std::size_t n : {1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        const std::vector<unsigned> samples = latencies(n);
+        std::vector<unsigned> sorted = samples;
+        std::stable_sort(sorted.begin(), sorted.end());
+
+        report("assign/insert_loop", n, n, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree;
+            for (const unsigned sample : samples) {
+                tree.insert(sample);
+            }
+        }));
+        report("assign/unsorted", n, n, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree(samples.begin(), samples.end());
+        }));
+        report("assign/sorted", n, n, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree(order_statistics::sorted_equivalent, sorted.begin(), sorted.end());
+        }));
+    }
+}
+
+// Compare `Tree::insert_batch` against inserting each element of the batch
+// individually, for a range of batch sizes. The tree starts out with a
+// million samples, and then receives another million in batches.
+void bench_insert_batch() {
+    constexpr std::size_t initial = 1'000'000;
+    constexpr std::size_t flushed = 1'000'000;
+    const std::vector<unsigned> samples = latencies(initial + flushed);
+    for (const std::size_t batch_size : {1'024, 4'096, 16'384, 65'536}) {
+        report("batch/insert_loop", batch_size, flushed, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree(samples.begin(), samples.begin() + initial);
+            for (std::size_t i = initial; i < samples.size(); i += batch_size) {
+                const std::size_t end = std::min(i + batch_size, samples.size());
+                for (std::size_t j = i; j < end; ++j) {
+                    tree.insert(samples[j]);
+                }
+            }
+        }));
+        report("batch/insert_batch", batch_size, flushed, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree(samples.begin(), samples.begin() + initial);
+            for (std::size_t i = initial; i < samples.size(); i += batch_size) {
+                const std::size_t end = std::min(i + batch_size, samples.size());
+                tree.insert_batch(std::span<const unsigned>(samples.data() + i, end - i));
+            }
+        }));
+    }
+}
+
+// Compare `KthPercentile::insert_batch` against inserting each element of
+// the batch individually, for a range of batch sizes.
+void bench_kth_percentile_batch() {
+    constexpr std::size_t n = 2'000'000;
+    const std::vector<unsigned> samples = latencies(n);
+    for (const std::size_t batch_size : {1'024, 16'384, 65'536}) {
+        report("kth_percentile/insert_loop", batch_size, n, seconds_to([&]() {
+            order_statistics::KthPercentile<unsigned, 90> p90;
+            for (const unsigned sample : samples) {
+                p90.insert(sample);
+            }
+            do_not_optimize(p90.get());
+        }));
+        report("kth_percentile/insert_batch", batch_size, n, seconds_to([&]() {
+            order_statistics::KthPercentile<unsigned, 90> p90;
+            for (std::size_t i = 0; i < n; i += batch_size) {
+                const std::size_t end = std::min(i + batch_size, n);
+                p90.insert_batch(std::span<const unsigned>(samples.data() + i, end - i));
+            }
+            do_not_optimize(p90.get());
+        }));
+    }
+}
+
+// Compare tracking four percentiles with one `MultiPercentile` against
+// tracking them with one `KthPercentile` each.
+void bench_multi_percentile() {
+    for (const std::size_t n : {100'000, 1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        const std::vector<unsigned> samples = latencies(n);
+        report("multi_percentile/kth_percentile_x4", n, n, seconds_to([&]() {
+            order_statistics::KthPercentile<unsigned, 50> p50;
+            order_statistics::KthPercentile<unsigned, 75> p75;
+            order_statistics::KthPercentile<unsigned, 90> p90;
+            order_statistics::KthPercentile<unsigned, 99> p99;
+            for (const unsigned sample : samples) {
+                p50.insert(sample);
+                p75.insert(sample);
+                p90.insert(sample);
+                p99.insert(sample);
+            }
+            do_not_optimize(p50.get() + p75.get() + p90.get() + p99.get());
+        }));
+        report("multi_percentile/multi", n, n, seconds_to([&]() {
+            order_statistics::FixedMultiPercentile<unsigned, std::identity, 50, 75, 90, 99> percentiles;
+            for (const unsigned sample : samples) {
+                percentiles.insert(sample);
+            }
+            do_not_optimize(percentiles.get(0) + percentiles.get(1) + percentiles.get(2) + percentiles.get(3));
+        }));
+    }
+}
+
+// Compare `ShardedPercentileRecorder` against a `Tree` guarded by a mutex,
+// with 1 to 64 threads each recording the same number of samples. The
+// recorder's one snapshot afterward is timed separately. Time is per sample
+// recorded, across all threads.
+void bench_sharded_recorder() {
+    constexpr std::size_t per_thread = 200'000;
+    const std::vector<unsigned> samples = latencies(per_thread);
+    for (const std::size_t threads : {1, 2, 4, 8, 16, 32, 64}) {
+        const auto run = [&](auto&& record) {
+            std::vector<std::thread> workers;
+            for (std::size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&]() {
+                    for (const unsigned sample : samples) {
+                        record(sample);
+                    }
+                });
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+        };
+        report("sharded/mutex_tree", threads, threads * per_thread, seconds_to([&]() {
+            std::mutex mutex;
+            order_statistics::Tree<unsigned> tree;
+            run([&](unsigned sample) {
+                const std::lock_guard<std::mutex> lock(mutex);
+                tree.insert(sample);
+            });
+        }));
+        // Time recording and merging separately, since recording is the
+        // part that contends.
+        order_statistics::ShardedPercentileRecorder<unsigned> recorder(threads);
+        report("sharded/recorder_insert", threads, threads * per_thread, seconds_to([&]() {
+            run([&](unsigned sample) {
+                recorder.insert(sample);
+            });
+        }));
+        report("sharded/recorder_snapshot", threads, threads * per_thread, seconds_to([&]() {
+            do_not_optimize(recorder.snapshot().percentile(99)[0]);
+        }));
+    }
+}
+
+// Compare `Tree::merge` against inserting each element of the smaller tree
+// into the larger, for a tree of a million samples and smaller trees of
+// various sizes. Time is per element of the smaller tree.
+void bench_merge() {
+    constexpr std::size_t n = 1'000'000;
+    const std::vector<unsigned> samples = latencies(2 * n);
+    for (const std::size_t m : {1'000, 10'000, 100'000, 1'000'000}) {
+        {
+            order_statistics::Tree<unsigned> larger(samples.begin(), samples.begin() + n);
+            const std::vector<unsigned> smaller(samples.begin() + n, samples.begin() + n + m);
+            report("merge/insert_loop", m, m, seconds_to([&]() {
+                for (const unsigned sample : smaller) {
+                    larger.insert(sample);
+                }
+            }));
+        }
+        {
+            order_statistics::Tree<unsigned> larger(samples.begin(), samples.begin() + n);
+            order_statistics::Tree<unsigned> smaller(samples.begin() + n, samples.begin() + n + m);
+            report("merge/merge", m, m, seconds_to([&]() {
+                larger.merge(std::move(smaller));
+            }));
+        }
+    }
+}
+
+// Compare summing the elements between p90 and p99 by calling
+// `Tree::nth_element` for each rank against iterating over `Tree::range`.
+// Time is per element summed.
+void bench_range() {
+    for (const std::size_t n : {100'000, 1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        const std::vector<unsigned> samples = latencies(n);
+        const order_statistics::Tree<unsigned> tree(samples.begin(), samples.end());
+        const std::size_t lo = 90 * n / 100;
+        const std::size_t hi = 99 * n / 100;
+        report("range/nth_element", n, hi - lo, seconds_to([&]() {
+            std::uint64_t sum = 0;
+            for (std::size_t rank = lo; rank < hi; ++rank) {
+                sum += tree.nth_element(rank);
+            }
+            do_not_optimize(sum);
+        }));
+        report("range/range", n, hi - lo, seconds_to([&]() {
+            std::uint64_t sum = 0;
+            for (const unsigned sample : tree.range(lo, hi)) {
+                sum += sample;
+            }
+            do_not_optimize(sum);
+        }));
+    }
+}
+
+// Compare computing the mean and variance of the elements from p99 up by
+// iterating over `Tree::range` against `Tree::sum_by_rank` with `KeySums`,
+// and the cost to insertion of maintaining the sums. Query times are per
+// query.
+void bench_sum_by_rank() {
+    using SumTree = order_statistics::Tree<unsigned, std::identity, order_statistics::HeapAllocator, order_statistics::KeySums<>>;
+    for (const std::size_t n : {100'000, 1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        const std::vector<unsigned> samples = latencies(n);
+        order_statistics::Tree<unsigned> tree;
+        report("sum_by_rank/insert", n, n, seconds_to([&]() {
+            for (const unsigned sample : samples) {
+                tree.insert(sample);
+            }
+        }));
+        SumTree sum_tree;
+        report("sum_by_rank/insert_with_sums", n, n, seconds_to([&]() {
+            for (const unsigned sample : samples) {
+                sum_tree.insert(sample);
+            }
+        }));
+        const std::size_t lo = 99 * n / 100;
+        report("sum_by_rank/range_scan", n, 1, seconds_to([&]() {
+            double sum = 0;
+            double sum_of_squares = 0;
+            for (const unsigned sample : tree.range(lo, n)) {
+                sum += sample;
+                sum_of_squares += double(sample) * sample;
+            }
+            do_not_optimize(sum + sum_of_squares);
+        }));
+        constexpr std::size_t queries = 1'000;
+        report("sum_by_rank/sum_by_rank", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                const auto sums = sum_tree.sum_by_rank(lo - i, n);
+                do_not_optimize(sums.sum + sums.sum_of_squares);
+            }
+        }));
+    }
+}
+
+// `CountingAllocator` is an `Allocator` that keeps a running total of the
+// bytes requested from all of its instances.
+template <typename Allocator>
+class CountingAllocator : public Allocator {
+ public:
+    static inline std::size_t bytes_requested = 0;
+
+    void *allocate(std::size_t size) {
+        bytes_requested += size;
+        return Allocator::allocate(size);
+    }
+
+    void deallocate(void *block, std::size_t size) {
+        bytes_requested -= size;
+        Allocator::deallocate(block, size);
+    }
+};
+
+// Measure the memory used per element by a `Tree` of `unsigned` keys, and its
+// lookup throughput, for keys that are distinct, that have a few duplicates
+// each, and that are long-tailed latencies.
+template <typename Allocator>
+void bench_layout(std::string_view name) {
+    using Counting = CountingAllocator<Allocator>;
+    using Tree = order_statistics::Tree<unsigned, std::identity, Counting>;
+    for (const std::size_t n : {1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        std::mt19937 generator(n);
+        std::vector<unsigned> distinct(n);
+        std::iota(distinct.begin(), distinct.end(), 0u);
+        std::shuffle(distinct.begin(), distinct.end(), generator);
+        std::vector<unsigned> few_duplicates(n);
+        for (unsigned& key : few_duplicates) {
+            key = generator() % (n / 2);
+        }
+        const std::pair<std::string_view, std::vector<unsigned>> workloads[] = {
+            {"distinct", std::move(distinct)},
+            {"few_duplicates", std::move(few_duplicates)},
+            {"latencies", latencies(n)},
+        };
+        for (const auto& [workload, keys] : workloads) {
+            const std::string prefix = std::string(name) + "/" + std::string(workload);
+            // An arena might release its blocks all at once, without
+            // `deallocate`, so count from where the previous tree left off.
+            const std::size_t before = Counting::bytes_requested;
+            Tree tree;
+            for (const unsigned key : keys) {
+                tree.insert(key);
+            }
+            report_bytes(prefix + "/memory", n, Counting::bytes_requested - before);
+            report(prefix + "/nth_element", n, n, seconds_to([&]() {
+                for (std::size_t i = 0; i < n; ++i) {
+                    do_not_optimize(tree.nth_element(keys[i] % n));
+                }
+            }));
+            report(prefix + "/rank", n, n, seconds_to([&]() {
+                for (const unsigned key : keys) {
+                    do_not_optimize(tree.rank(key));
+                }
+            }));
+        }
+    }
+}
+
+// Compare a `Tree` that stores copies of duplicate latencies against a
+// `CountedTree` that counts them: memory per element, insertion, and
+// percentile queries.
+template <typename OrderStatisticTree>
+void bench_counted(std::string_view name, const std::vector<unsigned>& samples) {
+    using Counting = CountingAllocator<order_statistics::HeapAllocator>;
+    const std::size_t n = samples.size();
+    const std::size_t before = Counting::bytes_requested;
+    OrderStatisticTree tree;
+    report(std::string(name) + "/insert", n, n, seconds_to([&]() {
+        for (const unsigned sample : samples) {
+            tree.insert(sample);
+        }
+    }));
+    report_bytes(std::string(name) + "/memory", n, Counting::bytes_requested - before);
+    constexpr std::size_t queries = 1'000'000;
+    report(std::string(name) + "/percentile", n, queries, seconds_to([&]() {
+        for (std::size_t i = 0; i < queries; ++i) {
+            do_not_optimize(tree.percentile(i % 100 + 1).front());
+        }
+    }));
+}
+
+void bench_counted() {
+    using Counting = CountingAllocator<order_statistics::HeapAllocator>;
+    for (const std::size_t n : {1'000'000, 10'000'000, 100'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        const std::vector<unsigned> samples = latencies(n);
+        bench_counted<order_statistics::Tree<unsigned, std::identity, Counting>>("counted/copies", samples);
+        bench_counted<order_statistics::CountedTree<unsigned, Counting>>("counted/counts", samples);
+    }
+}
+
+// Measure saving a snapshot of a tree of `samples` and restoring it, against
+// rebuilding the tree by inserting every sample again.
+template <typename OrderStatisticTree>
+void bench_snapshot(std::string_view name, const std::vector<unsigned>& samples) {
+    const std::size_t n = samples.size();
+    OrderStatisticTree tree;
+    report(std::string(name) + "/insert", n, n, seconds_to([&]() {
+        for (const unsigned sample : samples) {
+            tree.insert(sample);
+        }
+    }));
+    std::vector<char> buffer;
+    report(std::string(name) + "/save", n, n, seconds_to([&]() {
+        buffer.resize(order_statistics::snapshot_size(tree));
+        order_statistics::save_snapshot(tree, buffer);
+    }));
+    report_bytes(std::string(name) + "/snapshot", n, buffer.size());
+    OrderStatisticTree restored;
+    report(std::string(name) + "/restore", n, n, seconds_to([&]() {
+        order_statistics::restore_snapshot(restored, buffer);
+    }));
+    do_not_optimize(restored.size());
+}
+
+void bench_snapshot() {
+    for (const std::size_t n : {1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        // Latencies have few distinct keys, so also restore keys that are
+        // all distinct, where each is a node of its own.
+        const std::vector<unsigned> samples = latencies(n);
+        bench_snapshot<order_statistics::Tree<unsigned>>("snapshot/copies", samples);
+        bench_snapshot<order_statistics::CountedTree<unsigned>>("snapshot/counts", samples);
+        std::vector<unsigned> distinct(n);
+        std::iota(distinct.begin(), distinct.end(), 0u);
+        std::shuffle(distinct.begin(), distinct.end(), std::mt19937(n));
+        bench_snapshot<order_statistics::Tree<unsigned>>("snapshot/distinct/copies", distinct);
+        bench_snapshot<order_statistics::CountedTree<unsigned>>("snapshot/distinct/counts", distinct);
+    }
+}
+
+// Compare querying four percentiles with `Tree::percentile` against
+// querying them with `Tree::tracked_percentile`, where the queries are
+// interleaved with insertions. Time is per insertion plus its share of the
+// queries, which happen after every `interval` insertions.
+void bench_tracked_percentile() {
+    constexpr std::size_t n = 1'000'000;
+    constexpr std::size_t percents[] = {50, 90, 99, 100};
+    const std::vector<unsigned> samples = latencies(n);
+    for (const std::size_t interval : {1, 10, 100}) {
+        report("tracked/percentile", interval, n, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree;
+            for (std::size_t i = 0; i < n; ++i) {
+                tree.insert(samples[i]);
+                if (i % interval == 0) {
+                    for (const std::size_t percent : percents) {
+                        do_not_optimize(tree.percentile(percent)[0]);
+                    }
+                }
+            }
+        }));
+        report("tracked/tracked_percentile", interval, n, seconds_to([&]() {
+            order_statistics::Tree<unsigned> tree;
+            for (const std::size_t percent : percents) {
+                tree.track_percentile(percent);
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+                tree.insert(samples[i]);
+                if (i % interval == 0) {
+                    for (std::size_t j = 0; j < std::size(percents); ++j) {
+                        do_not_optimize(tree.tracked_percentile(j)[0]);
+                    }
+                }
+            }
+        }));
+    }
+}
+
+// Compare `KllSketch` against the exact `Tree` on the same streams, first for
+// insertion throughput, and then for accuracy: the worst error, as a
+// fraction of `n`, in the rank of the sketch's answer for each percentile
+// from 1 to 100. Also print how many elements the sketch retains.
+template <typename Value>
+void bench_sketch(std::string_view name, const std::vector<Value>& samples) {
+    const std::size_t n = samples.size();
+    const std::string prefix = "sketch/" + std::string(name);
+    order_statistics::Tree<Value> tree;
+    report(prefix + "/tree_insert", n, n, seconds_to([&]() {
+        for (const Value sample : samples) {
+            tree.insert(sample);
+        }
+    }));
+    order_statistics::KllSketch<Value> sketch;
+    report(prefix + "/kll_insert", n, n, seconds_to([&]() {
+        for (const Value sample : samples) {
+            sketch.insert(sample);
+        }
+    }));
+    // The first query sorts the retained elements, so time queries in bulk.
+    constexpr std::size_t queries = 100;
+    report(prefix + "/tree_percentile", n, queries, seconds_to([&]() {
+        for (std::size_t percent = 1; percent <= queries; ++percent) {
+            do_not_optimize(tree.percentile(percent)[0]);
+        }
+    }));
+    report(prefix + "/kll_percentile", n, queries, seconds_to([&]() {
+        for (std::size_t percent = 1; percent <= queries; ++percent) {
+            do_not_optimize(sketch.percentile(percent)[0]);
+        }
+    }));
+    double worst = 0;
+    for (std::size_t percent = 1; percent <= 100; ++percent) {
+        const std::size_t expected = std::min(percent * n / 100, n - 1);
+        const auto [min, max] = tree.rank(sketch.percentile(percent)[0]);
+        // Any position of the answer's key would do.
+        const std::size_t error = expected < min ? min - expected : expected > max ? expected - max : 0;
+        worst = std::max(worst, double(error) / n);
+    }
+    report_value(prefix + "/kll_max_rank_error", n, worst, "fraction of n");
+    report_value(prefix + "/kll_rank_error_bound", n,
+        order_statistics::KllSketch<Value>::normalized_rank_error(order_statistics::KllSketch<Value>::default_k), "fraction of n");
+    report_value(prefix + "/kll_retained", n, sketch.retained(), "elements");
+}
+
+void bench_sketch() {
+    for (const std::size_t n : {100'000, 1'000'000, 10'000'000}) {
+        if (n > max_problem_size()) {
+            break;
+        }
+        bench_sketch("lognormal", latencies(n));
+        std::mt19937_64 generator(n);
+        std::vector<std::uint64_t> uniform(n);
+        for (std::uint64_t& sample : uniform) {
+            sample = generator();
+        }
+        bench_sketch("uniform", uniform);
+    }
+}
+
+// `CountingStdAllocator` is a standard allocator that adds the bytes
+// requested through it, for any element type, to `std_bytes_requested`, so
+// that the memory of standard containers can be compared with `Tree`'s.
+inline std::size_t std_bytes_requested = 0;
+
+template <typename T>
+struct CountingStdAllocator {
+    using value_type = T;
+
+    CountingStdAllocator() = default;
+    template <typename U>
+    CountingStdAllocator(const CountingStdAllocator<U>&) {}
+
+    T *allocate(std::size_t n) {
+        std_bytes_requested += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *block, std::size_t n) {
+        std_bytes_requested -= n * sizeof(T);
+        std::allocator<T>().deallocate(block, n);
+    }
+
+    template <typename U>
+    friend bool operator==(const CountingStdAllocator&, const CountingStdAllocator<U>&) {
+        return true;
+    }
+};
+
+// Return `n` keys drawn from the specified `distribution`, which is one of:
+//
+// - "uniform": uniform over all 32-bit values, so nearly all distinct,
+// - "zipf": Zipf-distributed, with exponent 1, over a million values, so
+//   that a few keys are very common and most are rare,
+// - "duplicates": uniform over 100 values,
+// - "sorted" and "reverse": 0 through `n - 1`, ascending or descending.
+std::vector<std::uint32_t> suite_keys(std::string_view distribution, std::size_t n) {
+    std::vector<std::uint32_t> keys(n);
+    std::mt19937 generator(n);
+    if (distribution == "uniform") {
+        for (std::uint32_t& key : keys) {
+            key = generator();
+        }
+    } else if (distribution == "zipf") {
+        constexpr std::size_t values = 1'000'000;
+        std::vector<double> cumulative(values);
+        double total = 0;
+        for (std::size_t rank = 0; rank < values; ++rank) {
+            cumulative[rank] = total += 1.0 / double(rank + 1);
+        }
+        std::uniform_real_distribution<double> uniform(0, total);
+        for (std::uint32_t& key : keys) {
+            const std::size_t rank =
+                std::lower_bound(cumulative.begin(), cumulative.end(), uniform(generator)) - cumulative.begin();
+            // Scatter the popular keys, so that they aren't all the least.
+            key = std::uint32_t(std::min(rank, values - 1) * 2654435761u);
+        }
+    } else if (distribution == "duplicates") {
+        for (std::uint32_t& key : keys) {
+            key = generator() % 100;
+        }
+    } else if (distribution == "sorted") {
+        std::iota(keys.begin(), keys.end(), 0u);
+    } else {
+        assert(distribution == "reverse");
+        std::iota(keys.rbegin(), keys.rend(), 0u);
+    }
+    return keys;
+}
+
+// Measure `Tree` and `KthPercentile`, and `std::multiset` and
+// `std::nth_element` as baselines, on `n` keys from the specified
+// `distribution`. Small problems are repeated so that each measurement
+// covers at least about a million operations. Queries that take O(n) time
+// with a baseline are repeated fewer times, and the `std::multiset` baseline
+// is skipped above 10 million elements, where it needs more memory than
+// many machines have.
+void bench_suite(std::string_view distribution, std::size_t n) {
+    using Counting = CountingAllocator<order_statistics::HeapAllocator>;
+    const std::vector<std::uint32_t> keys = suite_keys(distribution, n);
+    const std::string prefix = "suite/" + std::string(distribution) + "/";
+    const std::size_t reps = std::max<std::size_t>(1, 1'000'000 / n);
+    constexpr std::size_t queries = 1'000'000;
+    const std::size_t linear_queries = std::clamp<std::size_t>(100'000'000 / n, 1, 1'000);
+    // The `i`th query is about this key, which is in the tree.
+    const auto query_key = [&](std::size_t i) { return keys[i * 7919 % n]; };
+
+    {
+        double insert = 0;
+        for (std::size_t rep = 1; rep < reps; ++rep) {
+            order_statistics::Tree<std::uint32_t, std::identity, Counting> tree;
+            insert += seconds_to([&]() {
+                for (const std::uint32_t key : keys) {
+                    tree.insert(key);
+                }
+            });
+        }
+        const std::size_t before = Counting::bytes_requested;
+        order_statistics::Tree<std::uint32_t, std::identity, Counting> tree;
+        insert += seconds_to([&]() {
+            for (const std::uint32_t key : keys) {
+                tree.insert(key);
+            }
+        });
+        report(prefix + "tree/insert", n, n * reps, insert);
+        report_bytes(prefix + "tree/memory", n, Counting::bytes_requested - before);
+        report(prefix + "tree/percentile", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                do_not_optimize(tree.percentile(i % 100 + 1).front());
+            }
+        }));
+        report(prefix + "tree/rank", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                do_not_optimize(tree.rank(query_key(i)));
+            }
+        }));
+        report(prefix + "tree/equal_range", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                do_not_optimize(tree.equal_range(query_key(i)).size());
+            }
+        }));
+    }
+
+    {
+        double insert = 0;
+        order_statistics::KthPercentile<std::uint32_t, 90> p90;
+        for (std::size_t rep = 0; rep < reps; ++rep) {
+            p90 = {};
+            insert += seconds_to([&]() {
+                for (const std::uint32_t key : keys) {
+                    p90.insert(key);
+                }
+            });
+        }
+        report(prefix + "kth_percentile/insert", n, n * reps, insert);
+        report(prefix + "kth_percentile/get", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                do_not_optimize(p90.get());
+            }
+        }));
+    }
+
+    if (n <= 10'000'000) {
+        using Multiset = std::multiset<std::uint32_t, std::less<>, CountingStdAllocator<std::uint32_t>>;
+        double insert = 0;
+        for (std::size_t rep = 1; rep < reps; ++rep) {
+            Multiset multiset;
+            insert += seconds_to([&]() {
+                for (const std::uint32_t key : keys) {
+                    multiset.insert(key);
+                }
+            });
+        }
+        const std::size_t before = std_bytes_requested;
+        Multiset multiset;
+        insert += seconds_to([&]() {
+            for (const std::uint32_t key : keys) {
+                multiset.insert(key);
+            }
+        });
+        report(prefix + "multiset/insert", n, n * reps, insert);
+        report_bytes(prefix + "multiset/memory", n, std_bytes_requested - before);
+        report(prefix + "multiset/percentile", n, linear_queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < linear_queries; ++i) {
+                const std::size_t rank = std::min((i % 100 + 1) * n / 100, n - 1);
+                do_not_optimize(*std::next(multiset.begin(), rank));
+            }
+        }));
+        report(prefix + "multiset/rank", n, linear_queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < linear_queries; ++i) {
+                do_not_optimize(std::distance(multiset.begin(), multiset.lower_bound(query_key(i))));
+            }
+        }));
+        report(prefix + "multiset/equal_range", n, queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < queries; ++i) {
+                const auto [begin, end] = multiset.equal_range(query_key(i));
+                do_not_optimize(begin == end);
+            }
+        }));
+    }
+
+    {
+        std::vector<std::uint32_t> values = keys;
+        report(prefix + "nth_element/percentile", n, linear_queries, seconds_to([&]() {
+            for (std::size_t i = 0; i < linear_queries; ++i) {
+                const std::size_t rank = std::min((i % 100 + 1) * n / 100, n - 1);
+                std::nth_element(values.begin(), values.begin() + rank, values.end());
+                do_not_optimize(values[rank]);
+            }
+        }));
+    }
+}
+
+void bench_suite() {
+    for (const std::string_view distribution : {"uniform", "zipf", "duplicates", "sorted", "reverse"}) {
+        for (std::size_t n = 1'000; n <= 100'000'000 && n <= max_problem_size(); n *= 10) {
+            bench_suite(distribution, n);
+        }
+    }
+}
+
+// Report the memory use of trees of keys from each distribution, as given by
+// `Tree::stats`: the nodes, and the value arrays both as allocated and as
+// used. With `ORDER_STATISTICS_COUNTERS` defined, also report the work done
+// per insertion.
+void bench_stats() {
+    constexpr std::size_t n = 1'000'000;
+    for (const std::string_view distribution : {"uniform", "zipf", "duplicates", "sorted"}) {
+        const std::vector<std::uint32_t> keys = suite_keys(distribution, n);
+        const std::string prefix = "stats/" + std::string(distribution) + "/";
+        order_statistics::tree_counters() = order_statistics::TreeCounters{};
+        order_statistics::Tree<std::uint32_t> tree;
+        const double seconds = seconds_to([&]() {
+            for (const std::uint32_t key : keys) {
+                tree.insert(key);
+            }
+        });
+        report(prefix + "insert", n, n, seconds);
+        const order_statistics::TreeStats stats = tree.stats();
+        report_bytes(prefix + "nodes", n, stats.node_bytes);
+        report_bytes(prefix + "arrays_allocated", n, stats.array_bytes_allocated);
+        report_bytes(prefix + "arrays_used", n, stats.array_bytes_used);
+        if constexpr (order_statistics::counters_enabled) {
+            const order_statistics::TreeCounters& counters = order_statistics::tree_counters();
+            report_value(prefix + "rotations", n, double(counters.left_rotations + counters.right_rotations) / n, "per element");
+            report_value(prefix + "reallocations", n, double(counters.reallocations) / n, "per element");
+            report_value(prefix + "comparisons", n, double(counters.comparisons) / counters.descents, "per descent");
+        }
+    }
+}
+
+// Insert records keyed by strings too long for the small string
+// optimization, and look them up by `std::string_view`, with and without
+// `CacheKeys`. With one record per key, each record is in place in its node.
+// With several, the records are in `allocated` storage, and without a cached
+// key, each step of a descent follows one more pointer.
+template <typename Keys>
+void bench_keys(std::string_view name) {
+    using Record = std::pair<std::string, std::uint64_t>;
+    const auto by_id = [](const Record& record) -> const std::string& { return record.first; };
+    using Tree = order_statistics::Tree<Record, decltype(by_id), order_statistics::HeapAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, Keys>;
+    constexpr std::size_t n = 1'000'000;
+    for (const std::size_t copies : {1, 8}) {
+        const std::string prefix = std::string(name) + "/copies_" + std::to_string(copies) + "/";
+        std::mt19937_64 generator(copies);
+        std::vector<std::string> ids(n / copies);
+        for (std::string& id : ids) {
+            id = "order-" + std::to_string(generator()) + "-" + std::to_string(generator() % 1000);
+        }
+        Tree tree;
+        const double insert_seconds = seconds_to([&]() {
+            for (std::size_t i = 0; i < n; ++i) {
+                tree.insert(Record{ids[i % ids.size()], i});
+            }
+        });
+        report(prefix + "insert", n, n, insert_seconds);
+
+        std::shuffle(ids.begin(), ids.end(), generator);
+        std::size_t total = 0;
+        const double rank_seconds = seconds_to([&]() {
+            for (std::size_t i = 0; i < n; ++i) {
+                total += tree.rank_of_key(std::string_view(ids[i % ids.size()]));
+            }
+        });
+        do_not_optimize(total);
+        report(prefix + "rank_of_key", n, n, rank_seconds);
+        report_bytes(prefix + "nodes", n, tree.stats().node_bytes);
+    }
+}
+
+// A less comparator that `Tree` can't treat as three-way, so that each step
+// of a descent takes two calls, as it did before three-way comparison.
+struct OnlyLess {
+    template <typename Left, typename Right>
+    bool operator()(const Left& left, const Right& right) const {
+        return left < right;
+    }
+};
+
+// Insert `keys` into a tree that compares them with `Compare`, and then find
+// the rank of each. Return the seconds taken by each part. Each tree has its
+// own arena, so that the layout of its nodes doesn't depend on what the heap
+// looked like after the previous run.
+template <typename Key, typename Compare>
+std::pair<double, double> time_compare(const std::vector<Key>& keys) {
+    using Tree = order_statistics::Tree<Key, std::identity, order_statistics::ArenaAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, order_statistics::ComputeKeys, Compare>;
+    Tree tree;
+    const double insert_seconds = seconds_to([&]() {
+        for (const Key& key : keys) {
+            tree.insert(key);
+        }
+    });
+    std::size_t total = 0;
+    const double rank_seconds = seconds_to([&]() {
+        for (const Key& key : keys) {
+            total += tree.rank_of_key(key);
+        }
+    });
+    do_not_optimize(total);
+    return {insert_seconds, rank_seconds};
+}
+
+// Compare `OnlyLess` with `std::less<>`, which uses `operator<=>`. Whichever
+// runs second tends to be slower, so run them in the order ABBA and report
+// the averages.
+template <typename Key>
+void bench_compare(const std::string& name, const std::vector<Key>& keys) {
+    const std::size_t n = keys.size();
+    const auto less_first = time_compare<Key, OnlyLess>(keys);
+    const auto three_way_first = time_compare<Key, std::less<>>(keys);
+    const auto three_way_second = time_compare<Key, std::less<>>(keys);
+    const auto less_second = time_compare<Key, OnlyLess>(keys);
+    report(name + "/less/insert", n, 2 * n, less_first.first + less_second.first);
+    report(name + "/less/rank_of_key", n, 2 * n, less_first.second + less_second.second);
+    report(name + "/three_way/insert", n, 2 * n, three_way_first.first + three_way_second.first);
+    report(name + "/three_way/rank_of_key", n, 2 * n, three_way_first.second + three_way_second.second);
+}
+
+void bench_compare() {
+    constexpr std::size_t n = 1'000'000;
+    std::mt19937_64 generator(n);
+    // Strings sharing a long prefix, as identifiers often do, so that
+    // comparing two of them takes more than a glance at the first byte.
+    std::vector<std::string> strings(n);
+    for (std::string& string : strings) {
+        string = "customer/" + std::to_string(generator() % (n / 4));
+    }
+    bench_compare("compare/string", strings);
+    // The same, but too long for the small string optimization, so that
+    // each comparison follows a pointer out of the node.
+    for (std::string& string : strings) {
+        string.insert(0, "region/eu-west/");
+    }
+    bench_compare("compare/long_string", strings);
+
+    // Pairs whose first members are often equal, so that comparing two of
+    // them often compares the second members too.
+    using Pair = std::pair<std::uint32_t, std::uint32_t>;
+    std::vector<Pair> pairs(n);
+    for (Pair& pair : pairs) {
+        pair = Pair(generator() % 1000, generator() % 1000);
+    }
+    bench_compare("compare/pair", pairs);
+}
+
+// Insert `keys` into a `Tree` that uses `Versions`, taking a snapshot every
+// `period` insertions (never, if zero) and keeping it until the next, as a
+// reporting thread would. Return the seconds taken.
+template <typename Versions>
+double time_persistent(const std::vector<std::uint64_t>& keys, std::size_t period) {
+    using Tree = order_statistics::Tree<std::uint64_t, std::identity, order_statistics::HeapAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, order_statistics::ComputeKeys, std::less<>,
+        Versions>;
+    Tree tree;
+    std::optional<Tree> snapshot;
+    return seconds_to([&]() {
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            if constexpr (std::is_same_v<Versions, order_statistics::Persistent>) {
+                if (period && i % period == 0) {
+                    snapshot.reset();
+                    snapshot.emplace(order_statistics::snapshot_of, tree);
+                }
+            }
+            tree.insert(keys[i]);
+        }
+        do_not_optimize(tree.size());
+    });
+}
+
+void bench_persistent() {
+    constexpr std::size_t n = 1'000'000;
+    constexpr std::size_t period = 1000;
+    std::mt19937_64 generator(n);
+    std::vector<std::uint64_t> keys(n);
+    for (std::uint64_t& key : keys) {
+        key = generator();
+    }
+    // Each variant runs twice, in mirrored order, so that none benefits from
+    // coming after the others have warmed up the heap.
+    double ephemeral = time_persistent<order_statistics::Ephemeral>(keys, 0);
+    double persistent = time_persistent<order_statistics::Persistent>(keys, 0);
+    double snapshots = time_persistent<order_statistics::Persistent>(keys, period);
+    snapshots += time_persistent<order_statistics::Persistent>(keys, period);
+    persistent += time_persistent<order_statistics::Persistent>(keys, 0);
+    ephemeral += time_persistent<order_statistics::Ephemeral>(keys, 0);
+    report("persistent/ephemeral/insert", n, 2 * n, ephemeral);
+    report("persistent/no_snapshot/insert", n, 2 * n, persistent);
+    report("persistent/snapshot_per_1000/insert", n, 2 * n, snapshots);
+}
+
+int main(int argc, char *argv[]) {
+    // If an argument is specified, run only the benchmarks whose names
+    // contain it.
+    const std::string_view filter = argc > 1 ? argv[1] : "";
+    const auto selected = [&](std::string_view name) {
+        return name.find(filter) != std::string_view::npos;
+    };
+
+    if (selected("sliding_window")) {
+        bench_sliding_window();
+    }
+    if (selected("tree/")) {
+        bench_tree();
+    }
+    if (selected("btree/")) {
+        bench_btree();
+    }
+    if (selected("simd/int32")) {
+        bench_simd<std::int32_t>("simd/int32");
+    }
+    if (selected("simd/int64")) {
+        bench_simd<std::int64_t>("simd/int64");
+    }
+    if (selected("simd/float")) {
+        bench_simd<float>("simd/float");
+    }
+    if (selected("simd/double")) {
+        bench_simd<double>("simd/double");
+    }
+    if (selected("assign/")) {
+        bench_assign();
+    }
+    if (selected("kth_percentile/")) {
+        bench_kth_percentile_batch();
+    }
+    if (selected("multi_percentile/")) {
+        bench_multi_percentile();
+    }
+    if (selected("batch/")) {
+        bench_insert_batch();
+    }
+    if (selected("merge/")) {
+        bench_merge();
+    }
+    if (selected("sharded/")) {
+        bench_sharded_recorder();
+    }
+    if (selected("range/")) {
+        bench_range();
+    }
+    if (selected("sum_by_rank/")) {
+        bench_sum_by_rank();
+    }
+    if (selected("tracked/")) {
+        bench_tracked_percentile();
+    }
+    if (selected("layout/heap")) {
+        bench_layout<order_statistics::HeapAllocator>("layout/heap");
+    }
+    if (selected("layout/arena")) {
+        bench_layout<order_statistics::ArenaAllocator>("layout/arena");
+    }
+    if (selected("counted/")) {
+        bench_counted();
+    }
+    if (selected("snapshot/")) {
+        bench_snapshot();
+    }
+    if (selected("keys/computed")) {
+        bench_keys<order_statistics::ComputeKeys>("keys/computed");
+    }
+    if (selected("keys/cached")) {
+        bench_keys<order_statistics::CacheKeys>("keys/cached");
+    }
+    if (selected("compare/")) {
+        bench_compare();
+    }
+    if (selected("persistent/")) {
+        bench_persistent();
+    }
+    if (selected("stats/")) {
+        bench_stats();
+    }
+    if (selected("suite/")) {
+        bench_suite();
+    }
+    if (selected("sketch/")) {
+        bench_sketch();
+    }
+    if (selected("allocator/heap")) {
+        bench_allocator<order_statistics::HeapAllocator>("allocator/heap");
+    }
+    if (selected("allocator/arena")) {
+        bench_allocator<order_statistics::ArenaAllocator>("allocator/arena");
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+// Prevent the compiler from optimizing away the computation of `value`.
+template <typename Value>
+void do_not_optimize(const Value& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Return the number of seconds it takes to call `func()`.
+template <typename Func>
+double seconds_to(Func&& func) {
+    const auto before = std::chrono::steady_clock::now();
+    func();
+    const auto after = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(after - before).count();
+}
+
+// Return the largest problem size that benchmarks should attempt, which is
+// the value of the `BENCH_MAX_N` environment variable, if set. Benchmarks
+// of hundreds of millions of elements need more memory than many machines
+// have.
+inline std::size_t max_problem_size() {
+    const char *const value = std::getenv("BENCH_MAX_N");
+    return value ? std::strtoull(value, nullptr, 10) : 100'000'000;
+}
+
+// Benchmark results are printed one per line, as four tab-separated fields:
+// the benchmark's name, the problem size, the measured value, and its unit
+// (such as `ns/op` or `bytes/element`), so that results from different
+// releases can be compared by script.
+
+// Print the specified `value`, measured in `unit`, for a problem of size `n`.
+inline void report_value(std::string_view name, std::size_t n, double value, std::string_view unit) {
+    std::cout << name << '\t' << n << '\t' << value << '\t' << unit << std::endl;
+}
+
+// Print the average duration of one of `ops` operations, on a problem of
+// size `n`, that took a total of `seconds`.
+inline void report(std::string_view name, std::size_t n, std::size_t ops, double seconds) {
+    std::cout << name << '\t' << n << '\t' << seconds * 1e9 / ops << "\tns/op" << std::endl;
+}
+
+// Print the average number of `bytes` used per element, for `n` elements.
+inline void report_bytes(std::string_view name, std::size_t n, std::size_t bytes) {
+    std::cout << name << '\t' << n << '\t' << double(bytes) / n << "\tbytes/element" << std::endl;
+}
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "simd.h"
+
+namespace order_statistics {
+
+// `BTree` is an order statistic B+tree having the same interface as `Tree`.
+// Each node holds up to `Fanout` keys or children in contiguous arrays, along
+// with the number of elements under each child, so that a descent touches
+// `log_Fanout(n)` nodes instead of `log_2(n)`, and each step scans a small
+// array instead of chasing a pointer.
+//
+// Elements having the same key are stored together in one array in a leaf,
+// in order of insertion.
+//
+// Searching within a node uses the kernels in `simd.h`, which are vectorized
+// for arithmetic keys when the target supports it.
+//
+// `insert` provides the strong exception guarantee, provided that copying and
+// moving keys doesn't throw.
+template <typename T, typename GetKey = std::identity, std::size_t Fanout = 16>
+class BTree {
+    static_assert(Fanout >= 4 && Fanout % 2 == 0);
+
+    using Key = std::remove_cvref_t<std::invoke_result_t<GetKey, const T&>>;
+
+    struct Node {
+        // The number of keys in a leaf, or the number of children of an
+        // internal node.
+        std::size_t count = 0;
+    };
+
+    struct Leaf : Node {
+        Key keys[Fanout];
+        // `sizes[i] == values[i].size()`, but contiguous.
+        std::uint64_t sizes[Fanout];
+        std::vector<T> values[Fanout];
+    };
+
+    struct Internal : Node {
+        // `keys[i]` is the smallest key in the subtree `children[i + 1]`.
+        Key keys[Fanout - 1];
+        // `weights[i]` is the number of elements in the subtree `children[i]`.
+        std::uint64_t weights[Fanout];
+        Node *children[Fanout];
+    };
+
+    // Every node but the root has at least `Fanout / 2` children, so this is
+    // more levels than any tree that fits in memory.
+    static constexpr std::size_t max_height = 64;
+
+    Node *root;
+    // The number of levels in the tree. Leaves are at height 1. An empty tree
+    // has height zero.
+    std::size_t height;
+
+ public:
+    BTree();
+    ~BTree();
+
+    BTree(const BTree&) = delete;
+    BTree(BTree&&) = delete;
+    BTree& operator=(const BTree&) = delete;
+    BTree& operator=(BTree&&) = delete;
+
+    // Add the specified value to the tree.
+    void insert(const T&);
+    void insert(T&&);
+
+    // Remove all values from the tree.
+    void clear();
+
+    std::size_t size() const;
+    bool empty() const;
+
+    // These have the same meaning as in `Tree`.
+    const T& nth_element(std::size_t rank) const;
+    std::span<const T> nth_elements(std::size_t rank) const;
+    std::span<const T> percentile(std::size_t percent) const;
+    std::pair<std::size_t, std::size_t> rank(const T& value) const;
+    std::span<const T> equal_range(const T& value) const;
+
+ private:
+    template <typename U>
+    void generic_insert(U&& value);
+
+    // Move the upper half of `node`'s contents into the specified empty
+    // `sibling`.
+    static void split(Leaf *node, Leaf *sibling);
+    // Move the upper half of `node`'s children into the specified empty
+    // `sibling`. Store in `split_key` the key that separated the halves.
+    static void split(Internal *node, Internal *sibling, Key& split_key);
+
+    // Return the number of elements in the subtree rooted at `node`.
+    static std::uint64_t weight(const Node *node, std::size_t height);
+
+    // Return the index of the child of `node` whose subtree would contain
+    // `key`.
+    static std::size_t child_index(const Internal *node, const Key& key);
+    // Return the index of the first key in `node` that is not less than
+    // `key`.
+    static std::size_t key_index(const Leaf *node, const Key& key);
+
+    static void dispose(Node *node, std::size_t height);
+
+    std::pair<std::span<const T>, std::size_t> get(std::size_t rank) const;
+    const Leaf *find_leaf(const Key& key, std::size_t& weight_behind) const;
+};
+
+template <typename T, typename GetKey, std::size_t Fanout>
+BTree<T, GetKey, Fanout>::BTree()
+: root(nullptr)
+, height(0) {}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+BTree<T, GetKey, Fanout>::~BTree() {
+    clear();
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::dispose(Node *node, std::size_t height) {
+    if (height == 1) {
+        delete static_cast<Leaf*>(node);
+        return;
+    }
+    Internal *const internal = static_cast<Internal*>(node);
+    for (std::size_t i = 0; i < internal->count; ++i) {
+        dispose(internal->children[i], height - 1);
+    }
+    delete internal;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::clear() {
+    if (root) {
+        dispose(root, height);
+        root = nullptr;
+        height = 0;
+    }
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::uint64_t BTree<T, GetKey, Fanout>::weight(const Node *node, std::size_t height) {
+    if (height == 1) {
+        const Leaf *const leaf = static_cast<const Leaf*>(node);
+        return std::reduce(leaf->sizes, leaf->sizes + leaf->count, std::uint64_t(0));
+    }
+    const Internal *const internal = static_cast<const Internal*>(node);
+    return std::reduce(internal->weights, internal->weights + internal->count, std::uint64_t(0));
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::size_t BTree<T, GetKey, Fanout>::size() const {
+    return root ? weight(root, height) : 0;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+bool BTree<T, GetKey, Fanout>::empty() const {
+    return root == nullptr;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::insert(const T& value) {
+    generic_insert(value);
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::insert(T&& value) {
+    generic_insert(std::move(value));
+}
+
+// In order to provide the strong exception guarantee, `generic_insert`
+// allocates every node that the insertion could need before it modifies the
+// tree.
+template <typename T, typename GetKey, std::size_t Fanout>
+template <typename U>
+void BTree<T, GetKey, Fanout>::generic_insert(U&& value) {
+    const Key key = GetKey()(value);
+    if (!root) {
+        std::unique_ptr<Leaf> leaf(new Leaf);
+        leaf->values[0].push_back(std::forward<U>(value));
+        leaf->keys[0] = key;
+        leaf->sizes[0] = 1;
+        leaf->count = 1;
+        root = leaf.release();
+        height = 1;
+        return;
+    }
+
+    // Descend to the leaf, remembering the path. `path[d]` is at depth `d`,
+    // and its child `indices[d]` is the next node on the path.
+    Internal *path[max_height];
+    std::size_t indices[max_height];
+    const std::size_t depth = height - 1;
+    Node *node = root;
+    for (std::size_t d = 0; d < depth; ++d) {
+        Internal *const internal = static_cast<Internal*>(node);
+        path[d] = internal;
+        indices[d] = child_index(internal, key);
+        node = internal->children[indices[d]];
+    }
+    Leaf *leaf = static_cast<Leaf*>(node);
+    std::size_t i = key_index(leaf, key);
+    if (i < leaf->count && !(key < leaf->keys[i])) {
+        // There are already elements having `key`.
+        leaf->values[i].push_back(std::forward<U>(value));
+        ++leaf->sizes[i];
+        for (std::size_t d = 0; d < depth; ++d) {
+            ++path[d]->weights[indices[d]];
+        }
+        return;
+    }
+
+    std::vector<T> values;
+    values.push_back(std::forward<U>(value));
+    // A full leaf splits, and then so does each full ancestor above it, up to
+    // the first that isn't full. If they're all full, the tree grows a level.
+    // `spares[s]` is the sibling of `path[depth - 1 - s]`, and `spares[depth]`
+    // is the new root.
+    std::unique_ptr<Leaf> spare_leaf;
+    std::unique_ptr<Internal> spares[max_height];
+    if (leaf->count == Fanout) {
+        spare_leaf.reset(new Leaf);
+        std::size_t s = 0;
+        while (s < depth && path[depth - 1 - s]->count == Fanout) {
+            spares[s++].reset(new Internal);
+        }
+        if (s == depth) {
+            spares[s].reset(new Internal);
+        }
+    }
+
+    // Nothing below allocates.
+    Node *new_child = nullptr;
+    Key split_key{};
+    if (spare_leaf) {
+        Leaf *const sibling = spare_leaf.release();
+        split(leaf, sibling);
+        split_key = sibling->keys[0];
+        new_child = sibling;
+        if (i > leaf->count) {
+            i -= leaf->count;
+            leaf = sibling;
+        }
+    }
+    std::move_backward(leaf->keys + i, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->sizes + i, leaf->sizes + leaf->count, leaf->sizes + leaf->count + 1);
+    std::move_backward(leaf->values + i, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+    leaf->keys[i] = key;
+    leaf->sizes[i] = 1;
+    leaf->values[i] = std::move(values);
+    ++leaf->count;
+
+    for (std::size_t d = depth; d-- > 0;) {
+        Internal *internal = path[d];
+        std::size_t j = indices[d];
+        if (!new_child) {
+            ++internal->weights[j];
+            continue;
+        }
+
+        // `children[j]` split. Its new sibling goes immediately to its right.
+        const std::uint64_t old_weight = internal->weights[j] + 1;
+        const std::uint64_t new_weight = weight(new_child, height - d - 1);
+        Internal *sibling = nullptr;
+        Key parent_split_key{};
+        if (internal->count == Fanout) {
+            sibling = spares[depth - 1 - d].release();
+            split(internal, sibling, parent_split_key);
+            if (j >= internal->count) {
+                j -= internal->count;
+                internal = sibling;
+            }
+        }
+        const std::size_t count = internal->count;
+        std::move_backward(internal->keys + j, internal->keys + count - 1, internal->keys + count);
+        std::move_backward(internal->weights + j + 1, internal->weights + count, internal->weights + count + 1);
+        std::move_backward(internal->children + j + 1, internal->children + count, internal->children + count + 1);
+        internal->keys[j] = std::move(split_key);
+        internal->weights[j] = old_weight - new_weight;
+        internal->weights[j + 1] = new_weight;
+        internal->children[j + 1] = new_child;
+        ++internal->count;
+        new_child = sibling;
+        split_key = std::move(parent_split_key);
+    }
+    if (!new_child) {
+        return;
+    }
+
+    // The root split, so the tree grows a level.
+    Internal *const new_root = spares[depth].release();
+    new_root->count = 2;
+    new_root->keys[0] = std::move(split_key);
+    new_root->children[0] = root;
+    new_root->children[1] = new_child;
+    new_root->weights[0] = weight(root, height);
+    new_root->weights[1] = weight(new_child, height);
+    root = new_root;
+    ++height;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::split(Leaf *node, Leaf *sibling) {
+    assert(node->count == Fanout);
+    constexpr std::size_t half = Fanout / 2;
+    std::move(node->keys + half, node->keys + Fanout, sibling->keys);
+    std::move(node->sizes + half, node->sizes + Fanout, sibling->sizes);
+    std::move(node->values + half, node->values + Fanout, sibling->values);
+    sibling->count = Fanout - half;
+    node->count = half;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+void BTree<T, GetKey, Fanout>::split(Internal *node, Internal *sibling, Key& split_key) {
+    assert(node->count == Fanout);
+    constexpr std::size_t half = Fanout / 2;
+    split_key = std::move(node->keys[half - 1]);
+    std::move(node->keys + half, node->keys + Fanout - 1, sibling->keys);
+    std::move(node->weights + half, node->weights + Fanout, sibling->weights);
+    std::move(node->children + half, node->children + Fanout, sibling->children);
+    sibling->count = Fanout - half;
+    node->count = half;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::size_t BTree<T, GetKey, Fanout>::child_index(const Internal *node, const Key& key) {
+    return detail::count_below<true>(node->keys, node->count - 1, key);
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::size_t BTree<T, GetKey, Fanout>::key_index(const Leaf *node, const Key& key) {
+    return detail::count_below<false>(node->keys, node->count, key);
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::pair<std::span<const T>, std::size_t> BTree<T, GetKey, Fanout>::get(std::size_t rank) const {
+    assert(rank < size());
+    std::uint64_t remaining = rank;
+    const Node *node = root;
+    for (std::size_t level = height; level > 1; --level) {
+        const Internal *const internal = static_cast<const Internal*>(node);
+        node = internal->children[detail::find_by_weight(internal->weights, internal->count, remaining)];
+    }
+    const Leaf *const leaf = static_cast<const Leaf*>(node);
+    const std::size_t i = detail::find_by_weight(leaf->sizes, leaf->count, remaining);
+    return {leaf->values[i], remaining};
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+const typename BTree<T, GetKey, Fanout>::Leaf *BTree<T, GetKey, Fanout>::find_leaf(
+        const Key& key, std::size_t& weight_behind) const {
+    const Node *node = root;
+    for (std::size_t level = height; level > 1; --level) {
+        const Internal *const internal = static_cast<const Internal*>(node);
+        const std::size_t i = child_index(internal, key);
+        weight_behind += std::reduce(internal->weights, internal->weights + i, std::uint64_t(0));
+        node = internal->children[i];
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+const T& BTree<T, GetKey, Fanout>::nth_element(std::size_t rank) const {
+    const auto [values, offset] = get(rank);
+    return values[offset];
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::span<const T> BTree<T, GetKey, Fanout>::nth_elements(std::size_t rank) const {
+    const auto [values, _] = get(rank);
+    return values;
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::span<const T> BTree<T, GetKey, Fanout>::percentile(std::size_t percent) const {
+    const std::size_t rank = std::min(percent * size() / 100, size() - 1);
+    return nth_elements(rank);
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::pair<std::size_t, std::size_t> BTree<T, GetKey, Fanout>::rank(const T& value) const {
+    assert(root);
+    const Key key = GetKey()(value);
+    std::size_t weight_behind = 0;
+    const Leaf *const leaf = find_leaf(key, weight_behind);
+    const std::size_t i = key_index(leaf, key);
+    assert(i < leaf->count && !(key < leaf->keys[i]));
+    weight_behind += std::reduce(leaf->sizes, leaf->sizes + i, std::uint64_t(0));
+    return {weight_behind, weight_behind + leaf->sizes[i] - 1};
+}
+
+template <typename T, typename GetKey, std::size_t Fanout>
+std::span<const T> BTree<T, GetKey, Fanout>::equal_range(const T& value) const {
+    if (!root) {
+        return {};
+    }
+    const Key key = GetKey()(value);
+    std::size_t weight_behind = 0;
+    const Leaf *const leaf = find_leaf(key, weight_behind);
+    const std::size_t i = key_index(leaf, key);
+    if (i < leaf->count && !(key < leaf->keys[i])) {
+        return leaf->values[i];
+    }
+    return {};
+}
+
+} // namespace order_statistics
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <type_traits>
+
+namespace order_statistics {
+
+// A comparator, as used by `Tree` and `KthPercentile` to order keys, is a
+// default constructible function object of one of two kinds:
+//
+// - A "less" comparator, such as `std::less<>`, returns whether its first
+//   argument is ordered before its second, as a `bool`.
+// - A three-way comparator, such as `std::compare_three_way`, returns a
+//   `std::strong_ordering`, `std::weak_ordering` or `std::partial_ordering`
+//   of its first argument relative to its second.
+//
+// Finding whether two keys are equivalent takes two calls to a less
+// comparator, but one call to a three-way comparator. `std::less` is treated
+// as a three-way comparator when the keys have `operator<=>`, which is
+// assumed to order them the same way as `operator<`.
+
+namespace detail {
+
+template <typename Compare>
+inline constexpr bool is_std_less = false;
+
+template <typename T>
+inline constexpr bool is_std_less<std::less<T>> = true;
+
+template <>
+inline constexpr bool is_std_less<std::ranges::less> = true;
+
+template <typename Compare, typename Left, typename Right>
+concept ThreeWayComparator = std::invocable<const Compare&, const Left&, const Right&> &&
+    std::is_convertible_v<std::invoke_result_t<const Compare&, const Left&, const Right&>, std::partial_ordering>;
+
+// Whether `compare<Compare>(left, right)` takes one comparison, rather than
+// as many as two.
+template <typename Compare, typename Left, typename Right>
+concept SingleComparison = ThreeWayComparator<Compare, Left, Right> ||
+    (is_std_less<Compare> && std::three_way_comparable_with<Left, Right>);
+
+// Return whether the specified `left` is ordered before the specified
+// `right` by `Compare`.
+template <typename Compare, typename Left, typename Right>
+bool less(const Left& left, const Right& right) {
+    if constexpr (ThreeWayComparator<Compare, Left, Right>) {
+        return Compare()(left, right) < 0;
+    } else {
+        return Compare()(left, right);
+    }
+}
+
+// Return the ordering of the specified `left` relative to the specified
+// `right` by `Compare`, as whichever of the standard ordering types is
+// natural to it, so that testing it is as cheap as possible. Keys that
+// `Compare` doesn't order either way are equivalent.
+template <typename Compare, typename Left, typename Right>
+auto compare(const Left& left, const Right& right) {
+    if constexpr (ThreeWayComparator<Compare, Left, Right>) {
+        return Compare()(left, right);
+    } else if constexpr (SingleComparison<Compare, Left, Right>) {
+        return left <=> right;
+    } else if (Compare()(left, right)) {
+        return std::weak_ordering::less;
+    } else if (Compare()(right, left)) {
+        return std::weak_ordering::greater;
+    } else {
+        return std::weak_ordering::equivalent;
+    }
+}
+
+} // namespace detail
+} // namespace order_statistics
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace order_statistics {
+
+// `KllSketch` estimates order statistics of a stream in bounded memory, using
+// the KLL sketch of Karnin, Lang and Liberty ("Optimal Quantile Approximation
+// in Streams", 2016). Its query functions mirror those of `Tree`, but return
+// approximate answers.
+//
+// The sketch is a stack of "compactors." Level `h` holds elements that each
+// stand for `2**h` elements of the stream. When the sketch is full, the
+// lowest level that is over its capacity is sorted, and every other element
+// of it (starting from a randomly chosen one of the first two) is promoted to
+// the next level, while the rest are discarded. Capacities shrink
+// geometrically, by a factor of 2/3, from `k` at the top level down, so the
+// sketch retains O(k log(n/k)) elements in total, of which only about `3k`
+// are in the lower levels.
+//
+// Error bound: each answer's rank differs from the exact rank by at most
+// `epsilon * n`, where `n` is `size()`, with probability at least
+// `1 - delta` for `epsilon = O(sqrt(log(1/delta)) / k)`. Empirically, the
+// worst rank error over all percentiles of a stream is within `2.5 * n / k`
+// for 99% of streams (see `normalized_rank_error`); with the default
+// `k = 200`, that's 1.25% of `n`, and the typical worst error is about half
+// of that. The error doesn't depend on the distribution of the keys, only on
+// `k`, on chance, and weakly on `n`.
+template <typename T, typename GetKey = std::identity>
+class KllSketch {
+ public:
+    static constexpr std::size_t default_k = 200;
+
+ private:
+    // `levels[h]` contains elements each having weight `2**h`. Levels are
+    // sorted only while they are being compacted.
+    std::vector<std::vector<T>> levels;
+    std::size_t k;
+    std::size_t count;
+    // The number of elements in all levels, and the number that triggers a
+    // compaction.
+    std::size_t retained_count;
+    std::size_t max_retained;
+    // State for the coin flips that choose which elements survive.
+    std::uint64_t random;
+
+    // All retained elements in key order, each paired with the total weight
+    // of the elements up to and including it. Queries build this on demand,
+    // and insertions discard it.
+    mutable std::vector<std::pair<const T*, std::uint64_t>> sorted;
+
+ public:
+    // Create an empty sketch whose accuracy parameter is the specified `k`,
+    // which is at least 8. Memory use and error are proportional to `k` and
+    // `1/k`, respectively. The specified `seed` determines which elements
+    // survive compactions.
+    explicit KllSketch(std::size_t k = default_k, std::uint64_t seed = 0x9e3779b97f4a7c15);
+
+    // Copies start with an empty query cache, because `sorted` points into
+    // the elements of the original's `levels`.
+    KllSketch(const KllSketch&);
+    KllSketch(KllSketch&&) = default;
+    KllSketch& operator=(const KllSketch&);
+    KllSketch& operator=(KllSketch&&) = default;
+
+    // Add the specified value to the sketch.
+    void insert(const T&);
+    void insert(T&&);
+
+    // Return the number of elements inserted into the sketch.
+    std::size_t size() const;
+    bool empty() const;
+
+    // Return the number of elements that the sketch is storing.
+    std::size_t retained() const;
+
+    // Return the approximate `n`th element, in the sense of
+    // `Tree::nth_element`. `rank` is between 0 and `size() - 1`, inclusive.
+    // The behavior is undefined if the sketch is empty.
+    const T& nth_element(std::size_t rank) const;
+
+    // Return a span containing one element whose key is approximately in the
+    // specified percentile, in the sense of `Tree::percentile`. `percent` is
+    // between 1 and 100, inclusive. The behavior is undefined if the sketch
+    // is empty.
+    std::span<const T> percentile(std::size_t percent) const;
+
+    // Return the approximate `{min, max}` of possible zero-based positions of
+    // the `value` in `GetKey`-order sequence, in the sense of `Tree::rank`.
+    // Unlike `Tree::rank`, `value` need not be in the sketch. If no retained
+    // element has its key, then both are the approximate number of elements
+    // whose keys are less.
+    std::pair<std::size_t, std::size_t> rank(const T& value) const;
+
+    // Return an empirical bound on the normalized rank error, `epsilon`, for
+    // a sketch having the specified `k`: the rank errors of 99% of sketches
+    // are within `epsilon * size()`.
+    static double normalized_rank_error(std::size_t k);
+
+ private:
+    template <typename U>
+    void generic_insert(U&& value);
+
+    // Return the capacity of level `h` when there are `levels.size()` levels.
+    std::size_t capacity(std::size_t h) const;
+
+    // Compact the lowest level that is over its capacity, adding a level if
+    // it's the top one.
+    void compress();
+
+    bool coin_flip();
+
+    // Fill `sorted`, if it isn't already.
+    void prepare_queries() const;
+};
+
+template <typename T, typename GetKey>
+KllSketch<T, GetKey>::KllSketch(std::size_t k, std::uint64_t seed)
+: levels(1)
+, k(k)
+, count(0)
+, retained_count(0)
+, max_retained(0)
+, random(seed | 1) {
+    assert(k >= 8);
+    max_retained = capacity(0);
+}
+
+template <typename T, typename GetKey>
+KllSketch<T, GetKey>::KllSketch(const KllSketch& other)
+: levels(other.levels)
+, k(other.k)
+, count(other.count)
+, retained_count(other.retained_count)
+, max_retained(other.max_retained)
+, random(other.random) {
+}
+
+template <typename T, typename GetKey>
+KllSketch<T, GetKey>& KllSketch<T, GetKey>::operator=(const KllSketch& other) {
+    if (this != &other) {
+        levels = other.levels;
+        k = other.k;
+        count = other.count;
+        retained_count = other.retained_count;
+        max_retained = other.max_retained;
+        random = other.random;
+        sorted.clear();
+    }
+    return *this;
+}
+
+template <typename T, typename GetKey>
+void KllSketch<T, GetKey>::insert(const T& value) {
+    generic_insert(value);
+}
+
+template <typename T, typename GetKey>
+void KllSketch<T, GetKey>::insert(T&& value) {
+    generic_insert(std::move(value));
+}
+
+template <typename T, typename GetKey>
+template <typename U>
+void KllSketch<T, GetKey>::generic_insert(U&& value) {
+    sorted.clear();
+    levels[0].push_back(std::forward<U>(value));
+    ++count;
+    if (++retained_count >= max_retained) {
+        compress();
+    }
+}
+
+template <typename T, typename GetKey>
+std::size_t KllSketch<T, GetKey>::capacity(std::size_t h) const {
+    const std::size_t depth = levels.size() - h - 1;
+    return std::size_t(std::ceil(std::pow(2.0 / 3.0, double(depth)) * double(k))) + 1;
+}
+
+template <typename T, typename GetKey>
+void KllSketch<T, GetKey>::compress() {
+    for (std::size_t h = 0; h < levels.size(); ++h) {
+        if (levels[h].size() < capacity(h)) {
+            continue;
+        }
+        if (h + 1 == levels.size()) {
+            levels.emplace_back();
+            max_retained = 0;
+            for (std::size_t i = 0; i < levels.size(); ++i) {
+                max_retained += capacity(i);
+            }
+        }
+        std::vector<T>& level = levels[h];
+        std::vector<T>& above = levels[h + 1];
+        std::sort(level.begin(), level.end(), [](const T& left, const T& right) {
+            return GetKey()(left) < GetKey()(right);
+        });
+        // If there's an odd number of elements, then the last one stays
+        // behind.
+        const std::size_t paired = level.size() & ~std::size_t(1);
+        for (std::size_t i = coin_flip(); i < paired; i += 2) {
+            above.push_back(std::move(level[i]));
+        }
+        if (paired != level.size()) {
+            level[0] = std::move(level.back());
+        }
+        level.resize(level.size() - paired);
+        retained_count -= paired / 2;
+        return;
+    }
+}
+
+template <typename T, typename GetKey>
+bool KllSketch<T, GetKey>::coin_flip() {
+    // xorshift64
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    return random >> 63;
+}
+
+template <typename T, typename GetKey>
+std::size_t KllSketch<T, GetKey>::size() const {
+    return count;
+}
+
+template <typename T, typename GetKey>
+bool KllSketch<T, GetKey>::empty() const {
+    return count == 0;
+}
+
+template <typename T, typename GetKey>
+std::size_t KllSketch<T, GetKey>::retained() const {
+    return retained_count;
+}
+
+template <typename T, typename GetKey>
+void KllSketch<T, GetKey>::prepare_queries() const {
+    if (!sorted.empty() || !count) {
+        return;
+    }
+    sorted.reserve(retained_count);
+    for (std::size_t h = 0; h < levels.size(); ++h) {
+        for (const T& value : levels[h]) {
+            sorted.emplace_back(&value, std::uint64_t(1) << h);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto& left, const auto& right) {
+        return GetKey()(*left.first) < GetKey()(*right.first);
+    });
+    std::uint64_t total = 0;
+    for (auto& [value, weight] : sorted) {
+        total += weight;
+        weight = total;
+    }
+}
+
+template <typename T, typename GetKey>
+const T& KllSketch<T, GetKey>::nth_element(std::size_t rank) const {
+    assert(count);
+    prepare_queries();
+    // Compaction trades two elements of weight `w` for one of weight `2w`, so
+    // the weights always total `count`, and some entry's cumulative weight
+    // exceeds `rank`.
+    const auto found = std::upper_bound(sorted.begin(), sorted.end(), std::uint64_t(rank),
+        [](std::uint64_t rank, const auto& entry) { return rank < entry.second; });
+    assert(found != sorted.end());
+    return *found->first;
+}
+
+template <typename T, typename GetKey>
+std::span<const T> KllSketch<T, GetKey>::percentile(std::size_t percent) const {
+    const std::size_t rank = std::min(percent * size() / 100, size() - 1);
+    return std::span<const T>(&nth_element(rank), 1);
+}
+
+template <typename T, typename GetKey>
+std::pair<std::size_t, std::size_t> KllSketch<T, GetKey>::rank(const T& value) const {
+    if (!count) {
+        return {0, 0};
+    }
+    prepare_queries();
+    const auto& key = GetKey()(value);
+    const auto less = std::partition_point(sorted.begin(), sorted.end(),
+        [&](const auto& entry) { return GetKey()(*entry.first) < key; });
+    const auto not_greater = std::partition_point(less, sorted.end(),
+        [&](const auto& entry) { return !(key < GetKey()(*entry.first)); });
+    const auto weight_before = [&](auto iter) -> std::uint64_t {
+        return iter == sorted.begin() ? 0 : std::prev(iter)->second;
+    };
+    const std::size_t min = weight_before(less);
+    const std::size_t max = weight_before(not_greater);
+    return {min, max == min ? min : max - 1};
+}
+
+template <typename T, typename GetKey>
+double KllSketch<T, GetKey>::normalized_rank_error(std::size_t k) {
+    // Measured as the 99th percentile, over many random streams of up to 10
+    // million elements, of the worst rank error among the percentiles 1
+    // through 100, and then rounded up.
+    return 2.5 / double(k);
+}
+
+} // namespace order_statistics
@@ -1,15 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <functional>
+#include <initializer_list>
 #include <queue>
+#include <ranges>
+#include <span>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "compare.h"
 
 namespace order_statistics {
 
-template <typename Value, std::size_t percentile /* "k" */, typename Key = std::identity>
+// `KthPercentile` orders its elements by their `Key` keys, as compared by
+// the comparator `Compare` (see `compare.h`).
+template <typename Value, std::size_t percentile /* "k" */, typename Key = std::identity, typename Compare = std::less<>>
 class KthPercentile {
   static_assert(percentile > 0);
   static_assert(percentile <= 100);
@@ -26,6 +36,12 @@ class KthPercentile {
   // min-heap of all elements greater than the k'th percentile value.
   std::priority_queue<Value, std::vector<Value>, KeyGreater> higher;
 
+  // Add the specified `value` to `lower` or to `higher`, whichever keeps
+  // every element of `lower` less than or equal to every element of
+  // `higher`, without regard to their sizes.
+  template <typename V>
+  void place(V&& value);
+
   // Move elements between `lower` and `higher` until `lower` contains all
   // elements less than or equal to the k'th percentile value, `higher`
   // contains all greater elements.
@@ -36,71 +52,540 @@ class KthPercentile {
   // The behavior is undefined if this object is empty.
   const Value& get() const;
 
+  std::size_t size() const;
+
   void insert(const Value&);
   void insert(Value&&);
+
+  // Add the elements of the specified range, and then rebalance once. This
+  // takes O(m log n) time for a range of `m` elements, however many of them
+  // end up on the other side of the percentile.
+  template <std::ranges::input_range Range>
+  void insert_batch(Range&& values);
+
+  // Replace the contents with the elements of the specified range, which
+  // must be sorted by key. This takes O(n) time, since the part of a sorted
+  // sequence on either side of the percentile is already a heap.
+  template <std::ranges::input_range Range>
+  void assign_sorted(Range&& values);
+
+  // Return a copy of the elements, sorted by key. This takes O(n log n)
+  // time.
+  std::vector<Value> sorted_elements() const;
 };
 
-template <typename Value, std::size_t percentile, typename Key>
-bool KthPercentile<Value, percentile, Key>::KeyLess::operator()(const Value& left, const Value& right) const {
-  return Key()(left) < Key()(right);
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+bool KthPercentile<Value, percentile, Key, Compare>::KeyLess::operator()(const Value& left, const Value& right) const {
+  return detail::less<Compare>(Key()(left), Key()(right));
 }
 
-template <typename Value, std::size_t percentile, typename Key>
-bool KthPercentile<Value, percentile, Key>::KeyGreater::operator()(const Value& left, const Value& right) const {
-  return Key()(left) > Key()(right);
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+bool KthPercentile<Value, percentile, Key, Compare>::KeyGreater::operator()(const Value& left, const Value& right) const {
+  return detail::less<Compare>(Key()(right), Key()(left));
 }
 
-template <typename Value, std::size_t percentile, typename Key>
-const Value& KthPercentile<Value, percentile, Key>::get() const {
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+const Value& KthPercentile<Value, percentile, Key, Compare>::get() const {
   return lower.top();
 }
 
-template <typename Value, std::size_t percentile, typename Key>
-void KthPercentile<Value, percentile, Key>::insert(const Value& value) {
-  if (lower.empty()) {
-    lower.push(value);
-    return;
-  }
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+std::size_t KthPercentile<Value, percentile, Key, Compare>::size() const {
+  return lower.size() + higher.size();
+}
 
-  if (KeyGreater()(value, lower.top())) {
-    higher.push(value);
-  } else {
-    lower.push(value);
-  }
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+void KthPercentile<Value, percentile, Key, Compare>::insert(const Value& value) {
+  place(value);
+  rebalance();
+}
 
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+void KthPercentile<Value, percentile, Key, Compare>::insert(Value&& value) {
+  place(std::move(value));
   rebalance();
 }
 
-template <typename Value, std::size_t percentile, typename Key>
-void KthPercentile<Value, percentile, Key>::insert(Value&& value) {
-  if (lower.empty()) {
-    lower.push(std::move(value));
-    return;
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+template <std::ranges::input_range Range>
+void KthPercentile<Value, percentile, Key, Compare>::insert_batch(Range&& values) {
+  for (auto&& value : values) {
+    // Elements of a range that we were given to consume can be moved.
+    if constexpr (std::is_rvalue_reference_v<Range&&> && !std::ranges::borrowed_range<Range>) {
+      place(std::move(value));
+    } else {
+      place(std::forward<decltype(value)>(value));
+    }
   }
+  rebalance();
+}
 
-  if (KeyGreater()(value, lower.top())) {
-    higher.push(std::move(value));
-  } else {
-    lower.push(std::move(value));
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+template <std::ranges::input_range Range>
+void KthPercentile<Value, percentile, Key, Compare>::assign_sorted(Range&& values) {
+  std::vector<Value> sorted(std::ranges::begin(values), std::ranges::end(values));
+  assert(std::is_sorted(sorted.begin(), sorted.end(), KeyLess()));
+  const std::size_t n = sorted.size();
+  // As in `rebalance`.
+  const std::size_t lower_target = n ? std::min(percentile * n / 100 + 1, n) : 0;
+  std::vector<Value> greater(std::make_move_iterator(sorted.begin() + lower_target),
+                             std::make_move_iterator(sorted.end()));
+  sorted.resize(lower_target);
+  // The constructors make heaps of these in O(n) time, and the reversed
+  // lower part is already one.
+  std::reverse(sorted.begin(), sorted.end());
+  lower = decltype(lower)(KeyLess(), std::move(sorted));
+  higher = decltype(higher)(KeyGreater(), std::move(greater));
+}
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+std::vector<Value> KthPercentile<Value, percentile, Key, Compare>::sorted_elements() const {
+  std::vector<Value> result;
+  result.reserve(size());
+  // Popping a copy of `lower` yields its elements greatest first, and
+  // popping a copy of `higher` yields its elements least first.
+  for (auto heap = lower; !heap.empty(); heap.pop()) {
+    result.push_back(heap.top());
   }
+  std::reverse(result.begin(), result.end());
+  for (auto heap = higher; !heap.empty(); heap.pop()) {
+    result.push_back(heap.top());
+  }
+  return result;
+}
 
-  rebalance();
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+template <typename V>
+void KthPercentile<Value, percentile, Key, Compare>::place(V&& value) {
+  if (!lower.empty() && KeyGreater()(value, lower.top())) {
+    higher.push(std::forward<V>(value));
+  } else {
+    lower.push(std::forward<V>(value));
+  }
 }
 
-template <typename Value, std::size_t percentile, typename Key>
-void KthPercentile<Value, percentile, Key>::rebalance() {
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+void KthPercentile<Value, percentile, Key, Compare>::rebalance() {
   const std::size_t n = lower.size() + higher.size();
-  const std::size_t lower_target = percentile / 100.0 * n + 1;
-  
-  if (lower.size() < lower_target) {
+  if (n == 0) {
+    return;
+  }
+  // The k'th percentile value has rank `floor(k * n / 100)`, or is the
+  // greatest element when that's `n`.
+  const std::size_t lower_target = std::min(percentile * n / 100 + 1, n);
+
+  while (lower.size() < lower_target) {
     assert(!higher.empty());
     lower.push(higher.top());
     higher.pop();
-  } else if (lower.size() > lower_target) {
-    assert(!lower.empty());
+  }
+  while (lower.size() > lower_target) {
     higher.push(lower.top());
     lower.pop();
   }
 }
 
+namespace detail {
+
+// `MinMaxHeap` is a double-ended priority queue: both its least and its
+// greatest elements, according to `Less`, can be found in O(1) time and
+// removed in O(log n) time. It's an array whose nodes on even levels are
+// less than their descendants, and whose nodes on odd levels are greater.
+template <typename Value, typename Less>
+class MinMaxHeap {
+  std::vector<Value> values;
+
+  static bool on_min_level(std::size_t index);
+
+  template <bool min>
+  void bubble_up(std::size_t index);
+  template <bool min>
+  void trickle_down(std::size_t index);
+
+  std::size_t max_index() const;
+  // Remove the element at the specified `index`, which is `0` or
+  // `max_index()`, and return it.
+  Value remove(std::size_t index);
+
+ public:
+  std::size_t size() const;
+  bool empty() const;
+
+  // The behavior of these is undefined if this heap is empty.
+  const Value& min() const;
+  const Value& max() const;
+  Value pop_min();
+  Value pop_max();
+
+  void push(const Value&);
+  void push(Value&&);
+};
+
+template <typename Value, typename Less>
+bool MinMaxHeap<Value, Less>::on_min_level(std::size_t index) {
+  return std::bit_width(index + 1) % 2 == 1;
+}
+
+template <typename Value, typename Less>
+template <bool min>
+void MinMaxHeap<Value, Less>::bubble_up(std::size_t index) {
+  // Compare against grandparents, which are on the same kind of level.
+  const auto before = [](const Value& left, const Value& right) {
+    return min ? Less()(left, right) : Less()(right, left);
+  };
+  while (index > 2) {
+    const std::size_t grandparent = ((index - 1) / 2 - 1) / 2;
+    if (!before(values[index], values[grandparent])) {
+      break;
+    }
+    std::swap(values[index], values[grandparent]);
+    index = grandparent;
+  }
+}
+
+template <typename Value, typename Less>
+template <bool min>
+void MinMaxHeap<Value, Less>::trickle_down(std::size_t index) {
+  const auto before = [](const Value& left, const Value& right) {
+    return min ? Less()(left, right) : Less()(right, left);
+  };
+  const std::size_t count = values.size();
+  // Carry the element being sifted down in `moving`, leaving a hole at
+  // `index`, rather than swapping it one level at a time.
+  Value moving = std::move(values[index]);
+  for (;;) {
+    // Find the first among the children and grandchildren of `index`. A
+    // child that has children of its own can't be first, because it's on
+    // the opposite kind of level. So, in the common case that all four
+    // grandchildren exist, only they need to be considered.
+    std::size_t best;
+    const std::size_t first_child = 2 * index + 1;
+    const std::size_t first_grandchild = 2 * first_child + 1;
+    if (first_grandchild + 3 < count) {
+      const std::size_t left = before(values[first_grandchild + 1], values[first_grandchild])
+          ? first_grandchild + 1 : first_grandchild;
+      const std::size_t right = before(values[first_grandchild + 3], values[first_grandchild + 2])
+          ? first_grandchild + 3 : first_grandchild + 2;
+      best = before(values[right], values[left]) ? right : left;
+    } else if (first_child < count) {
+      // Consider grandchildren before children, so that a child that ties
+      // with its own child isn't chosen.
+      best = first_grandchild < count ? first_grandchild : first_child;
+      const std::size_t candidates[] = {first_grandchild + 1, first_grandchild + 2, first_grandchild + 3,
+                                        first_child, first_child + 1};
+      for (const std::size_t candidate : candidates) {
+        if (candidate < count && before(values[candidate], values[best])) {
+          best = candidate;
+        }
+      }
+    } else {
+      break;
+    }
+    if (!before(values[best], moving)) {
+      break;
+    }
+    values[index] = std::move(values[best]);
+    index = best;
+    if (best <= first_child + 1) {
+      // A child has no descendants of its own left to check.
+      break;
+    }
+    // The grandchild's parent is on the opposite kind of level, so make sure
+    // the element moving down doesn't violate that level's order.
+    const std::size_t parent = (best - 1) / 2;
+    if (before(values[parent], moving)) {
+      std::swap(values[parent], moving);
+    }
+  }
+  values[index] = std::move(moving);
+}
+
+template <typename Value, typename Less>
+std::size_t MinMaxHeap<Value, Less>::max_index() const {
+  assert(!values.empty());
+  if (values.size() == 1) {
+    return 0;
+  }
+  if (values.size() == 2 || !Less()(values[1], values[2])) {
+    return 1;
+  }
+  return 2;
+}
+
+template <typename Value, typename Less>
+Value MinMaxHeap<Value, Less>::remove(std::size_t index) {
+  Value result = std::move(values[index]);
+  if (index + 1 != values.size()) {
+    values[index] = std::move(values.back());
+  }
+  values.pop_back();
+  if (index < values.size()) {
+    if (on_min_level(index)) {
+      trickle_down<true>(index);
+    } else {
+      trickle_down<false>(index);
+    }
+  }
+  return result;
+}
+
+template <typename Value, typename Less>
+std::size_t MinMaxHeap<Value, Less>::size() const {
+  return values.size();
+}
+
+template <typename Value, typename Less>
+bool MinMaxHeap<Value, Less>::empty() const {
+  return values.empty();
+}
+
+template <typename Value, typename Less>
+const Value& MinMaxHeap<Value, Less>::min() const {
+  assert(!values.empty());
+  return values[0];
+}
+
+template <typename Value, typename Less>
+const Value& MinMaxHeap<Value, Less>::max() const {
+  return values[max_index()];
+}
+
+template <typename Value, typename Less>
+Value MinMaxHeap<Value, Less>::pop_min() {
+  assert(!values.empty());
+  return remove(0);
+}
+
+template <typename Value, typename Less>
+Value MinMaxHeap<Value, Less>::pop_max() {
+  return remove(max_index());
+}
+
+template <typename Value, typename Less>
+void MinMaxHeap<Value, Less>::push(const Value& value) {
+  push(Value(value));
+}
+
+template <typename Value, typename Less>
+void MinMaxHeap<Value, Less>::push(Value&& value) {
+  values.push_back(std::move(value));
+  const std::size_t index = values.size() - 1;
+  if (index == 0) {
+    return;
+  }
+  // If the new element belongs on the other kind of level than the one it's
+  // on, then swap it with its parent first.
+  const std::size_t parent = (index - 1) / 2;
+  if (on_min_level(index)) {
+    if (Less()(values[parent], values[index])) {
+      std::swap(values[parent], values[index]);
+      bubble_up<false>(parent);
+    } else {
+      bubble_up<true>(index);
+    }
+  } else {
+    if (Less()(values[index], values[parent])) {
+      std::swap(values[parent], values[index]);
+      bubble_up<true>(parent);
+    } else {
+      bubble_up<false>(index);
+    }
+  }
+}
+
+constexpr bool strictly_increasing(std::initializer_list<double> values) {
+  return std::ranges::adjacent_find(values, std::greater_equal<>()) == values.end();
+}
+
+} // namespace detail
+
+// `MultiPercentile` tracks several percentiles of the same elements at once.
+// Rather than keeping a `KthPercentile` (and so a copy of every element) per
+// percentile, it partitions one copy of the elements into a chain of buckets
+// separated by the percentiles' values. Each bucket is a `MinMaxHeap`, so that
+// the elements on either side of a boundary are at hand. An insertion goes
+// into one bucket, and then one element crosses each boundary whose target
+// rank moved past it, for O(q + m log n) time where `q` is the number of
+// percentiles and `m` is the number of boundaries crossed.
+template <typename Value, typename Key = std::identity>
+class MultiPercentile {
+  struct KeyLess {
+    bool operator()(const Value&, const Value&) const;
+  };
+
+  // Each percentile is between 0 (exclusive) and 100 (inclusive), and they
+  // are in increasing order.
+  std::vector<double> percents;
+  // `buckets[i]` contains the elements ranked after the `i - 1`'th
+  // percentile value, up to and including the `i`'th percentile value. The
+  // last bucket contains the elements ranked after the last percentile value.
+  std::vector<detail::MinMaxHeap<Value, KeyLess>> buckets;
+  std::size_t count;
+
+  // Return the number of elements ranked at or before the specified
+  // `percent`ile value when there are `count` elements.
+  std::size_t target(double percent) const;
+
+  template <typename V>
+  void generic_insert(V&& value);
+
+ public:
+  // Track the specified `percentiles`, which must be in increasing order,
+  // each greater than 0 and no more than 100. Fractional percentiles, such
+  // as 99.9, are allowed.
+  explicit MultiPercentile(std::span<const double> percentiles);
+  MultiPercentile(std::initializer_list<double> percentiles);
+
+  // Return the value at the percentile having the specified `index` in the
+  // list given at construction. The behavior is undefined if this object is
+  // empty.
+  const Value& get(std::size_t index) const;
+
+  std::span<const double> percentiles() const;
+
+  std::size_t size() const;
+  bool empty() const;
+
+  void insert(const Value&);
+  void insert(Value&&);
+};
+
+// `FixedMultiPercentile` is a `MultiPercentile` whose percentiles are fixed
+// at compile time, where they are checked. Each percentile is an integer or
+// floating point constant, e.g. `FixedMultiPercentile<int, std::identity,
+// 50, 90, 99, 99.9>`.
+template <typename Value, typename Key, auto... percentiles>
+class FixedMultiPercentile : public MultiPercentile<Value, Key> {
+  static_assert(sizeof...(percentiles) > 0);
+  static_assert(((percentiles > 0 && percentiles <= 100) && ...));
+  static_assert(detail::strictly_increasing({double(percentiles)...}));
+
+ public:
+  FixedMultiPercentile();
+};
+
+template <typename Value, typename Key>
+bool MultiPercentile<Value, Key>::KeyLess::operator()(const Value& left, const Value& right) const {
+  return Key()(left) < Key()(right);
+}
+
+template <typename Value, typename Key>
+MultiPercentile<Value, Key>::MultiPercentile(std::span<const double> percentiles)
+: percents(percentiles.begin(), percentiles.end())
+, buckets(percentiles.size() + 1)
+, count(0) {
+  assert(!percents.empty());
+  for (std::size_t i = 0; i < percents.size(); ++i) {
+    assert(percents[i] > 0 && percents[i] <= 100);
+    assert(i == 0 || percents[i - 1] < percents[i]);
+  }
+}
+
+template <typename Value, typename Key>
+MultiPercentile<Value, Key>::MultiPercentile(std::initializer_list<double> percentiles)
+: MultiPercentile(std::span<const double>(percentiles.begin(), percentiles.size())) {}
+
+template <typename Value, typename Key>
+std::size_t MultiPercentile<Value, Key>::target(double percent) const {
+  // Same as `KthPercentile`. Multiplying before dividing keeps the result
+  // exact for whole percentiles.
+  return std::min(std::size_t(percent * count / 100) + 1, count);
+}
+
+template <typename Value, typename Key>
+const Value& MultiPercentile<Value, Key>::get(std::size_t index) const {
+  assert(count);
+  assert(index < percents.size());
+  // The value is the greatest element of the buckets up to `index`. Nearby
+  // percentiles can have the same value, leaving the buckets between them
+  // empty.
+  std::size_t i = index;
+  while (buckets[i].empty()) {
+    assert(i);
+    --i;
+  }
+  return buckets[i].max();
+}
+
+template <typename Value, typename Key>
+std::span<const double> MultiPercentile<Value, Key>::percentiles() const {
+  return percents;
+}
+
+template <typename Value, typename Key>
+std::size_t MultiPercentile<Value, Key>::size() const {
+  return count;
+}
+
+template <typename Value, typename Key>
+bool MultiPercentile<Value, Key>::empty() const {
+  return count == 0;
+}
+
+template <typename Value, typename Key>
+void MultiPercentile<Value, Key>::insert(const Value& value) {
+  generic_insert(value);
+}
+
+template <typename Value, typename Key>
+void MultiPercentile<Value, Key>::insert(Value&& value) {
+  generic_insert(std::move(value));
+}
+
+template <typename Value, typename Key>
+template <typename V>
+void MultiPercentile<Value, Key>::generic_insert(V&& value) {
+  // `value` goes into the first bucket whose percentile value is not less
+  // than it, or into the last bucket if there's no such percentile.
+  const std::size_t boundaries = percents.size();
+  std::size_t chosen = 0;
+  const Value *below = nullptr;
+  for (; chosen < boundaries; ++chosen) {
+    if (!buckets[chosen].empty()) {
+      below = &buckets[chosen].max();
+    }
+    if (below && !KeyLess()(*below, value)) {
+      break;
+    }
+  }
+  if (!below) {
+    chosen = 0;
+  }
+  buckets[chosen].push(std::forward<V>(value));
+  ++count;
+
+  // Now the number of elements at or before each boundary is off by at most
+  // one. Boundaries before `chosen` might be short an element, which comes
+  // from the bucket above. Fix them from the top down, so that each bucket
+  // is replenished before it gives. Boundaries at or after `chosen` might
+  // have an element too many, which goes to the bucket above. Fix them from
+  // the bottom up, for the same reason.
+  std::size_t at_or_before = 0;
+  for (std::size_t i = 0; i < chosen; ++i) {
+    at_or_before += buckets[i].size();
+  }
+  for (std::size_t i = chosen; i-- > 0;) {
+    if (at_or_before < target(percents[i])) {
+      buckets[i].push(buckets[i + 1].pop_min());
+      ++at_or_before;
+    }
+    at_or_before -= buckets[i].size();
+  }
+  at_or_before = 0;
+  for (std::size_t i = 0; i < chosen; ++i) {
+    at_or_before += buckets[i].size();
+  }
+  for (std::size_t i = chosen; i < boundaries; ++i) {
+    at_or_before += buckets[i].size();
+    if (at_or_before > target(percents[i])) {
+      buckets[i + 1].push(buckets[i].pop_max());
+      --at_or_before;
+    }
+  }
+}
+
+template <typename Value, typename Key, auto... percentiles>
+FixedMultiPercentile<Value, Key, percentiles...>::FixedMultiPercentile()
+: MultiPercentile<Value, Key>({double(percentiles)...}) {}
+
 } // namespace order_statistics
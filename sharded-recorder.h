@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "tree.h"
+
+namespace order_statistics {
+namespace detail {
+
+// Return a small integer identifying the calling thread. Threads are
+// numbered in the order in which they first call this function.
+inline std::size_t thread_index() {
+    static std::atomic<std::size_t> next_index{0};
+    thread_local const std::size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+// Shards are aligned to this, so that threads recording into different
+// shards don't contend for the same cache line.
+inline constexpr std::size_t cache_line_size = 64;
+
+} // namespace detail
+
+// `ShardedPercentileRecorder` collects values from many threads at once and
+// merges them, on demand, into a `Tree`. Each thread records into one of a
+// fixed number of shards, chosen by the thread, so that threads don't
+// contend with each other as long as there are at least as many shards as
+// threads. Recording is lock-free: a thread never waits for another thread,
+// not even for one that is taking a snapshot. The only slow path is
+// allocating a new chunk, once per `Chunk::capacity` values in a shard.
+//
+// Each shard appends values to a fixed-size chunk. When a chunk fills, the
+// thread that notices swaps in a new one and pushes the full one onto the
+// shard's list of full chunks. Taking a snapshot swaps out each shard's
+// current chunk and full list, waits for any threads still writing into
+// them, and then moves their values into the merged tree.
+//
+// To know when no thread is still writing into the chunks it swapped out, a
+// snapshot relies on each shard's pair of writer counts. A recording thread
+// counts itself in the count for the shard's current epoch, and a snapshot
+// flips the epoch after swapping out the chunks, and then waits for the
+// count of the previous epoch to drain to zero. Threads that arrive after
+// the flip can only see the new chunks.
+template <typename T, typename GetKey = std::identity>
+class ShardedPercentileRecorder {
+    // Recording a value must not fail after a slot is claimed for it.
+    static_assert(std::is_nothrow_copy_constructible_v<T> && std::is_nothrow_move_constructible_v<T>);
+
+    struct Chunk {
+        static constexpr std::size_t capacity = 1024;
+        // The number of slots handed out, which can exceed `capacity` once
+        // the chunk is full.
+        std::atomic<std::size_t> claimed{0};
+        // The next chunk in a shard's list of full chunks.
+        Chunk *next = nullptr;
+        alignas(T) unsigned char storage[capacity * sizeof(T)];
+
+        T *slot(std::size_t index);
+        // Return the number of slots that contain values.
+        std::size_t size() const;
+    };
+
+    struct alignas(detail::cache_line_size) Shard {
+        std::atomic<Chunk*> current{nullptr};
+        // A stack of chunks that are full.
+        std::atomic<Chunk*> full{nullptr};
+        std::atomic<unsigned> epoch{0};
+        // The number of threads recording in each epoch.
+        std::atomic<std::size_t> writers[2] = {0, 0};
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    // The number of shards is a power of two, so that a thread's shard is its
+    // index masked by this.
+    std::size_t shard_mask;
+    Tree<T, GetKey> merged;
+
+ public:
+    // Create a recorder having at least the specified number of shards,
+    // rounded up to a power of two. By default, there is one shard per
+    // hardware thread.
+    explicit ShardedPercentileRecorder(std::size_t shard_count = std::thread::hardware_concurrency());
+    ~ShardedPercentileRecorder();
+
+    ShardedPercentileRecorder(const ShardedPercentileRecorder&) = delete;
+    ShardedPercentileRecorder& operator=(const ShardedPercentileRecorder&) = delete;
+
+    // Record the specified value. Any number of threads may call `insert`
+    // concurrently, with each other and with `snapshot` and `clear`.
+    void insert(const T&);
+    void insert(T&&);
+
+    // Move every value recorded so far into the merged tree, and return the
+    // tree. Values recorded concurrently with `snapshot` might or might not
+    // be included. Only one thread at a time may call `snapshot` or `clear`,
+    // and the returned reference is valid until the next such call. If
+    // `snapshot` throws, then some values recorded since the previous
+    // snapshot might be lost.
+    const Tree<T, GetKey>& snapshot();
+
+    // Discard every value recorded so far, including those already merged.
+    void clear();
+
+    std::size_t shard_count() const;
+
+ private:
+    template <typename U>
+    void generic_insert(U&& value);
+
+    // Replace the specified `full` chunk as the `shard`'s current chunk,
+    // unless another thread has already done so.
+    static void replace_full(Shard& shard, Chunk *full);
+
+    // Detach all chunks holding values from the specified `shard`, wait until
+    // no thread is writing into them, and return them as a list.
+    static Chunk *detach(Shard& shard);
+
+    static void destroy(Chunk *chunks);
+};
+
+template <typename T, typename GetKey>
+T *ShardedPercentileRecorder<T, GetKey>::Chunk::slot(std::size_t index) {
+    return reinterpret_cast<T*>(storage + index * sizeof(T));
+}
+
+template <typename T, typename GetKey>
+std::size_t ShardedPercentileRecorder<T, GetKey>::Chunk::size() const {
+    return std::min(claimed.load(std::memory_order_relaxed), capacity);
+}
+
+template <typename T, typename GetKey>
+ShardedPercentileRecorder<T, GetKey>::ShardedPercentileRecorder(std::size_t shard_count)
+: shards(std::make_unique<Shard[]>(std::bit_ceil(std::max(shard_count, std::size_t(1)))))
+, shard_mask(std::bit_ceil(std::max(shard_count, std::size_t(1))) - 1) {
+    const auto guard = detail::on_scope_exit([this]() {
+        if (shards[shard_mask].current.load(std::memory_order_relaxed)) {
+            return;
+        }
+        for (std::size_t i = 0; i <= shard_mask; ++i) {
+            delete shards[i].current.load(std::memory_order_relaxed);
+        }
+    });
+    for (std::size_t i = 0; i <= shard_mask; ++i) {
+        shards[i].current.store(new Chunk, std::memory_order_relaxed);
+    }
+}
+
+template <typename T, typename GetKey>
+ShardedPercentileRecorder<T, GetKey>::~ShardedPercentileRecorder() {
+    for (std::size_t i = 0; i <= shard_mask; ++i) {
+        destroy(shards[i].current.load(std::memory_order_relaxed));
+        destroy(shards[i].full.load(std::memory_order_relaxed));
+    }
+}
+
+template <typename T, typename GetKey>
+void ShardedPercentileRecorder<T, GetKey>::insert(const T& value) {
+    generic_insert(value);
+}
+
+template <typename T, typename GetKey>
+void ShardedPercentileRecorder<T, GetKey>::insert(T&& value) {
+    generic_insert(std::move(value));
+}
+
+template <typename T, typename GetKey>
+template <typename U>
+void ShardedPercentileRecorder<T, GetKey>::generic_insert(U&& value) {
+    Shard& shard = shards[detail::thread_index() & shard_mask];
+
+    // Count this thread among the writers of the current epoch. If the epoch
+    // changed in the meantime, then a snapshot might not have seen the
+    // count, so try again.
+    unsigned epoch;
+    for (;;) {
+        epoch = shard.epoch.load();
+        shard.writers[epoch].fetch_add(1);
+        if (shard.epoch.load() == epoch) {
+            break;
+        }
+        shard.writers[epoch].fetch_sub(1, std::memory_order_release);
+    }
+    const auto guard = detail::on_scope_exit([&]() {
+        shard.writers[epoch].fetch_sub(1, std::memory_order_release);
+    });
+
+    for (;;) {
+        Chunk *const chunk = shard.current.load();
+        const std::size_t index = chunk->claimed.fetch_add(1, std::memory_order_relaxed);
+        if (index < Chunk::capacity) {
+            new (chunk->slot(index)) T(std::forward<U>(value));
+            return;
+        }
+        replace_full(shard, chunk);
+    }
+}
+
+template <typename T, typename GetKey>
+void ShardedPercentileRecorder<T, GetKey>::replace_full(Shard& shard, Chunk *full) {
+    Chunk *const fresh = new Chunk;
+    Chunk *expected = full;
+    if (!shard.current.compare_exchange_strong(expected, fresh)) {
+        // Another thread replaced it first.
+        delete fresh;
+        return;
+    }
+    full->next = shard.full.load(std::memory_order_relaxed);
+    while (!shard.full.compare_exchange_weak(full->next, full, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+template <typename T, typename GetKey>
+typename ShardedPercentileRecorder<T, GetKey>::Chunk *ShardedPercentileRecorder<T, GetKey>::detach(Shard& shard) {
+    // Leave the current chunk in place if nothing has been recorded in it.
+    Chunk *current = nullptr;
+    if (shard.current.load()->claimed.load(std::memory_order_relaxed)) {
+        current = shard.current.exchange(new Chunk);
+    }
+    Chunk *chunks = shard.full.exchange(nullptr);
+    if (current) {
+        current->next = chunks;
+        chunks = current;
+    }
+    if (!chunks) {
+        return nullptr;
+    }
+
+    // Threads that count themselves as writers after the epoch changes will
+    // find only the new chunks. Wait for the ones that came before. Like a
+    // writer's increment and then load of `epoch`, this store and then load
+    // of `writers` must both be sequentially consistent, so that at least
+    // one side sees the other's store.
+    const unsigned old_epoch = shard.epoch.load();
+    shard.epoch.store(1 - old_epoch);
+    while (shard.writers[old_epoch].load()) {
+        std::this_thread::yield();
+    }
+    return chunks;
+}
+
+template <typename T, typename GetKey>
+void ShardedPercentileRecorder<T, GetKey>::destroy(Chunk *chunks) {
+    while (chunks) {
+        Chunk *const next = chunks->next;
+        for (std::size_t i = 0; i < chunks->size(); ++i) {
+            chunks->slot(i)->~T();
+        }
+        delete chunks;
+        chunks = next;
+    }
+}
+
+template <typename T, typename GetKey>
+const Tree<T, GetKey>& ShardedPercentileRecorder<T, GetKey>::snapshot() {
+    std::vector<T> batch;
+    for (std::size_t i = 0; i <= shard_mask; ++i) {
+        Chunk *const chunks = detach(shards[i]);
+        const auto guard = detail::on_scope_exit([&]() {
+            destroy(chunks);
+        });
+        for (Chunk *chunk = chunks; chunk; chunk = chunk->next) {
+            for (std::size_t j = 0; j < chunk->size(); ++j) {
+                batch.push_back(std::move(*chunk->slot(j)));
+            }
+        }
+    }
+    merged.insert_batch(std::move(batch));
+    return merged;
+}
+
+template <typename T, typename GetKey>
+void ShardedPercentileRecorder<T, GetKey>::clear() {
+    for (std::size_t i = 0; i <= shard_mask; ++i) {
+        destroy(detach(shards[i]));
+    }
+    merged.clear();
+}
+
+template <typename T, typename GetKey>
+std::size_t ShardedPercentileRecorder<T, GetKey>::shard_count() const {
+    return shard_mask + 1;
+}
+
+} // namespace order_statistics
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+// This file contains the search kernels used to descend a `BTree`: finding
+// where a key belongs among a node's sorted keys, and finding which child
+// contains a given rank. For arithmetic keys, these are branch-free linear
+// scans. If the target supports AVX2 or SSE4.2 (e.g. `-march=native`), then
+// the scans use those instructions, which is decided at compile time.
+// Other key types use binary search.
+
+namespace order_statistics {
+namespace detail {
+
+// The key types for which there are vectorized kernels.
+template <typename Key>
+concept SimdKey = std::is_same_v<Key, float> || std::is_same_v<Key, double> ||
+    (std::is_integral_v<Key> && !std::is_same_v<Key, bool> && (sizeof(Key) == 4 || sizeof(Key) == 8));
+
+#if defined(__AVX2__)
+inline constexpr std::size_t simd_width = 32;
+#elif defined(__SSE4_2__)
+inline constexpr std::size_t simd_width = 16;
+#else
+inline constexpr std::size_t simd_width = 0;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+
+// Return the number of `keys` among the first `lanes` (one register's worth)
+// that are less than `key`, or not greater than `key` if `or_equal`.
+template <bool or_equal, typename Key>
+unsigned count_below_in_register(const Key *keys, Key key) {
+#if defined(__AVX2__)
+    if constexpr (std::is_same_v<Key, float>) {
+        const __m256 less = _mm256_cmp_ps(_mm256_loadu_ps(keys), _mm256_set1_ps(key), or_equal ? _CMP_LE_OQ : _CMP_LT_OQ);
+        return std::popcount(unsigned(_mm256_movemask_ps(less)));
+    } else if constexpr (std::is_same_v<Key, double>) {
+        const __m256d less = _mm256_cmp_pd(_mm256_loadu_pd(keys), _mm256_set1_pd(key), or_equal ? _CMP_LE_OQ : _CMP_LT_OQ);
+        return std::popcount(unsigned(_mm256_movemask_pd(less)));
+    } else if constexpr (sizeof(Key) == 4) {
+        // Unsigned comparison is signed comparison with the sign bits flipped.
+        const __m256i bias = _mm256_set1_epi32(std::is_signed_v<Key> ? 0 : INT32_MIN);
+        const __m256i mine = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys)), bias);
+        const __m256i theirs = _mm256_xor_si256(_mm256_set1_epi32(std::int32_t(key)), bias);
+        const __m256i above = or_equal ? _mm256_cmpgt_epi32(mine, theirs) : _mm256_cmpgt_epi32(theirs, mine);
+        const unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(above));
+        return or_equal ? 8 - std::popcount(mask) : std::popcount(mask);
+    } else {
+        const __m256i bias = _mm256_set1_epi64x(std::is_signed_v<Key> ? 0 : INT64_MIN);
+        const __m256i mine = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys)), bias);
+        const __m256i theirs = _mm256_xor_si256(_mm256_set1_epi64x(std::int64_t(key)), bias);
+        const __m256i above = or_equal ? _mm256_cmpgt_epi64(mine, theirs) : _mm256_cmpgt_epi64(theirs, mine);
+        const unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(above));
+        return or_equal ? 4 - std::popcount(mask) : std::popcount(mask);
+    }
+#else
+    if constexpr (std::is_same_v<Key, float>) {
+        const __m128 mine = _mm_loadu_ps(keys);
+        const __m128 theirs = _mm_set1_ps(key);
+        const __m128 less = or_equal ? _mm_cmple_ps(mine, theirs) : _mm_cmplt_ps(mine, theirs);
+        return std::popcount(unsigned(_mm_movemask_ps(less)));
+    } else if constexpr (std::is_same_v<Key, double>) {
+        const __m128d mine = _mm_loadu_pd(keys);
+        const __m128d theirs = _mm_set1_pd(key);
+        const __m128d less = or_equal ? _mm_cmple_pd(mine, theirs) : _mm_cmplt_pd(mine, theirs);
+        return std::popcount(unsigned(_mm_movemask_pd(less)));
+    } else if constexpr (sizeof(Key) == 4) {
+        const __m128i bias = _mm_set1_epi32(std::is_signed_v<Key> ? 0 : INT32_MIN);
+        const __m128i mine = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)), bias);
+        const __m128i theirs = _mm_xor_si128(_mm_set1_epi32(std::int32_t(key)), bias);
+        const __m128i above = or_equal ? _mm_cmpgt_epi32(mine, theirs) : _mm_cmpgt_epi32(theirs, mine);
+        const unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(above));
+        return or_equal ? 4 - std::popcount(mask) : std::popcount(mask);
+    } else {
+        const __m128i bias = _mm_set1_epi64x(std::is_signed_v<Key> ? 0 : INT64_MIN);
+        const __m128i mine = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)), bias);
+        const __m128i theirs = _mm_xor_si128(_mm_set1_epi64x(std::int64_t(key)), bias);
+        const __m128i above = or_equal ? _mm_cmpgt_epi64(mine, theirs) : _mm_cmpgt_epi64(theirs, mine);
+        const unsigned mask = _mm_movemask_pd(_mm_castsi128_pd(above));
+        return or_equal ? 2 - std::popcount(mask) : std::popcount(mask);
+    }
+#endif
+}
+
+#endif
+
+// Return the number of the `count` sorted `keys` that are less than `key`,
+// or not greater than `key` if `or_equal`, without using SIMD instructions.
+// That's the index of `std::lower_bound`, or of `std::upper_bound` if
+// `or_equal`.
+template <bool or_equal, typename Key>
+std::size_t count_below_scalar(const Key *keys, std::size_t count, const Key& key) {
+    if constexpr (std::is_arithmetic_v<Key>) {
+        std::size_t result = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            result += or_equal ? !(key < keys[i]) : keys[i] < key;
+        }
+        return result;
+    } else if constexpr (or_equal) {
+        return std::upper_bound(keys, keys + count, key) - keys;
+    } else {
+        return std::lower_bound(keys, keys + count, key) - keys;
+    }
+}
+
+// Return the same result as `count_below_scalar`, but using SIMD
+// instructions if they're available and `Key` is a `SimdKey`.
+template <bool or_equal, typename Key>
+std::size_t count_below(const Key *keys, std::size_t count, const Key& key) {
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    if constexpr (SimdKey<Key>) {
+        constexpr std::size_t lanes = simd_width / sizeof(Key);
+        std::size_t result = 0;
+        std::size_t i = 0;
+        for (; i + lanes <= count; i += lanes) {
+            result += count_below_in_register<or_equal>(keys + i, key);
+        }
+        return result + count_below_scalar<or_equal>(keys + i, count - i, key);
+    }
+#endif
+    return count_below_scalar<or_equal>(keys, count, key);
+}
+
+// Return the index of the first of the `count` `weights` whose inclusive
+// prefix sum exceeds `rank`, and subtract from `rank` the sum of the weights
+// before it. The behavior is undefined unless `rank` is less than the sum of
+// all `count` weights.
+inline std::size_t find_by_weight_scalar(const std::uint64_t *weights, std::size_t count, std::uint64_t& rank) {
+    // Count the prefix sums that don't exceed `rank`, without branching.
+    std::size_t index = 0;
+    std::uint64_t prefix = 0;
+    std::uint64_t behind = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        prefix += weights[i];
+        const bool skip = prefix <= rank;
+        index += skip;
+        behind = skip ? prefix : behind;
+    }
+    rank -= behind;
+    return index;
+}
+
+// Return the same result as `find_by_weight_scalar`, but using SIMD
+// instructions if they're available.
+inline std::size_t find_by_weight(const std::uint64_t *weights, std::size_t count, std::uint64_t& rank) {
+#if defined(__AVX2__)
+    // Compute the prefix sums four at a time, and count those not exceeding
+    // `rank`. Weights fit in 63 bits, so signed comparison is fine.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i limit = _mm256_set1_epi64x(std::int64_t(rank));
+    __m256i carry = zero;
+    std::size_t index = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i sums = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+        // [a, b, c, d] → [a, a+b, b+c, c+d] → [a, a+b, a+b+c, a+b+c+d]
+        sums = _mm256_add_epi64(sums, _mm256_blend_epi32(_mm256_permute4x64_epi64(sums, 0b10'01'00'00), zero, 0b0000'0011));
+        sums = _mm256_add_epi64(sums, _mm256_blend_epi32(_mm256_permute4x64_epi64(sums, 0b01'00'00'00), zero, 0b0000'1111));
+        sums = _mm256_add_epi64(sums, carry);
+        const unsigned above = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(sums, limit)));
+        index += 4 - std::popcount(above);
+        if (above) {
+            break;
+        }
+        carry = _mm256_permute4x64_epi64(sums, 0b11'11'11'11);
+    }
+    if (i + 4 > count) {
+        // We ran out of whole registers without finding the answer.
+        std::uint64_t remaining = rank - std::uint64_t(_mm256_extract_epi64(carry, 0));
+        index += find_by_weight_scalar(weights + i, count - i, remaining);
+        rank = remaining;
+        return index;
+    }
+    rank -= std::reduce(weights, weights + index, std::uint64_t(0));
+    return index;
+#else
+    return find_by_weight_scalar(weights, count, rank);
+#endif
+}
+
+} // namespace detail
+} // namespace order_statistics
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include "tree.h"
+
+namespace order_statistics {
+namespace detail {
+
+// `RingBuffer` is a FIFO queue stored in a circular array whose capacity is a
+// power of two. It grows by doubling, and never shrinks.
+template <typename Entry>
+class RingBuffer {
+    std::unique_ptr<Entry[]> entries;
+    std::size_t capacity;
+    std::size_t head;
+    std::size_t count;
+
+ public:
+    RingBuffer();
+
+    std::size_t size() const;
+    bool empty() const;
+
+    const Entry& front() const;
+    void pop_front();
+    void push_back(Entry&&);
+    void clear();
+};
+
+template <typename Entry>
+RingBuffer<Entry>::RingBuffer()
+: capacity(0)
+, head(0)
+, count(0) {}
+
+template <typename Entry>
+std::size_t RingBuffer<Entry>::size() const {
+    return count;
+}
+
+template <typename Entry>
+bool RingBuffer<Entry>::empty() const {
+    return count == 0;
+}
+
+template <typename Entry>
+const Entry& RingBuffer<Entry>::front() const {
+    assert(count);
+    return entries[head];
+}
+
+template <typename Entry>
+void RingBuffer<Entry>::pop_front() {
+    assert(count);
+    head = (head + 1) & (capacity - 1);
+    --count;
+}
+
+template <typename Entry>
+void RingBuffer<Entry>::push_back(Entry&& entry) {
+    if (count == capacity) {
+        const std::size_t new_capacity = capacity ? 2 * capacity : 16;
+        auto new_entries = std::make_unique<Entry[]>(new_capacity);
+        for (std::size_t i = 0; i < count; ++i) {
+            new_entries[i] = std::move(entries[(head + i) & (capacity - 1)]);
+        }
+        entries = std::move(new_entries);
+        capacity = new_capacity;
+        head = 0;
+    }
+    entries[(head + count) & (capacity - 1)] = std::move(entry);
+    ++count;
+}
+
+template <typename Entry>
+void RingBuffer<Entry>::clear() {
+    head = 0;
+    count = 0;
+}
+
+} // namespace detail
+
+// `SlidingWindowPercentile` is an order statistic `Tree` that contains only
+// the most recently inserted elements: at most `max_count` of them, and only
+// those inserted no more than `max_age` before the latest insertion (or call
+// to `expire`). Each insertion evicts expired elements, which costs amortized
+// O(log n) per element.
+//
+// Eviction is by key: when an element expires, the tree forgets an element
+// having the same `GetKey` key, though not necessarily the same element.
+template <typename T, typename GetKey = std::identity, typename Clock = std::chrono::steady_clock>
+class SlidingWindowPercentile {
+ public:
+    using time_point = typename Clock::time_point;
+    using duration = typename Clock::duration;
+
+ private:
+    using Key = std::remove_cvref_t<std::invoke_result_t<GetKey, const T&>>;
+
+    struct Sample {
+        time_point when;
+        Key key;
+    };
+
+    Tree<T, GetKey> tree;
+    // The keys of the elements in `tree`, oldest first.
+    detail::RingBuffer<Sample> samples;
+    std::size_t max_count;
+    duration max_age;
+
+ public:
+    // Keep at most the specified `max_count` most recent elements, each
+    // inserted no more than the specified `max_age` ago.
+    explicit SlidingWindowPercentile(std::size_t max_count, duration max_age = duration::max());
+    explicit SlidingWindowPercentile(duration max_age);
+
+    // Add the specified `value` to the window at the specified time `now`,
+    // and then evict any elements that have expired. `now` must not be earlier
+    // than the time of any previous insertion.
+    void insert(const T& value, time_point now = Clock::now());
+    void insert(T&& value, time_point now = Clock::now());
+
+    // Evict any elements that are older than `max_age` as of the specified
+    // time `now`.
+    void expire(time_point now = Clock::now());
+
+    // Remove all elements from the window.
+    void clear();
+
+    std::size_t size() const;
+    bool empty() const;
+
+    // Return all elements in the window whose `GetKey` key is in the
+    // specified percentile. See `Tree::percentile`. The behavior is undefined
+    // if the window is empty.
+    std::span<const T> percentile(std::size_t percent) const;
+
+    // Return the tree of elements currently in the window.
+    const Tree<T, GetKey>& elements() const;
+
+ private:
+    template <typename U>
+    void generic_insert(U&& value, time_point now);
+
+    void evict_oldest();
+};
+
+template <typename T, typename GetKey, typename Clock>
+SlidingWindowPercentile<T, GetKey, Clock>::SlidingWindowPercentile(std::size_t max_count, duration max_age)
+: max_count(max_count)
+, max_age(max_age) {
+    assert(max_count > 0);
+}
+
+template <typename T, typename GetKey, typename Clock>
+SlidingWindowPercentile<T, GetKey, Clock>::SlidingWindowPercentile(duration max_age)
+: SlidingWindowPercentile(std::numeric_limits<std::size_t>::max(), max_age) {}
+
+template <typename T, typename GetKey, typename Clock>
+void SlidingWindowPercentile<T, GetKey, Clock>::insert(const T& value, time_point now) {
+    generic_insert(value, now);
+}
+
+template <typename T, typename GetKey, typename Clock>
+void SlidingWindowPercentile<T, GetKey, Clock>::insert(T&& value, time_point now) {
+    generic_insert(std::move(value), now);
+}
+
+template <typename T, typename GetKey, typename Clock>
+template <typename U>
+void SlidingWindowPercentile<T, GetKey, Clock>::generic_insert(U&& value, time_point now) {
+    if (samples.size() == max_count) {
+        evict_oldest();
+    }
+    Key key = GetKey()(value);
+    tree.insert(std::forward<U>(value));
+    samples.push_back(Sample{now, std::move(key)});
+    expire(now);
+}
+
+template <typename T, typename GetKey, typename Clock>
+void SlidingWindowPercentile<T, GetKey, Clock>::expire(time_point now) {
+    // Avoid overflow in `now - max_age` when there's no age limit.
+    if (max_age == duration::max()) {
+        return;
+    }
+    while (!samples.empty() && now - samples.front().when > max_age) {
+        evict_oldest();
+    }
+}
+
+template <typename T, typename GetKey, typename Clock>
+void SlidingWindowPercentile<T, GetKey, Clock>::evict_oldest() {
+    const bool erased = tree.erase_one_by_key(samples.front().key);
+    assert(erased);
+    (void)erased;
+    samples.pop_front();
+}
+
+template <typename T, typename GetKey, typename Clock>
+void SlidingWindowPercentile<T, GetKey, Clock>::clear() {
+    tree.clear();
+    samples.clear();
+}
+
+template <typename T, typename GetKey, typename Clock>
+std::size_t SlidingWindowPercentile<T, GetKey, Clock>::size() const {
+    return tree.size();
+}
+
+template <typename T, typename GetKey, typename Clock>
+bool SlidingWindowPercentile<T, GetKey, Clock>::empty() const {
+    return tree.empty();
+}
+
+template <typename T, typename GetKey, typename Clock>
+std::span<const T> SlidingWindowPercentile<T, GetKey, Clock>::percentile(std::size_t percent) const {
+    return tree.percentile(percent);
+}
+
+template <typename T, typename GetKey, typename Clock>
+const Tree<T, GetKey>& SlidingWindowPercentile<T, GetKey, Clock>::elements() const {
+    return tree;
+}
+
+} // namespace order_statistics
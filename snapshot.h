@@ -0,0 +1,494 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include "kth-percentile.h"
+#include "tree.h"
+
+namespace order_statistics {
+
+// A snapshot is a compact binary image of the elements of a `Tree` or a
+// `KthPercentile`, from which an equivalent object can be built again in
+// O(n) time, such as after a restart. The elements must be trivially
+// copyable. A snapshot lists them in key order, as runs of identical
+// elements, each with its count:
+//
+//     offset  bytes        field
+//     0       4            `snapshot_magic`
+//     4       4            `snapshot_version`
+//     8       4            `sizeof(T)`, which is `s`
+//     12      4            zero
+//     16      8            number of elements
+//     24      8            number of runs, `r`
+//     32      r * (s + 8)  runs: `s` bytes of the element, and then the
+//                          number of times it repeats
+//
+// Integers, and the elements themselves, are in the byte order of the
+// machine that wrote the snapshot. A snapshot is meant to be read back by
+// the same program, not exchanged between machines.
+inline constexpr std::uint32_t snapshot_magic = 0x5354534f; // "OSTS" in little-endian
+inline constexpr std::uint32_t snapshot_version = 1;
+
+// `SnapshotError` is thrown when restoring from bytes that aren't a complete
+// snapshot of the expected element type, or when saving to a buffer that's
+// too small. Errors from the operating system are `std::system_error`.
+class SnapshotError : public std::runtime_error {
+ public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+struct SnapshotHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t element_size;
+    std::uint32_t reserved;
+    std::uint64_t size;
+    std::uint64_t runs;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32);
+
+// Reading from and writing to a file descriptor goes through a buffer of
+// this many bytes.
+inline constexpr std::size_t snapshot_chunk_size = 64 * 1024;
+
+// A run of identical elements, pointing into the object being saved.
+template <typename T>
+struct SnapshotRun {
+    const T *value;
+    std::uint64_t count;
+};
+
+template <typename T>
+std::uint64_t snapshot_bytes(std::size_t runs) {
+    return sizeof(SnapshotHeader) + runs * (sizeof(T) + sizeof(std::uint64_t));
+}
+
+// Append `count` copies of the specified `value` to the specified `runs`,
+// extending the last run if `value` is identical to its element. Elements
+// having the same bytes have the same key, so this never combines elements
+// that aren't adjacent in key order.
+template <typename T>
+void add_run(std::vector<SnapshotRun<T>>& runs, const T& value, std::uint64_t count) {
+    static_assert(std::is_trivially_copyable_v<T>, "snapshots require trivially copyable elements");
+    if (!runs.empty() && std::memcmp(runs.back().value, &value, sizeof(T)) == 0) {
+        runs.back().count += count;
+    } else {
+        runs.push_back({&value, count});
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::vector<SnapshotRun<T>> runs_of(const Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree) {
+    // Visit one key at a time, so that a `StoreCounts` tree's elements are
+    // counted rather than visited.
+    std::vector<SnapshotRun<T>> runs;
+    for (auto iter = tree.begin(); iter != tree.end(); iter = tree.upper_bound(GetKey()(*iter))) {
+        const auto values = tree.equal_range(*iter);
+        if constexpr (std::is_same_v<Duplicates, StoreCounts>) {
+            add_run(runs, values.front(), values.size());
+        } else {
+            for (const T& value : values) {
+                add_run(runs, value, 1);
+            }
+        }
+    }
+    return runs;
+}
+
+template <typename Value>
+std::vector<SnapshotRun<Value>> runs_of(const std::vector<Value>& sorted) {
+    std::vector<SnapshotRun<Value>> runs;
+    for (const Value& value : sorted) {
+        add_run(runs, value, 1);
+    }
+    return runs;
+}
+
+// Write all of the specified `size` bytes at `data` to the specified `fd`.
+inline void write_fully(int fd, const char *data, std::size_t size) {
+    while (size) {
+        const ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+// Read exactly the specified `size` bytes from the specified `fd` into
+// `data`. Throw `SnapshotError` if the file ends first.
+inline void read_fully(int fd, char *data, std::size_t size) {
+    while (size) {
+        const ssize_t got = ::read(fd, data, size);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (got == 0) {
+            throw SnapshotError("snapshot is truncated");
+        }
+        data += got;
+        size -= got;
+    }
+}
+
+// `BufferWriter` and `FileWriter` are the destinations of `write_snapshot`.
+class BufferWriter {
+    std::span<char> buffer;
+    std::size_t used;
+
+ public:
+    explicit BufferWriter(std::span<char> buffer)
+    : buffer(buffer)
+    , used(0) {}
+
+    void write(const void *data, std::size_t size) {
+        assert(size <= buffer.size() - used);
+        std::memcpy(buffer.data() + used, data, size);
+        used += size;
+    }
+
+    void finish() {}
+};
+
+class FileWriter {
+    int fd;
+    std::vector<char> pending;
+
+ public:
+    explicit FileWriter(int fd)
+    : fd(fd) {
+        pending.reserve(snapshot_chunk_size);
+    }
+
+    void write(const void *data, std::size_t size) {
+        const char *const bytes = static_cast<const char*>(data);
+        pending.insert(pending.end(), bytes, bytes + size);
+        if (pending.size() >= snapshot_chunk_size) {
+            finish();
+        }
+    }
+
+    // Write whatever is pending.
+    void finish() {
+        write_fully(fd, pending.data(), pending.size());
+        pending.clear();
+    }
+};
+
+template <typename T, typename Writer>
+void write_snapshot(Writer& writer, const std::vector<SnapshotRun<T>>& runs) {
+    std::uint64_t size = 0;
+    for (const auto& run : runs) {
+        size += run.count;
+    }
+    const SnapshotHeader header{snapshot_magic, snapshot_version, sizeof(T), 0, size, runs.size()};
+    writer.write(&header, sizeof header);
+    for (const auto& run : runs) {
+        writer.write(run.value, sizeof(T));
+        writer.write(&run.count, sizeof run.count);
+    }
+    writer.finish();
+}
+
+// `BufferReader` and `FileReader` are the sources of `read_snapshot`, which
+// announces with `expect` how many more bytes the snapshot has before
+// reading them.
+class BufferReader {
+    std::span<const char> buffer;
+    std::size_t used;
+    std::size_t expected;
+
+ public:
+    explicit BufferReader(std::span<const char> buffer)
+    : buffer(buffer)
+    , used(0)
+    , expected(0) {}
+
+    void expect(std::uint64_t size) {
+        if (size > buffer.size() - expected) {
+            throw SnapshotError("snapshot is truncated");
+        }
+        expected += size;
+    }
+
+    void read(void *data, std::size_t size) {
+        assert(size <= expected - used);
+        std::memcpy(data, buffer.data() + used, size);
+        used += size;
+    }
+
+    std::size_t bytes_read() const {
+        return used;
+    }
+};
+
+class FileReader {
+    int fd;
+    std::vector<char> chunk;
+    std::size_t offset;
+    // The number of bytes of the snapshot not yet read from `fd`. Reading
+    // no more than this leaves `fd` just after the snapshot.
+    std::uint64_t unread;
+
+ public:
+    explicit FileReader(int fd)
+    : fd(fd)
+    , offset(0)
+    , unread(0) {}
+
+    void expect(std::uint64_t size) {
+        unread += size;
+    }
+
+    void read(void *data, std::size_t size) {
+        char *out = static_cast<char*>(data);
+        while (size) {
+            if (offset == chunk.size()) {
+                assert(unread);
+                chunk.resize(std::min<std::uint64_t>(unread, snapshot_chunk_size));
+                read_fully(fd, chunk.data(), chunk.size());
+                unread -= chunk.size();
+                offset = 0;
+            }
+            const std::size_t count = std::min(size, chunk.size() - offset);
+            std::memcpy(out, chunk.data() + offset, count);
+            out += count;
+            offset += count;
+            size -= count;
+        }
+    }
+
+};
+
+// Read and check a snapshot of elements whose keys are given by `GetKey` and
+// ordered by `Compare`, and return its runs, each an element and its count.
+template <typename T, typename GetKey, typename Compare, typename Reader>
+std::vector<std::pair<T, std::uint64_t>> read_snapshot(Reader& reader) {
+    static_assert(std::is_trivially_copyable_v<T>, "snapshots require trivially copyable elements");
+    SnapshotHeader header;
+    reader.expect(sizeof header);
+    reader.read(&header, sizeof header);
+    if (header.magic != snapshot_magic) {
+        throw SnapshotError("not a snapshot, or written on a machine of different byte order");
+    }
+    if (header.version != snapshot_version) {
+        throw SnapshotError("unsupported snapshot version");
+    }
+    if (header.element_size != sizeof(T) || header.reserved != 0) {
+        throw SnapshotError("snapshot has a different element type");
+    }
+    constexpr std::size_t run_bytes = sizeof(T) + sizeof(std::uint64_t);
+    if (header.runs > header.size || header.runs > std::numeric_limits<std::uint64_t>::max() / run_bytes) {
+        throw SnapshotError("snapshot is corrupt");
+    }
+    reader.expect(header.runs * run_bytes);
+
+    std::vector<std::pair<T, std::uint64_t>> runs;
+    // A corrupt count mustn't cause a huge allocation before the data runs
+    // out.
+    runs.reserve(std::min<std::uint64_t>(header.runs, snapshot_chunk_size));
+    std::uint64_t size = 0;
+    for (std::uint64_t i = 0; i < header.runs; ++i) {
+        std::array<char, sizeof(T)> bytes;
+        reader.read(bytes.data(), bytes.size());
+        std::uint64_t count;
+        reader.read(&count, sizeof count);
+        const T value = std::bit_cast<T>(bytes);
+        if (count == 0 || count > header.size - size ||
+            (!runs.empty() && less<Compare>(GetKey()(value), GetKey()(runs.back().first)))) {
+            throw SnapshotError("snapshot is corrupt");
+        }
+        size += count;
+        runs.emplace_back(value, count);
+    }
+    if (size != header.size) {
+        throw SnapshotError("snapshot is corrupt");
+    }
+    return runs;
+}
+
+// `RunIterator` visits each element of a sequence of runs as many times as
+// it's counted, so that restoring can use the same bulk construction as
+// `Tree::assign`.
+template <typename T>
+class RunIterator {
+    const std::pair<T, std::uint64_t> *run;
+    std::uint64_t index;
+
+ public:
+    using iterator_concept = std::forward_iterator_tag;
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    RunIterator()
+    : run()
+    , index() {}
+
+    RunIterator(const std::pair<T, std::uint64_t> *run)
+    : run(run)
+    , index(0) {}
+
+    const T& operator*() const {
+        return run->first;
+    }
+
+    RunIterator& operator++() {
+        if (++index == run->second) {
+            ++run;
+            index = 0;
+        }
+        return *this;
+    }
+
+    RunIterator operator++(int) {
+        RunIterator old = *this;
+        ++*this;
+        return old;
+    }
+
+    friend bool operator==(const RunIterator&, const RunIterator&) = default;
+};
+
+template <typename T>
+std::ranges::subrange<RunIterator<T>> elements_of(const std::vector<std::pair<T, std::uint64_t>>& runs) {
+    return {RunIterator<T>(runs.data()), RunIterator<T>(runs.data() + runs.size())};
+}
+
+// Replace the elements of the specified `tree` with the specified `runs`. A
+// `StoreCounts` tree takes the runs as they are, rather than visiting each
+// element.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void assign_runs(Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree, const std::vector<std::pair<T, std::uint64_t>>& runs) {
+    if constexpr (std::is_same_v<Duplicates, StoreCounts>) {
+        tree.assign_counts(sorted_equivalent, runs.begin(), runs.end());
+    } else {
+        const auto elements = elements_of(runs);
+        tree.assign(sorted_equivalent, elements.begin(), elements.end());
+    }
+}
+
+} // namespace detail
+
+// Return the number of bytes in a snapshot of the specified `tree`.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t snapshot_size(const Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree) {
+    return detail::snapshot_bytes<T>(detail::runs_of(tree).size());
+}
+
+// Write a snapshot of the specified `tree` to the beginning of the specified
+// `buffer`, and return the number of bytes written. Throw `SnapshotError`,
+// without writing anything, if `buffer` is smaller than
+// `snapshot_size(tree)`. Finding the runs takes O(n) time, or O(k log n) time
+// for a `StoreCounts` tree of `k` distinct elements.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t save_snapshot(const Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree, std::span<char> buffer) {
+    const auto runs = detail::runs_of(tree);
+    if (detail::snapshot_bytes<T>(runs.size()) > buffer.size()) {
+        throw SnapshotError("snapshot buffer is too small");
+    }
+    detail::BufferWriter writer(buffer);
+    detail::write_snapshot(writer, runs);
+    return detail::snapshot_bytes<T>(runs.size());
+}
+
+// Write a snapshot of the specified `tree` to the specified file descriptor
+// `fd`. Throw `std::system_error` if writing fails.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void save_snapshot(const Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree, int fd) {
+    detail::FileWriter writer(fd);
+    detail::write_snapshot(writer, detail::runs_of(tree));
+}
+
+// Replace the elements of the specified `tree` with those of the snapshot at
+// the beginning of the specified `buffer`, and return the size of the
+// snapshot in bytes. If `buffer` doesn't begin with a valid snapshot of `T`
+// elements, then throw `SnapshotError` and leave `tree` unchanged. The tree
+// is built as by `Tree::assign` of sorted elements, in O(n) time, or in O(k)
+// time for a `StoreCounts` tree of `k` distinct elements.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t restore_snapshot(Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree, std::span<const char> buffer) {
+    detail::BufferReader reader(buffer);
+    detail::assign_runs(tree, detail::read_snapshot<T, GetKey, Compare>(reader));
+    return reader.bytes_read();
+}
+
+// Replace the elements of the specified `tree` with those of the snapshot
+// read from the specified file descriptor `fd`, which is left just after
+// the snapshot. Throw as `restore_snapshot` from a buffer does, or throw
+// `std::system_error` if reading fails.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void restore_snapshot(Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>& tree, int fd) {
+    detail::FileReader reader(fd);
+    detail::assign_runs(tree, detail::read_snapshot<T, GetKey, Compare>(reader));
+}
+
+// The following are the same as those above, but for a `KthPercentile`,
+// whose elements must first be sorted, in O(n log n) time.
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+std::size_t snapshot_size(const KthPercentile<Value, percentile, Key, Compare>& kth) {
+    return detail::snapshot_bytes<Value>(detail::runs_of(kth.sorted_elements()).size());
+}
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+std::size_t save_snapshot(const KthPercentile<Value, percentile, Key, Compare>& kth, std::span<char> buffer) {
+    const std::vector<Value> sorted = kth.sorted_elements();
+    const auto runs = detail::runs_of(sorted);
+    if (detail::snapshot_bytes<Value>(runs.size()) > buffer.size()) {
+        throw SnapshotError("snapshot buffer is too small");
+    }
+    detail::BufferWriter writer(buffer);
+    detail::write_snapshot(writer, runs);
+    return detail::snapshot_bytes<Value>(runs.size());
+}
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+void save_snapshot(const KthPercentile<Value, percentile, Key, Compare>& kth, int fd) {
+    const std::vector<Value> sorted = kth.sorted_elements();
+    detail::FileWriter writer(fd);
+    detail::write_snapshot(writer, detail::runs_of(sorted));
+}
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+std::size_t restore_snapshot(KthPercentile<Value, percentile, Key, Compare>& kth, std::span<const char> buffer) {
+    detail::BufferReader reader(buffer);
+    kth.assign_sorted(detail::elements_of(detail::read_snapshot<Value, Key, Compare>(reader)));
+    return reader.bytes_read();
+}
+
+template <typename Value, std::size_t percentile, typename Key, typename Compare>
+void restore_snapshot(KthPercentile<Value, percentile, Key, Compare>& kth, int fd) {
+    detail::FileReader reader(fd);
+    kth.assign_sorted(detail::elements_of(detail::read_snapshot<Value, Key, Compare>(reader)));
+}
+
+} // namespace order_statistics
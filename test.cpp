@@ -1,12 +1,28 @@
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cmath>
 #include <cstdint>
+#include <deque>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <random>
+#include <set>
+#include <ranges>
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include "btree.h"
+#include "kll-sketch.h"
 #include "kth-percentile.h"
+#include "simd.h"
+#include "sharded-recorder.h"
+#include "sliding-window.h"
+#include "snapshot.h"
 #include "tree.h"
 #include "test.h"
 
@@ -166,6 +182,124 @@ void test_kth_percentile() {
     }
 }
 
+void test_kth_percentile_batch() {
+    // Batches of various sizes, including empty ones, and percentiles whose
+    // targets a floating point calculation would round down, e.g. 0.29 * 100.
+    std::mt19937 generator(29);
+    std::uniform_int_distribution<int> value_of(0, 1000);
+    order_statistics::KthPercentile<int, 1> p1;
+    order_statistics::KthPercentile<int, 29> p29;
+    order_statistics::KthPercentile<int, 50> p50;
+    order_statistics::KthPercentile<int, 100> p100;
+    std::vector<int> sorted;
+    for (const std::size_t batch_size : {1, 0, 5, 100, 1, 1, 2000, 3, 0, 700}) {
+        std::vector<int> batch;
+        for (std::size_t i = 0; i < batch_size; ++i) {
+            batch.push_back(value_of(generator));
+        }
+        p1.insert_batch(batch);
+        p29.insert_batch(std::span<const int>(batch));
+        p50.insert_batch(std::vector<int>(batch));
+        p100.insert_batch(batch | std::views::transform([](int value) { return value; }));
+        sorted.insert(sorted.end(), batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+
+        ADD_CONTEXT(sorted.size());
+        ASSERT_EQUAL(p1.size(), sorted.size());
+        ASSERT_EQUAL(p1.get(), sorted[1 * sorted.size() / 100]);
+        ASSERT_EQUAL(p29.get(), sorted[29 * sorted.size() / 100]);
+        ASSERT_EQUAL(p50.get(), sorted[50 * sorted.size() / 100]);
+        ASSERT_EQUAL(p100.get(), sorted.back());
+
+        // Single insertions and batches can be mixed.
+        const int value = value_of(generator);
+        p1.insert(value);
+        p29.insert(value);
+        p50.insert(value);
+        p100.insert(value);
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), value), value);
+        ASSERT_EQUAL(p29.get(), sorted[29 * sorted.size() / 100]);
+        ASSERT_EQUAL(p100.get(), sorted.back());
+    }
+}
+
+void test_min_max_heap() {
+    // Interleave pushes with pops from both ends, and compare against a
+    // sorted vector. Pushes are more likely, so that the heap grows deep.
+    order_statistics::detail::MinMaxHeap<int, std::less<int>> heap;
+    std::vector<int> sorted;
+    std::mt19937 generator(3);
+    std::uniform_int_distribution<int> value_of(0, 50);
+    std::uniform_int_distribution<int> action_of(0, 4);
+    for (int i = 0; i < 20000; ++i) {
+        ADD_CONTEXT(i);
+        const int action = action_of(generator);
+        if (sorted.empty() || action < 3) {
+            const int value = value_of(generator);
+            heap.push(value);
+            sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), value), value);
+        } else if (action == 3) {
+            ASSERT_EQUAL(heap.pop_min(), sorted.front());
+            sorted.erase(sorted.begin());
+        } else {
+            ASSERT_EQUAL(heap.pop_max(), sorted.back());
+            sorted.pop_back();
+        }
+        ASSERT_EQUAL(heap.size(), sorted.size());
+        if (!sorted.empty()) {
+            ASSERT_EQUAL(heap.min(), sorted.front());
+            ASSERT_EQUAL(heap.max(), sorted.back());
+        }
+    }
+}
+
+void test_multi_percentile() {
+    // The same fish as `test_kth_percentile`, all percentiles at once.
+    const auto by_age = [](const Fish& fish) { return fish.age; };
+    order_statistics::FixedMultiPercentile<Fish, decltype(by_age), 10, 50, 70, 95> fixed;
+    std::vector<Fish> sorted;
+    for (const Fish& fish : fishes) {
+        fixed.insert(fish);
+        sorted.push_back(fish);
+        std::sort(sorted.begin(), sorted.end(),
+            [](const Fish& left, const Fish& right) { return left.age < right.age; });
+
+        ADD_CONTEXT(sorted.size());
+        ADD_CONTEXT(fish);
+        ASSERT_EQUAL(fixed.size(), sorted.size());
+        ASSERT_EQUAL(fixed.get(0).age, sorted[10 * sorted.size() / 100].age);
+        ASSERT_EQUAL(fixed.get(1).age, sorted[50 * sorted.size() / 100].age);
+        ASSERT_EQUAL(fixed.get(2).age, sorted[70 * sorted.size() / 100].age);
+        ASSERT_EQUAL(fixed.get(3).age, sorted[95 * sorted.size() / 100].age);
+    }
+
+    // Many duplicates, percentiles close together, and the 100th percentile.
+    for (const int distinct : {3, 100, 100000}) {
+        ADD_CONTEXT(distinct);
+        const std::vector<double> percents{1, 50, 90, 99, 99.9, 100};
+        order_statistics::MultiPercentile<int> multi(percents);
+        std::mt19937 generator(distinct);
+        std::uniform_int_distribution<int> value_of(0, distinct - 1);
+        std::vector<int> values;
+        for (int i = 0; i < 3000; ++i) {
+            const int value = value_of(generator);
+            if (i % 2) {
+                multi.insert(value);
+            } else {
+                int copy = value;
+                multi.insert(std::move(copy));
+            }
+            values.insert(std::upper_bound(values.begin(), values.end(), value), value);
+            ADD_CONTEXT(values.size());
+            for (std::size_t j = 0; j < percents.size(); ++j) {
+                ADD_CONTEXT(percents[j]);
+                const std::size_t rank = std::min(std::size_t(percents[j] * values.size() / 100), values.size() - 1);
+                ASSERT_EQUAL(multi.get(j), values[rank]);
+            }
+        }
+    }
+}
+
 void test_enclosing_power_of_2() {
     // `oracle` calculates the expected answer in a different way than the true
     // implementation.
@@ -190,8 +324,8 @@ void test_enclosing_power_of_2() {
     } while (i != 0);
 }
 
-template <typename T>
-void debug_print(std::ostream& out, order_statistics::TreeNode<T> *node, int indent = 0) {
+template <typename T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+void debug_print(std::ostream& out, order_statistics::TreeNode<T, Aggregate, Duplicates, CachedKey, Versions> *node, int indent = 0) {
     static const auto tabstop = std::string(2, ' ');
     for (int i = 0; i < indent; ++i) {
         out << tabstop;
@@ -312,8 +446,1542 @@ void test_tree() {
     }
 }
 
+// Verify that the subtree rooted at `node` is ordered by `GetKey`, that each
+// node's `height` and `weight` are consistent with its children, and that the
+// subtree is AVL balanced. Return the height of the subtree.
+template <typename T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions, typename GetKey>
+std::size_t check_invariants(const order_statistics::TreeNode<T, Aggregate, Duplicates, CachedKey, Versions> *node, const GetKey& get_key) {
+    if (!node) {
+        return 0;
+    }
+    ASSERT_EQUAL(node->values().empty(), false);
+    for (const T& value : node->values()) {
+        ASSERT_EQUAL(get_key(value) == get_key(node->values()[0]), true);
+    }
+    if (node->left) {
+        ASSERT_EQUAL(get_key(node->left->values()[0]) < get_key(node->values()[0]), true);
+    }
+    if (node->right) {
+        ASSERT_EQUAL(get_key(node->values()[0]) < get_key(node->right->values()[0]), true);
+    }
+    if constexpr (!std::is_void_v<CachedKey>) {
+        ASSERT_EQUAL(node->cached_key == get_key(node->values()[0]), true);
+    }
+    const std::size_t left_height = check_invariants(node->left, get_key);
+    const std::size_t right_height = check_invariants(node->right, get_key);
+    ASSERT_EQUAL(std::size_t(node->height), 1 + std::max(left_height, right_height));
+    ASSERT_EQUAL(left_height <= right_height + 1 && right_height <= left_height + 1, true);
+    ASSERT_EQUAL(node->weight, node->values().size() + node->left_weight() + node->right_weight());
+    return node->height;
+}
+
+template <typename Allocator>
+void test_tree_erase() {
+    // Insert and erase random keys having lots of duplicates, and compare the
+    // tree with a sorted vector after each operation.
+    order_statistics::Tree<int, std::identity, Allocator> tree;
+    std::vector<int> sorted;
+    std::mt19937 generator(1234);
+    std::uniform_int_distribution<int> key_of(0, 40);
+    std::uniform_int_distribution<int> coin(0, 9);
+
+    for (int i = 0; i < 4000; ++i) {
+        ADD_CONTEXT(i);
+        const int key = key_of(generator);
+        ADD_CONTEXT(key);
+        const auto [begin, end] = std::equal_range(sorted.begin(), sorted.end(), key);
+        // Lean toward inserting at first, and toward erasing afterward, so
+        // that nodes grow and then shrink back into `in_place` storage.
+        const int insert_odds = i < 2000 ? 6 : 3;
+        if (coin(generator) < insert_odds) {
+            tree.insert(key);
+            sorted.insert(end, key);
+        } else if (coin(generator) == 0) {
+            ASSERT_EQUAL(tree.erase(key), std::size_t(end - begin));
+            sorted.erase(begin, end);
+        } else {
+            ASSERT_EQUAL(tree.erase_one_by_key(key), begin != end);
+            if (begin != end) {
+                sorted.erase(begin);
+            }
+        }
+
+        ASSERT_EQUAL(tree.size(), sorted.size());
+        check_invariants(tree.get_root_for_testing(), std::identity());
+        if (!sorted.empty()) {
+            const std::size_t rank = (i * 7919) % sorted.size();
+            ASSERT_EQUAL(tree.nth_element(rank), sorted[rank]);
+        }
+    }
+
+    // Erase everything that's left.
+    while (!sorted.empty()) {
+        ASSERT_EQUAL(tree.erase_one_by_key(sorted.back()), true);
+        sorted.pop_back();
+        ASSERT_EQUAL(tree.size(), sorted.size());
+        check_invariants(tree.get_root_for_testing(), std::identity());
+    }
+    ASSERT_EQUAL(tree.erase_one_by_key(1), false);
+    ASSERT_EQUAL(tree.erase(1), 0u);
+}
+
+// `FailingAllocator` is a `HeapAllocator` that throws `std::bad_alloc`
+// instead while `failing` is true.
+class FailingAllocator : public order_statistics::HeapAllocator {
+ public:
+    static inline bool failing = false;
+
+    void *allocate(std::size_t size) {
+        if (failing) {
+            throw std::bad_alloc();
+        }
+        return HeapAllocator::allocate(size);
+    }
+};
+
+void test_tree_erase_allocation_failure() {
+    // Erasing shrinks a node's storage once it's a quarter full. If that
+    // allocation fails, the erase still succeeds, and the node's ancestors
+    // still count the right number of elements.
+    order_statistics::Tree<int, std::identity, FailingAllocator> tree;
+    for (int key = 0; key < 20; ++key) {
+        tree.insert(key);
+    }
+    for (int i = 0; i < 64; ++i) {
+        tree.insert(3);
+    }
+    ASSERT_EQUAL(tree.get_root_for_testing()->values()[0] != 3, true);
+    FailingAllocator::failing = true;
+    for (std::size_t count = 65; count > 1; --count) {
+        ADD_CONTEXT(count);
+        ASSERT_EQUAL(tree.erase_one_by_key(3), true);
+        ASSERT_EQUAL(tree.size(), 19 + count - 1);
+        ASSERT_EQUAL(tree.equal_range(3).size(), count - 1);
+        check_invariants(tree.get_root_for_testing(), std::identity());
+    }
+    FailingAllocator::failing = false;
+    ASSERT_EQUAL(tree.nth_element(3), 3);
+    ASSERT_EQUAL(tree.nth_element(4), 4);
+}
+
+void test_tree_node_in_place() {
+    using order_statistics::TreeNode;
+    static_assert(sizeof(TreeNode<std::uint32_t>) == 32);
+    static_assert(TreeNode<std::uint16_t>::in_place_capacity == sizeof(char*) / 2);
+    static_assert(TreeNode<std::uint64_t>::in_place_capacity == 1);
+    static_assert(TreeNode<std::string>::in_place_capacity == 1);
+
+    // Grow one node past its in-place capacity, and shrink it back, checking
+    // its elements and where they're stored at each size.
+    using Node = TreeNode<std::uint16_t>;
+    order_statistics::HeapAllocator allocator;
+    Node node(std::uint16_t(0));
+    const auto check = [&](std::size_t size) {
+        ADD_CONTEXT(size);
+        ASSERT_EQUAL(node.size(), size);
+        ASSERT_EQUAL(node.storage == Node::IN_PLACE, size <= Node::in_place_capacity);
+        for (std::size_t i = 0; i < size; ++i) {
+            ASSERT_EQUAL(node.values()[i], std::uint16_t(i));
+        }
+    };
+    for (std::size_t size = 2; size <= 3 * Node::in_place_capacity; ++size) {
+        node.insert(allocator, std::uint16_t(size - 1));
+        check(size);
+    }
+    while (node.size() > 2) {
+        node.pop_back(allocator);
+        check(node.size());
+    }
+    node.truncate(allocator, 1);
+    check(1);
+    node.reserve(allocator, 2 * Node::in_place_capacity);
+    ASSERT_EQUAL(node.storage == Node::ALLOCATED, true);
+    ASSERT_EQUAL(node.values().size(), 1u);
+    ASSERT_EQUAL(node.values()[0], std::uint16_t(0));
+    node.destroy_values(allocator);
+}
+
+void test_arena_allocator() {
+    using order_statistics::detail::Arena;
+    ASSERT_EQUAL(Arena::rounded_size(1), Arena::granularity);
+    ASSERT_EQUAL(Arena::rounded_size(40), 48u);
+    ASSERT_EQUAL(Arena::rounded_size(256), 256u);
+    ASSERT_EQUAL(Arena::rounded_size(257), 512u);
+    ASSERT_EQUAL(Arena::rounded_size(Arena::max_pooled_size), Arena::max_pooled_size);
+
+    // Blocks of every size class, and some that are too large for any, are
+    // recycled and don't overlap. AddressSanitizer would notice otherwise.
+    order_statistics::ArenaAllocator allocator;
+    std::vector<std::pair<char*, std::size_t>> blocks;
+    for (std::size_t size = 1; size <= 2 * Arena::max_pooled_size; size = size * 3 / 2 + 1) {
+        for (int i = 0; i < 3; ++i) {
+            char *const block = static_cast<char*>(allocator.allocate(size));
+            std::fill(block, block + size, char(blocks.size()));
+            blocks.emplace_back(block, size);
+        }
+    }
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        ADD_CONTEXT(i);
+        const auto [block, size] = blocks[i];
+        ASSERT_EQUAL(std::count(block, block + size, char(i)), std::ptrdiff_t(size));
+        if (i % 2) {
+            allocator.deallocate(block, size);
+        }
+    }
+
+    // A tree whose allocator is shared can't release everything at once.
+    const auto by_length = [](const std::string& str) { return str.size(); };
+    order_statistics::ArenaAllocator copy = allocator;
+    ASSERT_EQUAL(allocator.can_release_all(), false);
+    {
+        order_statistics::Tree<std::string, decltype(by_length), order_statistics::ArenaAllocator> tree(copy);
+        for (int i = 0; i < 1000; ++i) {
+            tree.insert(std::string(i % 37, 'x'));
+        }
+        tree.clear();
+        ASSERT_EQUAL(tree.size(), 0u);
+        tree.insert("hello");
+        ASSERT_EQUAL(tree.nth_element(0), "hello");
+    }
+
+    // But a tree that has its allocator to itself can.
+    order_statistics::Tree<std::string, decltype(by_length), order_statistics::ArenaAllocator> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(std::string(i % 37, 'x'));
+    }
+    tree.clear();
+    ASSERT_EQUAL(tree.size(), 0u);
+    tree.insert("hello");
+    ASSERT_EQUAL(tree.nth_element(0), "hello");
+}
+
+template <typename Allocator>
+void test_tree_merge(bool share_allocator) {
+    // Merged elements having the same key as existing elements come after
+    // them, so use pairs whose second member is the order of insertion
+    // across both trees.
+    using Pair = std::pair<int, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    const auto first_less = [](const Pair& left, const Pair& right) { return left.first < right.first; };
+    std::mt19937 generator(12);
+
+    for (const int ours_size : {0, 1, 10, 300, 3000}) {
+        for (const int theirs_size : {0, 1, 10, 300, 3000}) {
+            ADD_CONTEXT(ours_size);
+            ADD_CONTEXT(theirs_size);
+            std::uniform_int_distribution<int> key_of(0, std::max(ours_size, theirs_size) / 2);
+            const Allocator allocator;
+            order_statistics::Tree<Pair, decltype(by_first), Allocator> ours(allocator);
+            order_statistics::Tree<Pair, decltype(by_first), Allocator> theirs(share_allocator ? allocator : Allocator());
+            std::vector<Pair> expected;
+            int order = 0;
+            for (int i = 0; i < ours_size; ++i) {
+                ours.insert(Pair(key_of(generator), order++));
+            }
+            for (std::size_t rank = 0; rank < ours.size(); ++rank) {
+                expected.push_back(ours.nth_element(rank));
+            }
+            for (int i = 0; i < theirs_size; ++i) {
+                const Pair pair(key_of(generator), order++);
+                theirs.insert(pair);
+                expected.insert(std::upper_bound(expected.begin(), expected.end(), pair, first_less), pair);
+            }
+
+            ours.merge(std::move(theirs));
+            ASSERT_EQUAL(theirs.size(), 0u);
+            ASSERT_EQUAL(ours.size(), expected.size());
+            check_invariants(ours.get_root_for_testing(), by_first);
+            for (std::size_t rank = 0; rank < expected.size(); ++rank) {
+                ADD_CONTEXT(rank);
+                ASSERT_EQUAL(ours.nth_element(rank) == expected[rank], true);
+            }
+
+            // Both trees remain usable.
+            theirs.insert(Pair(0, -1));
+            ASSERT_EQUAL(theirs.size(), 1u);
+            ours.erase(Pair(0, 0));
+            check_invariants(ours.get_root_for_testing(), by_first);
+        }
+    }
+}
+
+void test_tree_split_join() {
+    // Split a tree having many duplicates at every rank and at every key,
+    // check both halves, and then join them back together.
+    using Pair = std::pair<int, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    std::mt19937 generator(13);
+    std::uniform_int_distribution<int> key_of(0, 20);
+    std::vector<Pair> pairs;
+    for (int i = 0; i < 200; ++i) {
+        pairs.emplace_back(key_of(generator), i);
+    }
+    using Tree = order_statistics::Tree<Pair, decltype(by_first), order_statistics::ArenaAllocator>;
+    Tree tree(pairs.begin(), pairs.end());
+    std::vector<Pair> sorted;
+    for (std::size_t rank = 0; rank < tree.size(); ++rank) {
+        sorted.push_back(tree.nth_element(rank));
+    }
+    const auto check = [&](const Tree& lower, const Tree& upper, std::size_t rank) {
+        ASSERT_EQUAL(lower.size(), rank);
+        ASSERT_EQUAL(upper.size(), sorted.size() - rank);
+        check_invariants(lower.get_root_for_testing(), by_first);
+        check_invariants(upper.get_root_for_testing(), by_first);
+        for (std::size_t i = 0; i < sorted.size(); ++i) {
+            ADD_CONTEXT(i);
+            const Pair& actual = i < rank ? lower.nth_element(i) : upper.nth_element(i - rank);
+            ASSERT_EQUAL(actual == sorted[i], true);
+        }
+    };
+
+    for (std::size_t rank = 0; rank <= sorted.size(); ++rank) {
+        ADD_CONTEXT(rank);
+        Tree upper;
+        tree.split_at_rank(rank, upper);
+        check(tree, upper, rank);
+        tree.join(std::move(upper));
+        ASSERT_EQUAL(upper.size(), 0u);
+        check(tree, upper, sorted.size());
+    }
+
+    for (int key = -1; key <= 22; ++key) {
+        ADD_CONTEXT(key);
+        Tree upper;
+        tree.split_at_key(key, upper);
+        const std::size_t rank = std::partition_point(sorted.begin(), sorted.end(),
+            [&](const Pair& pair) { return pair.first < key; }) - sorted.begin();
+        check(tree, upper, rank);
+        tree.join(std::move(upper));
+        check(tree, upper, sorted.size());
+    }
+
+    // Joining trees that don't share an allocator copies the elements.
+    Tree upper;
+    tree.split_at_rank(150, upper);
+    Tree other_arena;
+    other_arena.join(std::move(upper));
+    tree.join(std::move(other_arena));
+    check(tree, upper, sorted.size());
+
+    // When our greatest key is `upper`'s least, and the least node has
+    // duplicates and a right child, the combined node's elements are each
+    // destroyed once.
+    order_statistics::Tree<std::string> lower;
+    lower.insert("a");
+    order_statistics::Tree<std::string> strings;
+    for (const char *value : {"a", "a", "b"}) {
+        strings.insert(value);
+    }
+    ASSERT_EQUAL(strings.get_root_for_testing()->right != nullptr, true);
+    lower.join(std::move(strings));
+    ASSERT_EQUAL(lower.size(), 4u);
+    check_invariants(lower.get_root_for_testing(), std::identity());
+    ASSERT_EQUAL(lower.nth_elements(0).size(), 3u);
+    ASSERT_EQUAL(lower.nth_element(3), "b");
+}
+
+void test_tree_iterators() {
+    using Tree = order_statistics::Tree<std::pair<int, int>, decltype([](const std::pair<int, int>& pair) { return pair.first; })>;
+    static_assert(std::bidirectional_iterator<Tree::const_iterator>);
+    static_assert(std::ranges::bidirectional_range<Tree>);
+
+    Tree empty;
+    ASSERT_EQUAL(empty.begin() == empty.end(), true);
+    ASSERT_EQUAL(empty.lower_bound(0) == empty.end(), true);
+    ASSERT_EQUAL(empty.range(0, 0).empty(), true);
+
+    // Keys are even, so that odd keys are absent, and there are duplicates.
+    std::mt19937 generator;
+    std::uniform_int_distribution<int> key_of(0, 199);
+    for (const int n : {1, 2, 10, 1000}) {
+        ADD_CONTEXT(n);
+        Tree tree;
+        std::vector<std::pair<int, int>> expected;
+        for (int i = 0; i < n; ++i) {
+            const std::pair<int, int> pair(key_of(generator) * 2, i);
+            tree.insert(pair);
+            expected.insert(std::upper_bound(expected.begin(), expected.end(), pair, [](const auto& left, const auto& right) {
+                return left.first < right.first;
+            }), pair);
+        }
+        ASSERT_EQUAL(std::ranges::equal(tree, expected), true);
+        ASSERT_EQUAL(std::ranges::equal(tree | std::views::reverse, expected | std::views::reverse), true);
+        ASSERT_EQUAL(std::size_t(std::ranges::distance(tree)), tree.size());
+
+        // Walking back and forth from the middle visits the same elements.
+        auto iter = tree.range(n / 2, n).begin();
+        for (int i = n / 2; i > 0; --i) {
+            ADD_CONTEXT(i);
+            ASSERT_EQUAL(*--iter == expected[i - 1], true);
+        }
+        ASSERT_EQUAL(iter == tree.begin(), true);
+        ASSERT_EQUAL(iter++ == tree.begin(), true);
+        ASSERT_EQUAL(iter == std::next(tree.begin()), true);
+
+        for (int key = -1; key <= 400; ++key) {
+            ADD_CONTEXT(key);
+            const auto by_key = [](const std::pair<int, int>& pair) { return pair.first; };
+            const auto lower = std::ranges::lower_bound(expected, key, {}, by_key) - expected.begin();
+            const auto upper = std::ranges::upper_bound(expected, key, {}, by_key) - expected.begin();
+            ASSERT_EQUAL(std::distance(tree.begin(), tree.lower_bound(key)), lower);
+            ASSERT_EQUAL(std::distance(tree.begin(), tree.upper_bound(key)), upper);
+        }
+
+        for (int i = 0; i < 50; ++i) {
+            std::size_t lo = std::uniform_int_distribution<std::size_t>(0, n)(generator);
+            std::size_t hi = std::uniform_int_distribution<std::size_t>(0, n)(generator);
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            ADD_CONTEXT(lo);
+            ADD_CONTEXT(hi);
+            const auto range = tree.range(lo, hi);
+            ASSERT_EQUAL(std::ranges::equal(range, std::span(expected).subspan(lo, hi - lo)), true);
+        }
+    }
+}
+
+// Verify that each node's `KeySums` are the sums over its subtree.
+void check_key_sums(const order_statistics::TreeNode<int, order_statistics::KeySums<>> *node) {
+    if (!node) {
+        return;
+    }
+    check_key_sums(node->left);
+    check_key_sums(node->right);
+    const auto left = node->left_aggregate();
+    const auto right = node->right_aggregate();
+    const double key = node->values()[0];
+    const double size = node->values().size();
+    ASSERT_EQUAL(node->aggregate.sum, left.sum + key * size + right.sum);
+    ASSERT_EQUAL(node->aggregate.sum_of_squares, left.sum_of_squares + key * key * size + right.sum_of_squares);
+}
+
+template <typename Keys>
+void test_tree_key_lookups() {
+    // Look up string keys by `std::string_view`, including keys that aren't
+    // in the tree, and compare with a sorted vector. Only even numbered keys
+    // are inserted.
+    using Pair = std::pair<std::string, int>;
+    const auto by_first = [](const Pair& pair) -> const std::string& { return pair.first; };
+    using Tree = order_statistics::Tree<Pair, decltype(by_first), order_statistics::HeapAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, Keys>;
+    Tree tree;
+    ASSERT_EQUAL(tree.rank_of_key(std::string_view("k0")), 0u);
+    ASSERT_EQUAL(tree.count_of_key(std::string_view("k0")), 0u);
+    ASSERT_EQUAL(tree.equal_range_of_key(std::string_view("k0")).empty(), true);
+
+    std::vector<Pair> sorted;
+    std::mt19937 generator;
+    std::uniform_int_distribution<int> number_of(0, 50);
+    const auto key_of = [](int number) { return "k" + std::to_string(number); };
+    const auto check = [&]() {
+        check_invariants(tree.get_root_for_testing(), by_first);
+        for (int number = 0; number <= 101; ++number) {
+            const std::string key = key_of(number);
+            ADD_CONTEXT(key);
+            const auto lower = std::lower_bound(sorted.begin(), sorted.end(), key, [](const Pair& pair, const std::string& key) {
+                return pair.first < key;
+            });
+            const auto upper = std::upper_bound(sorted.begin(), sorted.end(), key, [](const std::string& key, const Pair& pair) {
+                return key < pair.first;
+            });
+            ASSERT_EQUAL(tree.rank_of_key(std::string_view(key)), std::size_t(lower - sorted.begin()));
+            ASSERT_EQUAL(tree.count_of_key(std::string_view(key)), std::size_t(upper - lower));
+            const auto values = tree.equal_range_of_key(std::string_view(key));
+            ASSERT_EQUAL(std::equal(values.begin(), values.end(), lower, upper), true);
+            if (lower != upper) {
+                const auto [min, max] = tree.rank(*lower);
+                ASSERT_EQUAL(min, std::size_t(lower - sorted.begin()));
+                ASSERT_EQUAL(max, std::size_t(upper - sorted.begin()) - 1);
+            }
+        }
+    };
+
+    for (int i = 0; i < 500; ++i) {
+        ADD_CONTEXT(i);
+        const Pair pair{key_of(2 * number_of(generator)), i};
+        tree.insert(pair);
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), pair, [](const Pair& left, const Pair& right) {
+            return left.first < right.first;
+        }), pair);
+        if (i % 5 == 0) {
+            const std::string key = key_of(2 * number_of(generator));
+            tree.erase_one_by_key(key);
+            const auto found = std::find_if(sorted.begin(), sorted.end(), [&](const Pair& pair) { return pair.first == key; });
+            if (found != sorted.end()) {
+                // `erase_one_by_key` removes the last inserted of the key.
+                auto last = found;
+                while (std::next(last) != sorted.end() && std::next(last)->first == key) {
+                    ++last;
+                }
+                sorted.erase(last);
+            }
+        }
+        if (i % 50 == 0) {
+            check();
+        }
+    }
+    check();
+
+    // Clearing a tree whose arena it has to itself still destroys the keys,
+    // even when the elements themselves are trivially destructible.
+    const auto to_string = [](const char *value) { return std::string(value); };
+    order_statistics::Tree<const char*, decltype(to_string), order_statistics::ArenaAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, Keys> c_strings;
+    for (const char *value : {"a fairly long string, so that it's allocated", "another string that's too long to be small"}) {
+        c_strings.insert(value);
+    }
+    c_strings.clear();
+    ASSERT_EQUAL(c_strings.size(), 0u);
+}
+
+void test_tree_stats_and_counters() {
+    using order_statistics::TreeCounters;
+    using order_statistics::tree_counters;
+    order_statistics::Tree<int> tree;
+    ASSERT_EQUAL(tree.stats().distinct_keys, 0u);
+    ASSERT_EQUAL(tree.stats().height, 0u);
+
+    // Inserting in increasing order only ever rotates left.
+    tree_counters() = TreeCounters{};
+    for (int i = 1; i <= 7; ++i) {
+        tree.insert(i);
+    }
+    if constexpr (order_statistics::counters_enabled) {
+        const TreeCounters counters = tree_counters();
+        ASSERT_EQUAL(counters.left_rotations, 4u);
+        ASSERT_EQUAL(counters.right_rotations, 0u);
+        ASSERT_EQUAL(counters.left_right_rotations, 0u);
+        ASSERT_EQUAL(counters.right_left_rotations, 0u);
+        ASSERT_EQUAL(counters.descents, 7u);
+        ASSERT_EQUAL(counters.reallocations, 0u);
+    }
+
+    // The root is 4, so finding it takes one descent and one three-way
+    // comparison.
+    tree_counters() = TreeCounters{};
+    ASSERT_EQUAL(tree.rank(4).first, 3u);
+    if constexpr (order_statistics::counters_enabled) {
+        ASSERT_EQUAL(tree_counters().descents, 1u);
+        ASSERT_EQUAL(tree_counters().comparisons, 1u);
+    }
+
+    // Two `int` fit in place. The third moves them to room for four, and the
+    // fifth moves those four to room for eight.
+    tree_counters() = TreeCounters{};
+    for (int i = 0; i < 4; ++i) {
+        tree.insert(5);
+    }
+    if constexpr (order_statistics::counters_enabled) {
+        ASSERT_EQUAL(tree_counters().reallocations, 2u);
+        ASSERT_EQUAL(tree_counters().bytes_moved, 6 * sizeof(int));
+    }
+
+    const order_statistics::TreeStats stats = tree.stats();
+    ASSERT_EQUAL(stats.size, 11u);
+    ASSERT_EQUAL(stats.distinct_keys, 7u);
+    ASSERT_EQUAL(stats.height, 3u);
+    ASSERT_EQUAL(stats.duplicates.size(), 3u);
+    ASSERT_EQUAL(stats.duplicates[0], 6u);
+    ASSERT_EQUAL(stats.duplicates[1], 0u);
+    ASSERT_EQUAL(stats.duplicates[2], 1u);
+    ASSERT_EQUAL(stats.node_bytes, 7 * sizeof(order_statistics::TreeNode<int>));
+    ASSERT_EQUAL(stats.allocated_arrays, 1u);
+    ASSERT_EQUAL(stats.array_bytes_allocated, 8 * sizeof(int));
+    ASSERT_EQUAL(stats.array_bytes_used, 5 * sizeof(int));
+}
+
+void test_tree_compare() {
+    using order_statistics::TreeCounters;
+    using order_statistics::tree_counters;
+    // Compare with `std::greater`, a less comparator that has no three-way
+    // form, so the tree is in decreasing order.
+    using Decreasing = order_statistics::Tree<int, std::identity, order_statistics::HeapAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, order_statistics::ComputeKeys, std::greater<>>;
+    Decreasing decreasing;
+    std::vector<int> sorted;
+    std::mt19937 generator;
+    std::uniform_int_distribution<int> key_of(0, 100);
+    for (int i = 0; i < 1000; ++i) {
+        const int key = key_of(generator);
+        decreasing.insert(key);
+        sorted.push_back(key);
+        if (i % 3 == 0) {
+            const int erased = key_of(generator);
+            decreasing.erase(erased);
+            std::erase(sorted, erased);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), std::greater<>());
+    ASSERT_EQUAL(std::equal(decreasing.begin(), decreasing.end(), sorted.begin(), sorted.end()), true);
+    for (int key = -1; key <= 101; ++key) {
+        ADD_CONTEXT(key);
+        const auto lower = std::lower_bound(sorted.begin(), sorted.end(), key, std::greater<>());
+        const auto upper = std::upper_bound(sorted.begin(), sorted.end(), key, std::greater<>());
+        ASSERT_EQUAL(decreasing.rank_of_key(key), std::size_t(lower - sorted.begin()));
+        ASSERT_EQUAL(decreasing.count_of_key(key), std::size_t(upper - lower));
+    }
+    ASSERT_EQUAL(decreasing.percentile(50)[0], sorted[sorted.size() / 2]);
+
+    // Splitting and merging compare keys too.
+    Decreasing upper;
+    decreasing.split_at_key(50, upper);
+    ASSERT_EQUAL(decreasing.size(), std::size_t(std::lower_bound(sorted.begin(), sorted.end(), 50, std::greater<>()) - sorted.begin()));
+    decreasing.merge(std::move(upper));
+    ASSERT_EQUAL(std::equal(decreasing.begin(), decreasing.end(), sorted.begin(), sorted.end()), true);
+
+    // Finding a key equal to the root's takes two calls to a less comparator,
+    // but one call to a three-way comparator.
+    using Strings = order_statistics::Tree<std::string, std::identity, order_statistics::HeapAllocator,
+        order_statistics::NoAggregate, order_statistics::StoreCopies, order_statistics::ComputeKeys, std::compare_three_way>;
+    Strings strings;
+    for (const char *const word : {"cherry", "apple", "date", "banana"}) {
+        strings.insert(word);
+    }
+    ASSERT_EQUAL(strings.rank_of_key(std::string_view("banana")), 1u);
+    ASSERT_EQUAL(strings.rank_of_key(std::string_view("coconut")), 3u);
+    ASSERT_EQUAL(strings.count_of_key(std::string_view("date")), 1u);
+    const int root = decreasing.get_root_for_testing()->values()[0];
+    tree_counters() = TreeCounters{};
+    decreasing.rank(root);
+    if constexpr (order_statistics::counters_enabled) {
+        ASSERT_EQUAL(tree_counters().comparisons, 2u);
+    }
+    tree_counters() = TreeCounters{};
+    strings.rank(strings.get_root_for_testing()->values()[0]);
+    if constexpr (order_statistics::counters_enabled) {
+        ASSERT_EQUAL(tree_counters().comparisons, 1u);
+    }
+
+    // `KthPercentile` takes a comparator too. In decreasing order, the 90th
+    // percentile is near the least element.
+    order_statistics::KthPercentile<int, 90, std::identity, std::greater<>> kth;
+    for (int i = 0; i < 100; ++i) {
+        kth.insert(i);
+    }
+    ASSERT_EQUAL(kth.get(), 9);
+}
+
+void test_tree_persistent() {
+    using order_statistics::TreeCounters;
+    using order_statistics::tree_counters;
+    // Elements are strings keyed by their length, so that nodes have several
+    // elements in `allocated` storage, which snapshots share too.
+    const auto by_length = [](const std::string& value) { return value.size(); };
+    using Strings = order_statistics::PersistentTree<std::string, decltype(by_length)>;
+    const auto stable_sorted = [&](std::vector<std::string> values) {
+        std::stable_sort(values.begin(), values.end(), [&](const std::string& left, const std::string& right) {
+            return by_length(left) < by_length(right);
+        });
+        return values;
+    };
+    Strings tree;
+    std::vector<std::string> inserted;
+    for (int i = 0; i < 1000; ++i) {
+        const std::string value = std::string(i % 100 + 1, 'a' + i % 26);
+        tree.insert(value);
+        inserted.push_back(value);
+    }
+    const std::vector<std::string> before = stable_sorted(inserted);
+
+    {
+        const Strings snapshot = tree.snapshot();
+        // Inserting copies only the path to the new element's node, and that
+        // node's elements.
+        tree_counters() = TreeCounters{};
+        tree.insert(std::string(50, 'z'));
+        inserted.push_back(std::string(50, 'z'));
+        if constexpr (order_statistics::counters_enabled) {
+            ASSERT_EQUAL(tree_counters().node_copies > 0, true);
+            ASSERT_EQUAL(tree_counters().node_copies <= tree.stats().height, true);
+            ASSERT_EQUAL(tree_counters().array_copies, 1u);
+        }
+        // Inserting a new key again copies nothing that's already copied.
+        tree_counters() = TreeCounters{};
+        tree.insert(std::string(150, 'z'));
+        inserted.push_back(std::string(150, 'z'));
+        if constexpr (order_statistics::counters_enabled) {
+            ASSERT_EQUAL(tree_counters().node_copies <= tree.stats().height, true);
+            ASSERT_EQUAL(tree_counters().array_copies, 0u);
+        }
+        // Erasing a node copies also the nodes beside the paths to it and to
+        // its successor, which is still O(log n).
+        tree_counters() = TreeCounters{};
+        ASSERT_EQUAL(tree.erase(std::string(77, '?')), 10u);
+        std::erase_if(inserted, [](const std::string& value) { return value.size() == 77; });
+        if constexpr (order_statistics::counters_enabled) {
+            ASSERT_EQUAL(tree_counters().node_copies <= 4 * tree.stats().height, true);
+        }
+
+        // Change the tree every way there is. The snapshot doesn't change.
+        for (int i = 0; i < 300; ++i) {
+            const std::string value = std::string(i % 150 + 1, 'A' + i % 26);
+            tree.insert(value);
+            inserted.push_back(value);
+            if (i % 7 == 0) {
+                ASSERT_EQUAL(tree.erase_one_by_key(std::size_t(i % 120 + 1)), true);
+                const auto last = std::find_if(inserted.rbegin(), inserted.rend(), [&](const std::string& value) {
+                    return value.size() == std::size_t(i % 120 + 1);
+                });
+                inserted.erase(std::next(last).base());
+            }
+            if (i % 50 == 0) {
+                tree.erase(std::string(i / 50 + 3, 'x'));
+                std::erase_if(inserted, [&](const std::string& value) { return value.size() == std::size_t(i / 50 + 3); });
+            }
+        }
+        std::vector<std::string> batch{"p", "qq", std::string(200, 'r')};
+        tree.insert_batch(batch);
+        inserted.insert(inserted.end(), batch.begin(), batch.end());
+        Strings upper;
+        tree.split_at_rank(tree.size() / 3, upper);
+        tree.merge(std::move(upper));
+        check_invariants(tree.get_root_for_testing(), by_length);
+        check_invariants(snapshot.get_root_for_testing(), by_length);
+        const std::vector<std::string> after = stable_sorted(inserted);
+        ASSERT_EQUAL(std::equal(tree.begin(), tree.end(), after.begin(), after.end()), true);
+        ASSERT_EQUAL(std::equal(snapshot.begin(), snapshot.end(), before.begin(), before.end()), true);
+
+        // The snapshot answers queries as the tree did when it was taken.
+        for (std::size_t rank = 0; rank < before.size(); rank += 37) {
+            ADD_CONTEXT(rank);
+            ASSERT_EQUAL(snapshot.nth_element(rank), before[rank]);
+            const auto [lo, hi] = snapshot.rank(before[rank]);
+            ASSERT_EQUAL(lo, rank / 10 * 10);
+            ASSERT_EQUAL(hi, rank / 10 * 10 + 9);
+            ASSERT_EQUAL(snapshot.equal_range(before[rank]).size(), 10u);
+        }
+        ASSERT_EQUAL(snapshot.percentile(50)[0], before[500]);
+    }
+
+    // Snapshots can outlive the tree, be changed themselves, and be read on
+    // another thread while the tree changes.
+    std::shared_ptr<const Strings> shared;
+    std::vector<std::string> expected(tree.begin(), tree.end());
+    {
+        Strings original;
+        for (const std::string& value : expected) {
+            original.insert(value);
+        }
+        shared = std::make_shared<const Strings>(order_statistics::snapshot_of, original);
+        std::thread reader([&]() {
+            for (int i = 0; i < 20; ++i) {
+                ASSERT_EQUAL(std::equal(shared->begin(), shared->end(), expected.begin(), expected.end()), true);
+            }
+        });
+        for (int i = 0; i < 2000; ++i) {
+            original.insert(std::string(i % 300 + 1, 'w'));
+            original.erase_one_by_key(std::size_t(i % 250 + 1));
+        }
+        reader.join();
+    }
+    Strings changed = shared->snapshot();
+    changed.erase(expected.front());
+    ASSERT_EQUAL(changed.size() < shared->size(), true);
+    ASSERT_EQUAL(std::equal(shared->begin(), shared->end(), expected.begin(), expected.end()), true);
+
+    // Counted trees share their nodes the same way.
+    using Counted = order_statistics::PersistentTree<int, std::identity, order_statistics::NoAggregate, order_statistics::StoreCounts>;
+    Counted counted;
+    for (int i = 0; i < 100; ++i) {
+        counted.insert(i % 10);
+    }
+    const Counted counted_snapshot = counted.snapshot();
+    counted.insert(3, 5);
+    counted.erase(4);
+    ASSERT_EQUAL(counted.count_of_key(3), 15u);
+    ASSERT_EQUAL(counted.count_of_key(4), 0u);
+    ASSERT_EQUAL(counted_snapshot.count_of_key(3), 10u);
+    ASSERT_EQUAL(counted_snapshot.count_of_key(4), 10u);
+    ASSERT_EQUAL(counted_snapshot.size(), 100u);
+}
+
+void test_tree_sum_by_rank() {
+    // Keys are small integers, so sums in `double` are exact, and can be
+    // compared for equality.
+    using Tree = order_statistics::Tree<int, std::identity, order_statistics::HeapAllocator, order_statistics::KeySums<>>;
+    Tree tree;
+    ASSERT_EQUAL(tree.sum_by_rank(0, 0).sum, 0.0);
+
+    std::vector<int> sorted;
+    std::mt19937 generator;
+    std::uniform_int_distribution<int> key_of(-50, 50);
+    const auto check = [&]() {
+        check_invariants(tree.get_root_for_testing(), std::identity());
+        check_key_sums(tree.get_root_for_testing());
+        ASSERT_EQUAL(tree.size(), sorted.size());
+        for (int i = 0; i < 20; ++i) {
+            std::size_t lo = std::uniform_int_distribution<std::size_t>(0, sorted.size())(generator);
+            std::size_t hi = std::uniform_int_distribution<std::size_t>(0, sorted.size())(generator);
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            ADD_CONTEXT(lo);
+            ADD_CONTEXT(hi);
+            double sum = 0;
+            double sum_of_squares = 0;
+            for (std::size_t rank = lo; rank < hi; ++rank) {
+                sum += sorted[rank];
+                sum_of_squares += double(sorted[rank]) * sorted[rank];
+            }
+            const auto sums = tree.sum_by_rank(lo, hi);
+            ASSERT_EQUAL(sums.sum, sum);
+            ASSERT_EQUAL(sums.sum_of_squares, sum_of_squares);
+        }
+    };
+
+    // Every kind of change to the tree has to keep the sums up to date.
+    for (int i = 0; i < 2000; ++i) {
+        ADD_CONTEXT(i);
+        const int key = key_of(generator);
+        tree.insert(key);
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), key), key);
+        if (i % 7 == 0) {
+            const int erased = key_of(generator);
+            tree.erase_one_by_key(erased);
+            if (const auto found = std::lower_bound(sorted.begin(), sorted.end(), erased); found != sorted.end() && *found == erased) {
+                sorted.erase(found);
+            }
+        }
+        if (i % 100 == 0) {
+            check();
+        }
+    }
+    check();
+    tree.erase(0);
+    std::erase(sorted, 0);
+    check();
+
+    std::vector<int> batch;
+    for (int i = 0; i < 300; ++i) {
+        batch.push_back(key_of(generator) * 3);
+    }
+    tree.insert_batch(batch);
+    sorted.insert(sorted.end(), batch.begin(), batch.end());
+    std::stable_sort(sorted.begin(), sorted.end());
+    check();
+
+    Tree upper;
+    tree.split_at_rank(sorted.size() / 3, upper);
+    ASSERT_EQUAL(tree.sum_by_rank(0, tree.size()).sum + upper.sum_by_rank(0, upper.size()).sum,
+        std::accumulate(sorted.begin(), sorted.end(), 0.0));
+    tree.join(std::move(upper));
+    check();
+    tree.split_at_key(10, upper);
+    Tree other;
+    for (int i = 0; i < 100; ++i) {
+        other.insert(key_of(generator));
+    }
+    tree.merge(std::move(upper));
+    for (const int key : other) {
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), key), key);
+    }
+    tree.merge(std::move(other));
+    check();
+}
+
+template <typename Allocator>
+void test_counted_tree() {
+    // A `CountedTree` must answer every query the same as a `Tree` that
+    // stores copies, while having only one node per distinct key.
+    using Counted = order_statistics::CountedTree<int, Allocator>;
+    using Copies = order_statistics::Tree<int, std::identity, Allocator>;
+    Counted counted;
+    Copies copies;
+    std::mt19937 generator(99);
+    std::uniform_int_distribution<int> key_of(0, 30);
+    const auto check = [&]() {
+        check_invariants(counted.get_root_for_testing(), std::identity());
+        ASSERT_EQUAL(counted.size(), copies.size());
+        std::size_t nodes = 0;
+        std::set<int> distinct;
+        for (const int key : copies) {
+            distinct.insert(key);
+        }
+        std::vector<const order_statistics::TreeNode<int, order_statistics::NoAggregate, order_statistics::StoreCounts>*> stack;
+        if (counted.get_root_for_testing()) {
+            stack.push_back(counted.get_root_for_testing());
+        }
+        while (!stack.empty()) {
+            const auto *node = stack.back();
+            stack.pop_back();
+            ++nodes;
+            for (const auto *child : {node->left, node->right}) {
+                if (child) {
+                    stack.push_back(child);
+                }
+            }
+        }
+        ASSERT_EQUAL(nodes, distinct.size());
+        ASSERT_EQUAL(std::ranges::equal(counted, copies), true);
+        for (std::size_t rank = 0; rank < copies.size(); rank += 7) {
+            ADD_CONTEXT(rank);
+            ASSERT_EQUAL(counted.nth_element(rank), copies.nth_element(rank));
+            const auto elements = counted.nth_elements(rank);
+            ASSERT_EQUAL(elements.size(), copies.nth_elements(rank).size());
+            ASSERT_EQUAL(std::ranges::equal(elements, copies.nth_elements(rank)), true);
+        }
+        for (int key = 0; key <= 30; ++key) {
+            ADD_CONTEXT(key);
+            ASSERT_EQUAL(counted.equal_range(key).size(), copies.equal_range(key).size());
+        }
+        if (!copies.empty()) {
+            for (std::size_t percent = 1; percent <= 100; percent += 11) {
+                ADD_CONTEXT(percent);
+                ASSERT_EQUAL(counted.percentile(percent).front(), copies.percentile(percent).front());
+                ASSERT_EQUAL(counted.percentile(percent).size(), copies.percentile(percent).size());
+            }
+        }
+    };
+
+    for (int i = 0; i < 3000; ++i) {
+        ADD_CONTEXT(i);
+        const int key = key_of(generator);
+        switch (generator() % 8) {
+        case 0:
+            counted.erase_one_by_key(key);
+            copies.erase_one_by_key(key);
+            break;
+        case 1:
+            if (i % 10 == 0) {
+                counted.erase(key);
+                copies.erase(key);
+            }
+            break;
+        case 2: {
+            const std::size_t count = generator() % 5;
+            counted.insert(key, count);
+            for (std::size_t j = 0; j < count; ++j) {
+                copies.insert(key);
+            }
+            break;
+        }
+        default:
+            counted.insert(key);
+            copies.insert(key);
+        }
+        if (i % 50 == 0) {
+            check();
+        }
+    }
+    check();
+
+    // Divide a run of duplicates between trees, and put them back together.
+    for (std::size_t rank : {std::size_t(0), copies.size() / 3, copies.size() / 2 + 1, copies.size()}) {
+        ADD_CONTEXT(rank);
+        Counted counted_upper;
+        Copies copies_upper;
+        counted.split_at_rank(rank, counted_upper);
+        copies.split_at_rank(rank, copies_upper);
+        ASSERT_EQUAL(counted_upper.size(), copies_upper.size());
+        ASSERT_EQUAL(std::ranges::equal(counted_upper, copies_upper), true);
+        check();
+        counted.join(std::move(counted_upper));
+        copies.join(std::move(copies_upper));
+        check();
+    }
+
+    // Merge another tree, which shares our allocator only if it's a
+    // `HeapAllocator`.
+    Counted counted_other;
+    Copies copies_other;
+    for (int i = 0; i < 500; ++i) {
+        const int key = key_of(generator) + 15;
+        counted_other.insert(key);
+        copies_other.insert(key);
+    }
+    counted.merge(std::move(counted_other));
+    copies.merge(std::move(copies_other));
+    ASSERT_EQUAL(counted_other.size(), 0u);
+    check();
+
+    // Assign sorted runs directly. Adjacent runs of the same key share a
+    // node.
+    const std::vector<std::pair<int, std::uint64_t>> runs = {{-3, 2}, {0, 1}, {0, 4}, {7, 1}, {30, 3}};
+    counted.assign_counts(order_statistics::sorted_equivalent, runs.begin(), runs.end());
+    copies.clear();
+    for (const auto& [key, count] : runs) {
+        for (std::uint64_t i = 0; i < count; ++i) {
+            copies.insert(key);
+        }
+    }
+    check();
+
+    // The aggregate covers each element as many times as it's counted.
+    order_statistics::CountedTree<int, order_statistics::HeapAllocator, order_statistics::KeySums<>> sums;
+    sums.insert(3, 1000);
+    sums.insert(-2, 10);
+    sums.insert(3);
+    ASSERT_EQUAL(sums.size(), 1011u);
+    ASSERT_EQUAL(sums.sum_by_rank(0, sums.size()).sum, 3.0 * 1001 - 20);
+    ASSERT_EQUAL(sums.sum_by_rank(5, 15).sum, 5 * -2.0 + 5 * 3.0);
+}
+
+void test_snapshot() {
+    using order_statistics::SnapshotError;
+    const auto throws_snapshot_error = [](auto&& func) {
+        try {
+            func();
+        } catch (const SnapshotError&) {
+            return true;
+        }
+        return false;
+    };
+    std::mt19937 generator(5);
+
+    // Elements having the same key but different bytes make separate runs,
+    // and come back in the same order.
+    struct Sample {
+        int key;
+        int tag;
+    };
+    const auto by_key = [](const Sample& sample) { return sample.key; };
+    order_statistics::Tree<Sample, decltype(by_key)> samples;
+    for (int i = 0; i < 3000; ++i) {
+        samples.insert(Sample{int(generator() % 50), i < 1500 ? 0 : 1});
+    }
+    std::vector<char> buffer(order_statistics::snapshot_size(samples));
+    ASSERT_EQUAL(order_statistics::save_snapshot(samples, buffer), buffer.size());
+    // Each key has a run of tag 0 and then a run of tag 1, so there are at
+    // most 100 runs, rather than 3000 elements.
+    ASSERT_EQUAL(buffer.size() <= 32 + 100 * 16, true);
+    order_statistics::Tree<Sample, decltype(by_key)> restored_samples;
+    ASSERT_EQUAL(order_statistics::restore_snapshot(restored_samples, buffer), buffer.size());
+    check_invariants(restored_samples.get_root_for_testing(), by_key);
+    ASSERT_EQUAL(std::ranges::equal(samples, restored_samples, [](const Sample& left, const Sample& right) {
+        return left.key == right.key && left.tag == right.tag;
+    }), true);
+
+    // Trees that store counts and copies, and a `KthPercentile`, write the
+    // same snapshot of the same elements, and restore from one another's.
+    order_statistics::Tree<unsigned> copies;
+    order_statistics::CountedTree<unsigned> counted;
+    order_statistics::KthPercentile<unsigned, 90> p90;
+    for (int i = 0; i < 5000; ++i) {
+        const unsigned value = generator() % 300;
+        copies.insert(value);
+        counted.insert(value);
+        p90.insert(value);
+    }
+    std::vector<char> from_copies(order_statistics::snapshot_size(copies));
+    std::vector<char> from_counted(order_statistics::snapshot_size(counted));
+    std::vector<char> from_p90(order_statistics::snapshot_size(p90));
+    order_statistics::save_snapshot(copies, from_copies);
+    order_statistics::save_snapshot(counted, from_counted);
+    order_statistics::save_snapshot(p90, from_p90);
+    ASSERT_EQUAL(from_copies == from_counted, true);
+    ASSERT_EQUAL(from_copies == from_p90, true);
+
+    order_statistics::CountedTree<unsigned> restored_counted;
+    order_statistics::restore_snapshot(restored_counted, from_copies);
+    check_invariants(restored_counted.get_root_for_testing(), std::identity());
+    ASSERT_EQUAL(std::ranges::equal(restored_counted, copies), true);
+    order_statistics::KthPercentile<unsigned, 90> restored_p90;
+    order_statistics::restore_snapshot(restored_p90, from_copies);
+    ASSERT_EQUAL(restored_p90.size(), p90.size());
+    ASSERT_EQUAL(restored_p90.get(), p90.get());
+    ASSERT_EQUAL(restored_p90.sorted_elements() == p90.sorted_elements(), true);
+    restored_p90.insert(1000);
+    p90.insert(1000);
+    ASSERT_EQUAL(restored_p90.get(), p90.get());
+
+    // Snapshots written one after another to a file are read back one at a
+    // time.
+    std::FILE *const file = std::tmpfile();
+    const int fd = fileno(file);
+    order_statistics::Tree<unsigned> empty;
+    order_statistics::save_snapshot(copies, fd);
+    order_statistics::save_snapshot(empty, fd);
+    order_statistics::save_snapshot(p90, fd);
+    ASSERT_EQUAL(::lseek(fd, 0, SEEK_SET), 0);
+    order_statistics::Tree<unsigned> restored_copies;
+    restored_copies.insert(7);
+    order_statistics::restore_snapshot(restored_copies, fd);
+    ASSERT_EQUAL(std::ranges::equal(restored_copies, copies), true);
+    order_statistics::restore_snapshot(restored_copies, fd);
+    ASSERT_EQUAL(restored_copies.size(), 0u);
+    order_statistics::restore_snapshot(restored_p90, fd);
+    ASSERT_EQUAL(restored_p90.sorted_elements() == p90.sorted_elements(), true);
+    ASSERT_EQUAL(throws_snapshot_error([&]() { order_statistics::restore_snapshot(restored_copies, fd); }), true);
+    std::fclose(file);
+
+    // Bad input is rejected, leaving the tree unchanged.
+    std::vector<char> small(from_copies.size() - 1);
+    ASSERT_EQUAL(throws_snapshot_error([&]() { order_statistics::save_snapshot(copies, small); }), true);
+    const auto rejected = [&](std::span<const char> bytes) {
+        return throws_snapshot_error([&]() { order_statistics::restore_snapshot(restored_copies, bytes); }) &&
+            std::ranges::equal(restored_copies, copies);
+    };
+    order_statistics::restore_snapshot(restored_copies, from_copies);
+    ASSERT_EQUAL(rejected(std::span(from_copies).first(from_copies.size() - 1)), true);
+    ASSERT_EQUAL(rejected(std::span(from_copies).first(20)), true);
+    std::vector<char> corrupt = from_copies;
+    corrupt[0] ^= 1;
+    ASSERT_EQUAL(rejected(corrupt), true);
+    corrupt = from_copies;
+    corrupt[8] = 8; // element size
+    ASSERT_EQUAL(rejected(corrupt), true);
+    corrupt = from_copies;
+    corrupt[16] ^= 1; // number of elements
+    ASSERT_EQUAL(rejected(corrupt), true);
+    corrupt = from_copies;
+    std::swap_ranges(corrupt.begin() + 32, corrupt.begin() + 44, corrupt.begin() + 44); // swap two runs
+    ASSERT_EQUAL(rejected(corrupt), true);
+    std::vector<char> wrong_type(order_statistics::snapshot_size(samples));
+    order_statistics::save_snapshot(samples, wrong_type);
+    ASSERT_EQUAL(rejected(wrong_type), true);
+}
+
+void test_tree_tracked_percentile() {
+    // After every change to the tree, each tracked percentile must be the
+    // same as the untracked one. Small keys make for many duplicates, so
+    // that cursors both stay within nodes and move between them.
+    for (const int key_range : {5, 100, 100000}) {
+        ADD_CONTEXT(key_range);
+        order_statistics::Tree<int> tree;
+        const std::size_t percents[] = {1, 10, 50, 90, 99, 100};
+        for (std::size_t i = 0; i < std::size(percents); ++i) {
+            ASSERT_EQUAL(tree.track_percentile(percents[i]), i);
+        }
+        const auto check = [&]() {
+            for (std::size_t i = 0; i < std::size(percents); ++i) {
+                ADD_CONTEXT(percents[i]);
+                ASSERT_EQUAL(tree.tracked_percentile(i).data(), tree.percentile(percents[i]).data());
+            }
+        };
+        std::mt19937 generator;
+        std::uniform_int_distribution<int> key_of(0, key_range - 1);
+        for (int i = 0; i < 3000; ++i) {
+            ADD_CONTEXT(i);
+            tree.insert(key_of(generator));
+            // Query only some of the time, so that cursors have to follow
+            // several insertions in a row.
+            if (i % 3 == 0) {
+                check();
+            }
+            if (i % 500 == 499) {
+                tree.erase(key_of(generator));
+                check();
+                tree.insert_batch(std::vector<int>{key_of(generator), key_of(generator)});
+                check();
+                order_statistics::Tree<int> upper;
+                tree.split_at_rank(tree.size() / 2, upper);
+                check();
+                tree.join(std::move(upper));
+                check();
+            }
+        }
+    }
+}
+
+void test_sliding_window() {
+    // Keep the last 50 samples, and only those from the last 100 ticks. Ticks
+    // advance irregularly so that sometimes the count limit applies and
+    // sometimes the age limit applies.
+    using Clock = std::chrono::steady_clock;
+    using Window = order_statistics::SlidingWindowPercentile<int, std::identity, Clock>;
+    Window window(50, Clock::duration(100));
+    std::deque<std::pair<Clock::time_point, int>> recent;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> key_of(0, 30);
+    std::uniform_int_distribution<int> tick_of(0, 5);
+    Clock::time_point now;
+
+    for (int i = 0; i < 3000; ++i) {
+        ADD_CONTEXT(i);
+        now += Clock::duration(tick_of(generator));
+        const int key = key_of(generator);
+        window.insert(key, now);
+        recent.emplace_back(now, key);
+        if (recent.size() > 50) {
+            recent.pop_front();
+        }
+        while (now - recent.front().first > Clock::duration(100)) {
+            recent.pop_front();
+        }
+
+        std::vector<int> sorted;
+        for (const auto& [_, key] : recent) {
+            sorted.push_back(key);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        ASSERT_EQUAL(window.size(), sorted.size());
+        for (const std::size_t percent : {1, 10, 50, 90, 99, 100}) {
+            ADD_CONTEXT(percent);
+            const std::size_t rank = std::min(percent * sorted.size() / 100, sorted.size() - 1);
+            ASSERT_EQUAL(window.percentile(percent)[0], sorted[rank]);
+        }
+    }
+
+    // Expire everything.
+    window.expire(now + Clock::duration(101));
+    ASSERT_EQUAL(window.empty(), true);
+}
+
+template <std::size_t Fanout>
+void test_btree() {
+    // Insert random fish-like pairs, many having the same key, and compare
+    // the tree with a stably sorted vector.
+    using Pair = std::pair<int, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    const auto first_less = [](const Pair& left, const Pair& right) { return left.first < right.first; };
+    order_statistics::BTree<Pair, decltype(by_first), Fanout> tree;
+    std::vector<Pair> sorted;
+    std::mt19937 generator(Fanout);
+    std::uniform_int_distribution<int> key_of(0, 500);
+
+    ASSERT_EQUAL(tree.empty(), true);
+    ASSERT_EQUAL(tree.equal_range(Pair(1, 0)).empty(), true);
+    for (int i = 0; i < 2000; ++i) {
+        const Pair pair(key_of(generator), i);
+        tree.insert(pair);
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), pair, first_less), pair);
+    }
+    ASSERT_EQUAL(tree.size(), sorted.size());
+
+    for (std::size_t rank = 0; rank < sorted.size(); ++rank) {
+        ADD_CONTEXT(rank);
+        ASSERT_EQUAL(tree.nth_element(rank) == sorted[rank], true);
+        const std::span<const Pair> elements = tree.nth_elements(rank);
+        const auto [begin, end] = std::equal_range(sorted.begin(), sorted.end(), sorted[rank], first_less);
+        ASSERT_EQUAL(std::equal(elements.begin(), elements.end(), begin, end), true);
+        ASSERT_EQUAL(std::equal(tree.equal_range(sorted[rank]).begin(), tree.equal_range(sorted[rank]).end(), begin, end), true);
+        const auto [min, max] = tree.rank(sorted[rank]);
+        ASSERT_EQUAL(std::ptrdiff_t(min), begin - sorted.begin());
+        ASSERT_EQUAL(std::ptrdiff_t(max), end - sorted.begin() - 1);
+    }
+    for (std::size_t percent = 1; percent <= 100; ++percent) {
+        ADD_CONTEXT(percent);
+        ASSERT_EQUAL(tree.percentile(percent)[0].first, sorted[std::min(percent * sorted.size() / 100, sorted.size() - 1)].first);
+    }
+    ASSERT_EQUAL(tree.equal_range(Pair(501, 0)).empty(), true);
+
+    tree.clear();
+    ASSERT_EQUAL(tree.size(), 0u);
+}
+
+template <typename Key>
+void test_count_below() {
+    // Compare the search kernels against the standard binary searches, for
+    // every prefix of a sorted array having duplicates, and for keys below,
+    // among, between and above the elements.
+    // For unsigned keys, include some whose most significant bit is set.
+    std::vector<Key> keys;
+    for (int i = 0; i < 37; ++i) {
+        keys.push_back(std::is_signed_v<Key> ? Key(i / 2 * 3 - 20) : Key(i / 2 * 3));
+    }
+    keys.push_back(std::numeric_limits<Key>::max() - Key(1));
+    keys.push_back(std::numeric_limits<Key>::max());
+    for (std::size_t count = 0; count <= keys.size(); ++count) {
+        ADD_CONTEXT(count);
+        for (int i = -25; i < 60; ++i) {
+            const Key key = Key(i);
+            ADD_CONTEXT(key);
+            const auto lower = std::lower_bound(keys.begin(), keys.begin() + count, key) - keys.begin();
+            const auto upper = std::upper_bound(keys.begin(), keys.begin() + count, key) - keys.begin();
+            ASSERT_EQUAL(std::ptrdiff_t(order_statistics::detail::count_below<false>(keys.data(), count, key)), lower);
+            ASSERT_EQUAL(std::ptrdiff_t(order_statistics::detail::count_below<true>(keys.data(), count, key)), upper);
+            ASSERT_EQUAL(std::ptrdiff_t(order_statistics::detail::count_below_scalar<false>(keys.data(), count, key)), lower);
+            ASSERT_EQUAL(std::ptrdiff_t(order_statistics::detail::count_below_scalar<true>(keys.data(), count, key)), upper);
+        }
+    }
+}
+
+void test_find_by_weight() {
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<std::uint64_t> weight_of(0, 5);
+    for (std::size_t count = 1; count <= 19; ++count) {
+        std::vector<std::uint64_t> weights(count);
+        for (std::uint64_t& weight : weights) {
+            weight = weight_of(generator);
+        }
+        weights.back() += 1;
+        const std::uint64_t total = std::reduce(weights.begin(), weights.end(), std::uint64_t(0));
+        for (std::uint64_t rank = 0; rank < total; ++rank) {
+            ADD_CONTEXT(count);
+            ADD_CONTEXT(rank);
+            // The oracle: walk until the rank falls inside of a weight.
+            std::size_t expected_index = 0;
+            std::uint64_t expected_remaining = rank;
+            while (expected_remaining >= weights[expected_index]) {
+                expected_remaining -= weights[expected_index++];
+            }
+            std::uint64_t remaining = rank;
+            ASSERT_EQUAL(order_statistics::detail::find_by_weight(weights.data(), count, remaining), expected_index);
+            ASSERT_EQUAL(remaining, expected_remaining);
+            remaining = rank;
+            ASSERT_EQUAL(order_statistics::detail::find_by_weight_scalar(weights.data(), count, remaining), expected_index);
+            ASSERT_EQUAL(remaining, expected_remaining);
+        }
+    }
+}
+
+void test_tree_assign() {
+    // Elements having the same key must stay in their original order, so use
+    // pairs whose second member is the original position.
+    using Pair = std::pair<int, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    const auto first_less = [](const Pair& left, const Pair& right) { return left.first < right.first; };
+    std::mt19937 generator(99);
+
+    for (const int n : {0, 1, 2, 3, 7, 100, 1000}) {
+        ADD_CONTEXT(n);
+        std::uniform_int_distribution<int> key_of(0, n / 3);
+        std::vector<Pair> pairs;
+        for (int i = 0; i < n; ++i) {
+            pairs.emplace_back(key_of(generator), i);
+        }
+        std::vector<Pair> sorted = pairs;
+        std::stable_sort(sorted.begin(), sorted.end(), first_less);
+
+        order_statistics::Tree<Pair, decltype(by_first)> unsorted_tree(pairs.begin(), pairs.end());
+        order_statistics::Tree<Pair, decltype(by_first)> sorted_tree(order_statistics::sorted_equivalent, sorted.begin(), sorted.end());
+        // `assign` replaces whatever was there before.
+        order_statistics::Tree<Pair, decltype(by_first), order_statistics::ArenaAllocator> reassigned;
+        reassigned.insert(Pair(-1, -1));
+        reassigned.assign(pairs.begin(), pairs.end());
+
+        ASSERT_EQUAL(unsorted_tree.size(), sorted.size());
+        ASSERT_EQUAL(sorted_tree.size(), sorted.size());
+        ASSERT_EQUAL(reassigned.size(), sorted.size());
+        check_invariants(unsorted_tree.get_root_for_testing(), by_first);
+        check_invariants(sorted_tree.get_root_for_testing(), by_first);
+        check_invariants(reassigned.get_root_for_testing(), by_first);
+        for (std::size_t rank = 0; rank < sorted.size(); ++rank) {
+            ADD_CONTEXT(rank);
+            ASSERT_EQUAL(unsorted_tree.nth_element(rank) == sorted[rank], true);
+            ASSERT_EQUAL(sorted_tree.nth_element(rank) == sorted[rank], true);
+            ASSERT_EQUAL(reassigned.nth_element(rank) == sorted[rank], true);
+        }
+
+        // A bulk loaded tree can be modified like any other.
+        unsorted_tree.insert(Pair(n / 6, n));
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), Pair(n / 6, n), first_less), Pair(n / 6, n));
+        check_invariants(unsorted_tree.get_root_for_testing(), by_first);
+        for (std::size_t rank = 0; rank < sorted.size(); ++rank) {
+            ASSERT_EQUAL(unsorted_tree.nth_element(rank) == sorted[rank], true);
+        }
+    }
+}
+
+void test_tree_insert_batch() {
+    // As in `test_tree_assign`, the second member of each pair is its
+    // insertion order, which must be preserved among elements having the
+    // same key.
+    using Pair = std::pair<int, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    const auto first_less = [](const Pair& left, const Pair& right) { return left.first < right.first; };
+    std::mt19937 generator(7);
+
+    for (const int tree_size : {0, 1, 5, 100, 1000}) {
+        for (const int batch_size : {0, 1, 3, 50, 2000}) {
+            // Batches whose keys are spread among the tree's keys, and
+            // batches whose keys are all greater than the tree's, which
+            // makes `join` reconcile very different heights.
+            for (const int offset : {0, tree_size}) {
+                ADD_CONTEXT(tree_size);
+                ADD_CONTEXT(batch_size);
+                ADD_CONTEXT(offset);
+                std::uniform_int_distribution<int> key_of(0, std::max(tree_size, batch_size) / 4);
+                order_statistics::Tree<Pair, decltype(by_first)> tree;
+                std::vector<Pair> expected;
+                int order = 0;
+                for (int i = 0; i < tree_size; ++i) {
+                    tree.insert(Pair(key_of(generator), order++));
+                }
+                for (std::size_t rank = 0; rank < tree.size(); ++rank) {
+                    expected.push_back(tree.nth_element(rank));
+                }
+
+                std::vector<Pair> batch;
+                for (int i = 0; i < batch_size; ++i) {
+                    batch.emplace_back(offset + key_of(generator), order++);
+                }
+                tree.insert_batch(std::span<const Pair>(batch));
+                for (const Pair& pair : batch) {
+                    expected.insert(std::upper_bound(expected.begin(), expected.end(), pair, first_less), pair);
+                }
+
+                ASSERT_EQUAL(tree.size(), expected.size());
+                check_invariants(tree.get_root_for_testing(), by_first);
+                for (std::size_t rank = 0; rank < expected.size(); ++rank) {
+                    ADD_CONTEXT(rank);
+                    ASSERT_EQUAL(tree.nth_element(rank) == expected[rank], true);
+                }
+            }
+        }
+    }
+
+    // A batch can be any range, and an rvalue range's elements are moved.
+    order_statistics::Tree<std::string> strings;
+    strings.insert("b");
+    std::vector<std::string> words{"c", "a", "b", "a"};
+    strings.insert_batch(std::move(words));
+    ASSERT_EQUAL(strings.size(), 5u);
+    ASSERT_EQUAL(strings.equal_range("a").size(), 2u);
+    ASSERT_EQUAL(strings.equal_range("b").size(), 2u);
+    ASSERT_EQUAL(strings.nth_element(4), std::string("c"));
+    strings.insert_batch(std::views::iota(0, 3) | std::views::transform([](int i) { return std::string(1, 'd' + i); }));
+    ASSERT_EQUAL(strings.size(), 8u);
+    ASSERT_EQUAL(strings.nth_element(7), std::string("f"));
+}
+
+void test_sharded_recorder() {
+    // Several threads record disjoint values, each more than a chunk's worth,
+    // while the main thread takes snapshots. Afterward, every value must
+    // have been recorded exactly once.
+    constexpr int threads = 6;
+    constexpr int per_thread = 5000;
+    // Fewer shards than threads, so that some threads share a shard.
+    order_statistics::ShardedPercentileRecorder<int> recorder(4);
+    ASSERT_EQUAL(recorder.shard_count(), 4u);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&recorder, t]() {
+            for (int i = 0; i < per_thread; ++i) {
+                recorder.insert(i * threads + t);
+            }
+        });
+    }
+    std::size_t previous = 0;
+    for (int i = 0; i < 20; ++i) {
+        const std::size_t size = recorder.snapshot().size();
+        ASSERT_EQUAL(size >= previous, true);
+        previous = size;
+        std::this_thread::yield();
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    const auto& merged = recorder.snapshot();
+    ASSERT_EQUAL(merged.size(), std::size_t(threads * per_thread));
+    check_invariants(merged.get_root_for_testing(), std::identity());
+    for (int value = 0; value < threads * per_thread; ++value) {
+        ADD_CONTEXT(value);
+        ASSERT_EQUAL(merged.nth_element(value), value);
+    }
+    ASSERT_EQUAL(merged.percentile(50)[0], threads * per_thread / 2);
+
+    // `clear` discards merged and unmerged values alike.
+    recorder.insert(-1);
+    recorder.clear();
+    ASSERT_EQUAL(recorder.snapshot().size(), 0u);
+    recorder.insert(-1);
+    ASSERT_EQUAL(recorder.snapshot().size(), 1u);
+}
+
+void test_kll_sketch() {
+    // Until the first compaction, the sketch is exact.
+    order_statistics::KllSketch<int> small;
+    ASSERT_EQUAL(small.empty(), true);
+    for (int i = 99; i >= 0; --i) {
+        small.insert(i);
+    }
+    ASSERT_EQUAL(small.size(), 100u);
+    ASSERT_EQUAL(small.retained(), 100u);
+    for (int i = 0; i < 100; ++i) {
+        ADD_CONTEXT(i);
+        ASSERT_EQUAL(small.nth_element(i), i);
+    }
+    ASSERT_EQUAL(small.percentile(50)[0], 50);
+    ASSERT_EQUAL(small.percentile(100)[0], 99);
+    ASSERT_EQUAL(small.rank(42).first, 42u);
+    ASSERT_EQUAL(small.rank(42).second, 42u);
+    ASSERT_EQUAL(small.rank(-1).first, 0u);
+    ASSERT_EQUAL(small.rank(-1).second, 0u);
+
+    // Afterward, answers are within the documented error bound, and memory
+    // stays bounded. The bound holds for 99% of streams, so check a fixed
+    // stream having a typical error.
+    constexpr std::size_t k = 100;
+    constexpr std::size_t n = 200000;
+    using Pair = std::pair<double, int>;
+    const auto by_first = [](const Pair& pair) { return pair.first; };
+    order_statistics::KllSketch<Pair, decltype(by_first)> sketch(k);
+    std::mt19937 generator;
+    std::lognormal_distribution<double> distribution(6, 1);
+    std::vector<double> keys;
+    for (std::size_t i = 0; i < n; ++i) {
+        keys.push_back(distribution(generator));
+        sketch.insert({keys.back(), int(i)});
+    }
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQUAL(sketch.size(), n);
+    ASSERT_EQUAL(sketch.retained() < 4 * k * std::size_t(std::log2(n / k)), true);
+    const double tolerance = order_statistics::KllSketch<int>::normalized_rank_error(k) * n;
+    for (std::size_t percent = 1; percent <= 100; ++percent) {
+        ADD_CONTEXT(percent);
+        const std::size_t expected = std::min(percent * n / 100, n - 1);
+        const double key = sketch.percentile(percent)[0].first;
+        const std::size_t actual = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        ASSERT_EQUAL(std::abs(double(actual) - double(expected)) <= tolerance, true);
+        const auto [min, max] = sketch.rank({keys[expected], 0});
+        ASSERT_EQUAL(std::abs(double(min) - double(expected)) <= tolerance, true);
+        ASSERT_EQUAL(min <= max, true);
+    }
+
+    // Copies of a sketch whose query cache is filled answer the same queries
+    // after the original changes or goes away.
+    auto original = std::make_unique<order_statistics::KllSketch<int>>(k);
+    for (int i = 0; i < int(n); ++i) {
+        original->insert(i);
+    }
+    const int median = original->nth_element(n / 2);
+    order_statistics::KllSketch<int> copied = *original;
+    order_statistics::KllSketch<int> assigned;
+    assigned.insert(-1);
+    ASSERT_EQUAL(assigned.nth_element(0), -1);
+    assigned = *original;
+    for (int i = 0; i < int(n); ++i) {
+        original->insert(-i);
+    }
+    ASSERT_EQUAL(original->nth_element(n / 2) != median, true);
+    original.reset();
+    ASSERT_EQUAL(copied.nth_element(n / 2), median);
+    ASSERT_EQUAL(assigned.nth_element(n / 2), median);
+    ASSERT_EQUAL(copied.rank(median).first, assigned.rank(median).first);
+}
+
 int main() {
     test_kth_percentile();
+    test_kth_percentile_batch();
+    test_min_max_heap();
+    test_multi_percentile();
     test_enclosing_power_of_2();
     test_tree();
+    test_tree_erase<order_statistics::HeapAllocator>();
+    test_tree_erase<order_statistics::ArenaAllocator>();
+    test_tree_erase_allocation_failure();
+    test_tree_node_in_place();
+    test_arena_allocator();
+    test_tree_assign();
+    test_tree_insert_batch();
+    test_tree_merge<order_statistics::HeapAllocator>(true);
+    test_tree_merge<order_statistics::ArenaAllocator>(true);
+    test_tree_merge<order_statistics::ArenaAllocator>(false);
+    test_tree_split_join();
+    test_tree_tracked_percentile();
+    test_counted_tree<order_statistics::HeapAllocator>();
+    test_counted_tree<order_statistics::ArenaAllocator>();
+    test_snapshot();
+    test_tree_iterators();
+    test_tree_sum_by_rank();
+    test_tree_stats_and_counters();
+    test_tree_compare();
+    test_tree_key_lookups<order_statistics::ComputeKeys>();
+    test_tree_key_lookups<order_statistics::CacheKeys>();
+    test_tree_persistent();
+    test_sliding_window();
+    test_sharded_recorder();
+    test_kll_sketch();
+    test_count_below<std::int32_t>();
+    test_count_below<std::uint32_t>();
+    test_count_below<std::int64_t>();
+    test_count_below<std::uint64_t>();
+    test_count_below<float>();
+    test_count_below<double>();
+    test_find_by_weight();
+    test_btree<4>();
+    test_btree<16>();
 }
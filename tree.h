@@ -1,16 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <bit>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <concepts>
 #include <functional>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <ranges>
 #include <type_traits>
 #include <span>
+#include <tuple>
 #include <utility>
 #include <vector>
+#include "allocator.h"
+#include "compare.h"
 
 namespace order_statistics {
 namespace detail {
@@ -48,51 +56,347 @@ class ScopeExitGuard {
 template <typename Func>
 ScopeExitGuard<Func> on_scope_exit(Func&& func) {
     return ScopeExitGuard<Func>(std::forward<Func>(func));
-} 
+}
+
+} // namespace detail
+
+// Define `ORDER_STATISTICS_COUNTERS` to a nonzero value to have every `Tree`
+// and `TreeNode` count the work done on its hot paths in `tree_counters()`.
+// Otherwise, counting compiles to nothing.
+#ifndef ORDER_STATISTICS_COUNTERS
+#define ORDER_STATISTICS_COUNTERS 0
+#endif
+
+inline constexpr bool counters_enabled = ORDER_STATISTICS_COUNTERS != 0;
+
+// `TreeCounters` is what the trees of one thread have done since the
+// counters were last reset, which is done by assigning `TreeCounters{}` to
+// `tree_counters()`. All stay zero unless `counters_enabled`.
+struct TreeCounters {
+    // Calls to `rotate_left` and `rotate_right`, including those that are
+    // half of a double rotation.
+    std::uint64_t left_rotations = 0;
+    std::uint64_t right_rotations = 0;
+    // Rebalancings that rotated a child one way and then its parent the
+    // other, named for the direction of the child's rotation.
+    std::uint64_t left_right_rotations = 0;
+    std::uint64_t right_left_rotations = 0;
+    // Moves of a node's elements into new storage, whether to grow or shrink
+    // `allocated`, or between `allocated` and `in_place`, and the number of
+    // bytes of elements moved.
+    std::uint64_t reallocations = 0;
+    std::uint64_t bytes_moved = 0;
+    // Searches by key from the root (by `insert`, `erase`, `find`, `rank`,
+    // `lower_bound` and `upper_bound`), and the key comparisons they made.
+    // `comparisons / descents` is the comparisons per descent.
+    std::uint64_t descents = 0;
+    std::uint64_t comparisons = 0;
+    // Copies that a `Persistent` tree made of nodes, and of nodes'
+    // `allocated` elements, that it shared with a snapshot and was about to
+    // change.
+    std::uint64_t node_copies = 0;
+    std::uint64_t array_copies = 0;
+};
+
+inline TreeCounters& tree_counters() {
+    thread_local TreeCounters counters;
+    return counters;
+}
+
+namespace detail {
+
+// Add the specified `amount` to the specified `counter` of `tree_counters()`,
+// if `counters_enabled`.
+inline void count(std::uint64_t TreeCounters::*counter, std::uint64_t amount = 1) {
+    if constexpr (counters_enabled) {
+        tree_counters().*counter += amount;
+    }
+}
+
+// Return `less<Compare>(left, right)`, counting the comparison.
+template <typename Compare, typename Left, typename Right>
+bool counted_less(const Left& left, const Right& right) {
+    count(&TreeCounters::comparisons);
+    return less<Compare>(left, right);
+}
+
+// Return `compare<Compare>(left, right)`, counting the comparisons.
+template <typename Compare, typename Left, typename Right>
+auto counted_compare(const Left& left, const Right& right) {
+    const auto order = compare<Compare>(left, right);
+    count(&TreeCounters::comparisons, SingleComparison<Compare, Left, Right> || order < 0 ? 1 : 2);
+    return order;
+}
+
+} // namespace detail
+
+// An aggregate policy says what summary of its subtree's elements a
+// `TreeNode` maintains alongside `weight`, such as the sum of their keys.
+// The summary must depend only on the elements' keys. A policy `A` provides:
+//
+// - `A::value_type`, whose default value is the summary of no elements,
+// - `static A::value_type of(const T& value, std::size_t count)`, returning
+//   the summary of `count` elements having the key of `value`, and
+// - `static A::value_type combine(const A::value_type& left, const
+//   A::value_type& right)`, returning the summary of the elements of `left`
+//   and those of `right`. `combine` must be associative and commutative, so
+//   that an insertion can combine the new element's summary into each
+//   ancestor's without regard to where in the subtree the element went.
+//
+// `NoAggregate`, the default, maintains nothing and costs nothing.
+struct NoAggregate {
+    struct value_type {};
+
+    template <typename T>
+    static value_type of(const T&, std::size_t) {
+        return {};
+    }
+
+    static value_type combine(const value_type&, const value_type&) {
+        return {};
+    }
+};
+
+// `KeySums` maintains the sum and the sum of squares of the `GetKey` keys,
+// from which `Tree::sum_by_rank` yields means and variances. The sums are
+// `double`, so that squares of large integer keys don't overflow.
+template <typename GetKey = std::identity>
+struct KeySums {
+    struct value_type {
+        double sum = 0;
+        double sum_of_squares = 0;
+    };
+
+    template <typename T>
+    static value_type of(const T& value, std::size_t count) {
+        const double key = double(GetKey()(value));
+        return {key * double(count), key * key * double(count)};
+    }
+
+    static value_type combine(const value_type& left, const value_type& right) {
+        return {left.sum + right.sum, left.sum_of_squares + right.sum_of_squares};
+    }
+};
+
+// A duplicates policy says how a `TreeNode` stores its elements, which all
+// have the same key. `StoreCopies`, the default, keeps every element, in
+// order of insertion. `StoreCounts` keeps only the first element and counts
+// the rest, so that inserting a duplicate is an increment and the memory
+// used is proportional to the number of distinct keys, rather than to the
+// number of elements. That's correct only if elements having the same key
+// are interchangeable, such as integers that are their own keys.
+struct StoreCopies {};
+struct StoreCounts {};
+
+// A key policy says where a `Tree` gets the `GetKey` key of a node's
+// elements when it compares keys, such as at each step of a descent.
+// `ComputeKeys`, the default, applies `GetKey` to the node's first element
+// every time. `CacheKeys` keeps a copy of the key in each node, which costs
+// the memory of a key per node, but saves calling `GetKey` and following
+// the node's `allocated` pointer. That's worthwhile when projecting a key is
+// expensive, or when keys such as `std::string` are compared often.
+struct ComputeKeys {};
+struct CacheKeys {};
+
+// A versions policy says whether a `Tree` can share its nodes with snapshots
+// of it. `Ephemeral`, the default, can't, and changes its nodes in place.
+// `Persistent` counts the references to each node, and to each node's
+// `allocated` elements, so that `Tree::snapshot` can return a tree sharing
+// all of them in O(1) time. Afterward, a change to either tree first copies
+// the shared nodes that it's about to change: `insert` copies those on the
+// path from the root, and `erase` also those beside the path, so that each
+// costs O(log n) allocations. Other changes, such as `merge` and
+// `insert_batch`, first copy every shared node, in O(n) time. The counts are
+// atomic, so a snapshot can be read and destroyed on one thread while the
+// tree it was taken from changes on another. A node is bigger by its count.
+struct Ephemeral {};
+struct Persistent {};
+
+namespace detail {
+
+// `NotPersistent` is what a `TreeNode` or `Tree` that doesn't use
+// `Persistent` has instead of each member that only a persistent one needs.
+struct NotPersistent {
+    NotPersistent() = default;
+    explicit NotPersistent(std::size_t) {}
+};
+
+// `NoCachedKey` is what a `TreeNode` that doesn't cache its key has instead.
+struct NoCachedKey {};
+
+template <typename T, typename GetKey>
+struct cached_key {
+    using type = std::remove_cvref_t<std::invoke_result_t<GetKey, const T&>>;
+
+    static type of(const T& value) {
+        return GetKey()(value);
+    }
+};
+
+template <typename T>
+struct cached_key<T, void> {
+    using type = NoCachedKey;
+
+    static type of(const T&) {
+        return {};
+    }
+};
 
 } // namespace detail
 
+// `Repeated` is a view of one element repeated some number of times. It
+// provides the parts of the `std::span<const T>` interface that don't
+// require the elements to be distinct objects. A `TreeNode` that uses
+// `StoreCounts` presents its elements this way.
+template <typename T>
+class Repeated {
+    const T *value;
+    std::size_t count;
+
+ public:
+    class iterator {
+        const T *value;
+        std::size_t index;
+
+     public:
+        using iterator_concept = std::forward_iterator_tag;
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() : value(), index() {}
+        iterator(const T *value, std::size_t index) : value(value), index(index) {}
+
+        const T& operator*() const { return *value; }
+        const T *operator->() const { return value; }
+
+        iterator& operator++() {
+            ++index;
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++index;
+            return old;
+        }
+
+        friend bool operator==(const iterator& left, const iterator& right) {
+            return left.index == right.index;
+        }
+    };
+
+    Repeated() : value(), count() {}
+    Repeated(const T& value, std::size_t count) : value(&value), count(count) {}
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const T& operator[](std::size_t) const { return *value; }
+    const T& front() const { return *value; }
+    const T& back() const { return *value; }
+
+    iterator begin() const { return iterator(value, 0); }
+    iterator end() const { return iterator(value, count); }
+};
+
 // The move constructor of the node's value type `T` must not throw exceptions.
 // This is needed to ensure the strong exception guarantee of
-// `TreeNode<T>::insert`.
+// `TreeNode<T>::insert`. Also, allocators provide only fundamental alignment.
 template <typename T>
-concept TreeNodeValue = std::is_nothrow_move_constructible_v<T>;
+concept TreeNodeValue = std::is_nothrow_move_constructible_v<T> &&
+    alignof(T) <= alignof(std::max_align_t);
 
-template <TreeNodeValue T>
+template <TreeNodeValue T, typename Aggregate = NoAggregate, typename Duplicates = StoreCopies, typename CachedKey = void, typename Versions = Ephemeral>
 class TreeNode {
  public:
+    // Whether the node stores a count of its elements rather than copies of
+    // them. If so, its one element is always `in_place`, and `weight` is
+    // the count.
+    static constexpr bool counted = std::is_same_v<Duplicates, StoreCounts>;
+
+    // The type of `values()`.
+    using values_type = std::conditional_t<counted, Repeated<T>, std::span<const T>>;
+
+    // Whether the node can be shared by more than one tree. See `Persistent`.
+    static constexpr bool persistent = std::is_same_v<Versions, Persistent>;
+
     // Note that `weight` must be listed first in order for MSVC to pack the
-    // bit fields as tightly as possible. 57 + 6 + 1 = 64.
-    std::uint64_t weight : 57;
-    std::uint8_t height : 6;
+    // bit fields as tightly as possible. 51 + 6 + 6 + 1 = 64. The fields
+    // share one underlying type, since GCC and Clang won't let a bit field
+    // straddle a boundary of its own type, which would put a `std::uint8_t`
+    // field after 51 bits into the next byte, and the node would need 16
+    // bytes for its bit fields instead of 8.
+    std::uint64_t weight : 51;
+    std::uint64_t height : 6;
+    // If `storage == ALLOCATED`, then `allocated` has room for
+    // `2**log2_capacity` elements. Storing the capacity, rather than deriving
+    // it from `size()`, lets a node that shrinks keep its storage until it is
+    // a quarter full, so alternating `insert` and `pop_back` near a power of
+    // two doesn't reallocate every time. If `storage == IN_PLACE`, then
+    // instead `log2_capacity` is the number of elements in `in_place`, so
+    // that `values()` doesn't have to visit the children to find it.
+    std::uint64_t log2_capacity : 6;
     enum { IN_PLACE, ALLOCATED } storage : 1;
 
+    // The number of elements that fit in `in_place`. Small trivially
+    // copyable elements, such as `std::uint32_t` latencies, fit several to
+    // the space of the `allocated` pointer, so a node with a few duplicates
+    // doesn't need an allocation.
+    static constexpr std::size_t in_place_capacity =
+        !counted && std::is_trivially_copyable_v<T> && sizeof(T) < sizeof(char*) ? sizeof(char*) / sizeof(T) : 1;
+
     TreeNode *left;
     TreeNode *right;
 
+    // The summary of the elements of this subtree, as defined by `Aggregate`.
+    [[no_unique_address]] typename Aggregate::value_type aggregate;
+
+    // If `CachedKey` isn't `void`, then it's a projection like a `Tree`'s
+    // `GetKey`, and `cached_key` is the key of this node's elements.
+    using cached_key_type = typename detail::cached_key<T, CachedKey>::type;
+    [[no_unique_address]] cached_key_type cached_key;
+
+    // If `persistent`, then `refs` is the number of links to this node, from
+    // parents or as a tree's root. A node whose `refs` is more than one
+    // mustn't change. Its `allocated` storage, if any, is preceded by a
+    // count of the nodes sharing that storage.
+    using refs_type = std::conditional_t<persistent, std::atomic<std::size_t>, detail::NotPersistent>;
+    [[no_unique_address]] refs_type refs;
+
  private:
-    // If this node has only one element, then it might be stored as
-    // `in_place`. Otherwise, `allocated` points to storage for an array of
-    // elements. It's possible that this node has only one element, but that
-    // it's nonetheless in storage pointed to by `allocated` -- it's a
-    // necessary edge case to preserve the strong exception guarantee for
-    // `insert`. See `insert`.
+    // If this node has no more than `in_place_capacity` elements, then they
+    // might be stored in `in_place`. Otherwise, `allocated` points to
+    // storage for an array of elements. It's possible that this node has few
+    // elements, but that they're nonetheless in storage pointed to by
+    // `allocated` -- it's a necessary edge case to preserve the strong
+    // exception guarantee for `insert`. See `insert`.
     // The selected union field is indicated by `storage`.
+    // `allocated` is obtained from the allocator passed to `insert`, which
+    // must be the same allocator (or an equal one) every time.
     union {
-        T in_place;
+        T in_place[in_place_capacity];
         char *allocated;
     };
 
  public:
     explicit TreeNode(const T&);
     explicit TreeNode(T&&);
+    // Copy the specified `other` node, including its links to its children,
+    // but without counting them. If `other` has `allocated` storage, then the
+    // copy shares it. Only a `persistent` node can be copied.
+    TreeNode(const TreeNode& other);
+    // The destructor does not destroy the node's values, because it doesn't
+    // have the allocator needed to free their storage. Call `destroy_values`
+    // before destroying the node.
     ~TreeNode();
 
     TreeNode() = delete;
     TreeNode& operator=(const TreeNode&) = delete;
     TreeNode& operator=(TreeNode&&) = delete;
 
-    std::span<const T> values() const;
+    values_type values() const;
 
     std::size_t left_height() const;
     std::size_t right_height() const;
@@ -102,136 +406,387 @@ class TreeNode {
 
     std::size_t size() const;
 
-    void insert(const T&);
-    void insert(T&&);
+    // Return how many elements this node has room for without reallocating.
+    // A node that uses `StoreCounts` never reallocates, though this says 1.
+    std::size_t capacity() const;
+
+    typename Aggregate::value_type left_aggregate() const;
+    typename Aggregate::value_type right_aggregate() const;
+
+    // Recompute `aggregate` from this node's elements and its children's
+    // `aggregate`. Whoever changes `weight` directly must call this
+    // afterward, children first.
+    void update_aggregate();
+
+    template <typename Allocator>
+    void insert(Allocator&, const T&);
+    template <typename Allocator>
+    void insert(Allocator&, T&&);
+
+    // Add the specified `count` more elements like this node's first. Only a
+    // node that uses `StoreCounts` can do this, and it doesn't throw.
+    void add_copies(std::size_t count);
+
+    // Move the elements of the specified `other` node onto the end of this
+    // node's, which must have room reserved for them, so that this doesn't
+    // throw. `other` keeps its moved-from elements.
+    template <typename Allocator>
+    void append(Allocator&, TreeNode& other);
+
+    // Remove the most recently inserted element. The behavior is undefined
+    // unless `size() > 1`. If the remaining elements fit in `in_place`
+    // afterward, they are moved back there.
+    template <typename Allocator>
+    void pop_back(Allocator&);
+
+    // Destroy the elements after the first `new_size`, which is at least
+    // one. If the remaining elements fit in `in_place`, they are moved back
+    // there. Otherwise, the storage is kept. This doesn't throw, unless the
+    // elements are shared and have to be copied first.
+    template <typename Allocator>
+    void truncate(Allocator&, std::size_t new_size);
+
+    // Make room for at least the specified `count` elements, so that
+    // inserting up to that many doesn't reallocate.
+    template <typename Allocator>
+    void reserve(Allocator&, std::size_t count);
+
+    // Destroy all of this node's values and free any storage allocated for
+    // them. Afterward, the only valid operation on this node is destruction.
+    template <typename Allocator>
+    void destroy_values(Allocator&);
+
+    // If this node's `allocated` storage is shared with other nodes, then
+    // copy its elements into storage of this node's own. Every change to the
+    // elements does this first, except `append`'s moving from `other`.
+    template <typename Allocator>
+    void unshare_values(Allocator&);
 
     void replace_children(TreeNode *new_left, TreeNode *new_right);
     
     static std::pair<const TreeNode*, std::size_t> get(const TreeNode&, std::size_t rank);
 
  private:
-    template <typename U>
-    void generic_insert(U&& value);
+    template <typename Allocator, typename U>
+    void generic_insert(Allocator&, U&& value);
+
+    // Move the elements of `allocated` into new storage having room for
+    // `2**new_log2_capacity` elements, which must be at least `size()`.
+    template <typename Allocator>
+    void reallocate(Allocator&, std::uint8_t new_log2_capacity);
+
+    // Move the elements of `in_place` into new storage having room for
+    // `2**new_log2_capacity` elements, which must be more than
+    // `in_place_capacity`. If destroying an old element throws, then the
+    // node still ends up with its elements in `allocated`.
+    template <typename Allocator>
+    void move_out_of_place(Allocator&, std::uint8_t new_log2_capacity);
+
+    // Move the specified `count` elements of `allocated`, which is at most
+    // `in_place_capacity`, back into `in_place`, and free `allocated`. This
+    // doesn't throw.
+    template <typename Allocator>
+    void move_back_in_place(Allocator&, std::size_t count);
+
+    std::size_t allocated_bytes() const;
+
+    // `allocated` storage is preceded by `array_header` bytes, which hold its
+    // count of sharing nodes if `persistent`, and are otherwise absent.
+    static constexpr std::size_t array_header = persistent ? alignof(std::max_align_t) : 0;
+
+    // Return new storage having room for `2**log2_capacity` elements, after
+    // the header. Free storage so obtained, which has room for `bytes` of
+    // elements.
+    template <typename Allocator>
+    static char *allocate_array(Allocator&, std::uint8_t log2_capacity);
+    template <typename Allocator>
+    static void deallocate_array(Allocator&, char *array, std::size_t bytes);
+
+    // Return the count of nodes sharing the specified `array`.
+    static std::atomic<std::size_t>& array_refs(char *array);
+
+    // Give up this node's share of the specified `array`, holding `size`
+    // elements. If no other node shares it, then destroy the elements and
+    // free the storage.
+    template <typename Allocator>
+    void release_array(Allocator&, char *array, std::size_t size);
 };
 
-template <TreeNodeValue T>
-TreeNode<T>::TreeNode(const T& value)
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::TreeNode(const T& value)
 : weight(1)
 , height(1)
+, log2_capacity(1)
 , storage(IN_PLACE)
 , left()
 , right()
-, in_place(value) {}
+, aggregate(Aggregate::of(value, 1))
+, cached_key(detail::cached_key<T, CachedKey>::of(value))
+, refs(1)
+, in_place{value} {}
 
-template <TreeNodeValue T>
-TreeNode<T>::TreeNode(T&& value)
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::TreeNode(T&& value)
 : weight(1)
 , height(1)
+, log2_capacity(1)
 , storage(IN_PLACE)
 , left()
 , right()
-, in_place(std::move(value)) {}
+, aggregate(Aggregate::of(value, 1))
+, cached_key(detail::cached_key<T, CachedKey>::of(value))
+, refs(1)
+, in_place{std::move(value)} {}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::TreeNode(const TreeNode& other)
+: weight(other.weight)
+, height(other.height)
+, log2_capacity(other.log2_capacity)
+, storage(other.storage)
+, left(other.left)
+, right(other.right)
+, aggregate(other.aggregate)
+, cached_key(other.cached_key)
+, refs(1) {
+    static_assert(persistent);
+    if (storage == ALLOCATED) {
+        allocated = other.allocated;
+        array_refs(allocated).fetch_add(1, std::memory_order_relaxed);
+    } else {
+        std::uninitialized_copy_n(other.in_place, log2_capacity, in_place);
+    }
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::~TreeNode() {}
 
-template <TreeNodeValue T>
-TreeNode<T>::~TreeNode() {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::destroy_values(Allocator& allocator) {
     if (storage == IN_PLACE) {
-        in_place.~T();
+        std::destroy_n(in_place, log2_capacity);
         return;
     }
     assert(storage == ALLOCATED);
-    for (const T& value : values()) {
-        value.~T();
+    release_array(allocator, allocated, size());
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::release_array(Allocator& allocator, char *array, std::size_t size) {
+    if constexpr (persistent) {
+        if (array_refs(array).fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
     }
-    delete[] allocated;
+    std::destroy_n(std::launder(reinterpret_cast<T*>(array)), size);
+    deallocate_array(allocator, array, allocated_bytes());
 }
 
-template <TreeNodeValue T>
-std::span<const T> TreeNode<T>::values() const {
-    if (storage == IN_PLACE) {
-        return std::span<const T>(&in_place, 1);
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::unshare_values(Allocator& allocator) {
+    if constexpr (persistent && !counted) {
+        if (storage != ALLOCATED || array_refs(allocated).load(std::memory_order_acquire) == 1) {
+            return;
+        }
+        const std::size_t size = this->size();
+        char *const new_storage = allocate_array(allocator, log2_capacity);
+        try {
+            std::uninitialized_copy_n(values().data(), size, reinterpret_cast<T*>(new_storage));
+        } catch (...) {
+            deallocate_array(allocator, new_storage, allocated_bytes());
+            throw;
+        }
+        char *const old_storage = allocated;
+        allocated = new_storage;
+        detail::count(&TreeCounters::array_copies);
+        // Another node might have let go of `old_storage` meanwhile.
+        release_array(allocator, old_storage, size);
+    }
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+char *TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::allocate_array(Allocator& allocator, std::uint8_t log2_capacity) {
+    char *const block =
+        static_cast<char*>(allocator.allocate(array_header + (std::size_t(1) << log2_capacity) * sizeof(T)));
+    if constexpr (persistent) {
+        new (block) std::atomic<std::size_t>(1);
     }
+    return block + array_header;
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::deallocate_array(Allocator& allocator, char *array, std::size_t bytes) {
+    allocator.deallocate(array - array_header, array_header + bytes);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::atomic<std::size_t>& TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::array_refs(char *array) {
+    static_assert(persistent);
+    return *std::launder(reinterpret_cast<std::atomic<std::size_t>*>(array - array_header));
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::allocated_bytes() const {
     assert(storage == ALLOCATED);
-    return std::span<const T>(std::launder(reinterpret_cast<const T*>(allocated)), size());
+    return (std::size_t(1) << log2_capacity) * sizeof(T);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::capacity() const {
+    return storage == IN_PLACE ? in_place_capacity : std::size_t(1) << log2_capacity;
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+typename TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::values_type TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::values() const {
+    if constexpr (counted) {
+        return Repeated<T>(in_place[0], size());
+    } else if (storage == IN_PLACE) {
+        return std::span<const T>(in_place, log2_capacity);
+    } else {
+        assert(storage == ALLOCATED);
+        return std::span<const T>(std::launder(reinterpret_cast<const T*>(allocated)), size());
+    }
 }
 
-template <TreeNodeValue T>
-std::size_t TreeNode<T>::left_weight() const {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::left_weight() const {
     return left ? left->weight : 0;
 }
 
-template <TreeNodeValue T>
-std::size_t TreeNode<T>::right_weight() const {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::right_weight() const {
     return right ? right->weight : 0;
 }
 
-template <TreeNodeValue T>
-std::size_t TreeNode<T>::size() const {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::size() const {
     return weight - left_weight() - right_weight();
 }
 
-template <TreeNodeValue T>
-std::size_t TreeNode<T>::left_height() const {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+typename Aggregate::value_type TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::left_aggregate() const {
+    return left ? left->aggregate : typename Aggregate::value_type();
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+typename Aggregate::value_type TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::right_aggregate() const {
+    return right ? right->aggregate : typename Aggregate::value_type();
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::update_aggregate() {
+    if constexpr (!std::is_same_v<Aggregate, NoAggregate>) {
+        aggregate = Aggregate::combine(
+            Aggregate::combine(left_aggregate(), Aggregate::of(values()[0], size())), right_aggregate());
+    }
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::left_height() const {
     return left ? left->height : 0;
 }
 
-template <TreeNodeValue T>
-std::size_t TreeNode<T>::right_height() const {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::size_t TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::right_height() const {
     return right ? right->height : 0;
 }
 
-template <TreeNodeValue T>
-void TreeNode<T>::insert(const T& value) {
-    generic_insert(value);
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::insert(Allocator& allocator, const T& value) {
+    generic_insert(allocator, value);
+    update_aggregate();
 }
 
-template <TreeNodeValue T>
-void TreeNode<T>::insert(T&& value) {
-    generic_insert(std::move(value));
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::insert(Allocator& allocator, T&& value) {
+    generic_insert(allocator, std::move(value));
+    update_aggregate();
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::add_copies(std::size_t count) {
+    static_assert(counted);
+    weight += count;
+    update_aggregate();
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::append(Allocator& allocator, TreeNode& other) {
+    if constexpr (counted) {
+        add_copies(other.size());
+        return;
+    }
+    // The elements aren't `const`, only our view of them is.
+    for (const T& value : other.values()) {
+        insert(allocator, std::move(const_cast<T&>(value)));
+    }
 }
 
-template <TreeNodeValue T>
-void TreeNode<T>::replace_children(TreeNode *new_left, TreeNode *new_right) {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::replace_children(TreeNode *new_left, TreeNode *new_right) {
     const std::size_t my_size = size();
     left = new_left;
     right = new_right;
     weight = my_size + left_weight() + right_weight();
     height = 1 + std::max(left_height(), right_height());
+    update_aggregate();
 }
 
-template <TreeNodeValue T>
-std::pair<const TreeNode<T>*, std::size_t> TreeNode<T>::get(const TreeNode<T>& node, std::size_t rank) {
-   if (rank < node.left_weight()) {
-       // It's an element to our left.
-       return get(*node.left, rank);
-   } 
-   if (rank - node.left_weight() < node.size()) {
-       // It's one of our elements.
-       return {&node, rank - node.left_weight()};
-   }
-   // It's an element to our right.
-   return get(*node.right, rank - node.left_weight() - node.size());
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+std::pair<const TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>*, std::size_t> TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::get(const TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>& root, std::size_t rank) {
+    const TreeNode *node = &root;
+    for (;;) {
+        const std::size_t left_weight = node->left_weight();
+        if (rank < left_weight) {
+            // It's an element to our left.
+            node = node->left;
+            continue;
+        }
+        rank -= left_weight;
+        const std::size_t size = node->weight - left_weight - node->right_weight();
+        if (rank < size) {
+            // It's one of our elements.
+            return {node, rank};
+        }
+        // It's an element to our right.
+        rank -= size;
+        node = node->right;
+    }
 }
 
 // Note that in order for `generic_insert` to provide the strong exception
 // guarantee, the order of statements in its implementation is a bit subtle.
-template <TreeNodeValue T>
-template <typename U>
-void TreeNode<T>::generic_insert(U&& value) {
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator, typename U>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::generic_insert(Allocator& allocator, U&& value) {
+    if constexpr (counted) {
+        ++weight;
+        return;
+    }
+    unshare_values(allocator);
     if (storage == IN_PLACE) {
+        const std::size_t size = log2_capacity;
+        if (size < in_place_capacity) {
+            // There's room in `in_place`. Only trivially copyable elements
+            // get here, so this can't throw.
+            new (&in_place[size]) T(std::forward<U>(value));
+            ++log2_capacity;
+            ++weight;
+            return;
+        }
         // We need to allocate `allocated` and then move `in_place` into it and
-        // append `value`.
-        char *const new_storage = new char[2 * sizeof(T)];
-        new (new_storage) T(std::move(in_place));
-        // Maybe at the `return` below, and maybe if `~T()` throws.
-        // In the latter case, I think it's undefined behavior to assign to
-        // `allocated`, but I bet it's fine.
-        const auto guard = detail::on_scope_exit([&, this]() {
-            storage = ALLOCATED;
-            allocated = new_storage;
-        });
-        in_place.~T();
-        // copy/move the new element
-        new (new_storage + sizeof(T)) T(std::forward<U>(value));
+        // append `value`. If copying or moving the new element throws, then
+        // the node keeps its old elements, in `allocated`.
+        move_out_of_place(allocator, std::bit_width(size));
+        new (allocated + size * sizeof(T)) T(std::forward<U>(value));
         ++weight;
         return;
     }
@@ -239,43 +794,271 @@ void TreeNode<T>::generic_insert(U&& value) {
     // Append to `allocated`.
     assert(storage == ALLOCATED);
     const std::size_t size = values().size();
-    const std::size_t capacity = detail::enclosing_power_of_2(size);
-    char *destination;
-    if (size == capacity) {
+    if (size == std::size_t(1) << log2_capacity) {
         // We have to reallocate to larger storage and move the elements over.
-        std::unique_ptr<char[]> new_storage(new char[2 * capacity * sizeof(T)]);
-        char *const old_storage = allocated;
-        T *const begin = std::launder(reinterpret_cast<T*>(old_storage));
-        const T *const end = begin + size;
-        destination = new_storage.get();
-        for (auto iter = begin; iter != end; ++iter, destination += sizeof(T)) {
-            new (destination) T(std::move(*iter));
-        }
-        allocated = new_storage.release();
-        // Now `allocated` is just a higher-capacity version of what we started
-        // with. Before we append `value`, first destroy the old elements that
-        // were just moved-from. This way, if any of the destructors throw, the
-        // sequence of elements appears unchanged (strong exception guarnatee),
-        // even though we leak `old_storage`.
-        for (auto iter = begin; iter != end; ++iter) {
-            iter->~T();
-        }
-        delete[] old_storage;
-    } else {
-        // There's already room for `value`.
-        destination = allocated + size * sizeof(T);
+        reallocate(allocator, log2_capacity + 1);
     }
-    new (destination) T(std::forward<U>(value));
+    // There's now room for `value`.
+    new (allocated + size * sizeof(T)) T(std::forward<U>(value));
     ++weight;
 }
 
-template <typename T, typename GetKey = std::identity>
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::reallocate(Allocator& allocator, std::uint8_t new_log2_capacity) {
+    assert(storage == ALLOCATED);
+    const std::size_t size = values().size();
+    assert(size <= std::size_t(1) << new_log2_capacity);
+    // Nothing between here and the assignment to `allocated` can throw,
+    // because moving a `T` can't throw.
+    char *const new_storage = allocate_array(allocator, new_log2_capacity);
+    char *const old_storage = allocated;
+    const std::size_t old_bytes = allocated_bytes();
+    T *const begin = std::launder(reinterpret_cast<T*>(old_storage));
+    const T *const end = begin + size;
+    char *destination = new_storage;
+    for (auto iter = begin; iter != end; ++iter, destination += sizeof(T)) {
+        new (destination) T(std::move(*iter));
+    }
+    allocated = new_storage;
+    log2_capacity = new_log2_capacity;
+    detail::count(&TreeCounters::reallocations);
+    detail::count(&TreeCounters::bytes_moved, size * sizeof(T));
+    // Now `allocated` is just a different-capacity version of what we started
+    // with. Before we continue, first destroy the old elements that were just
+    // moved-from. This way, if any of the destructors throw, the sequence of
+    // elements appears unchanged (strong exception guarnatee), even though we
+    // leak `old_storage`.
+    for (auto iter = begin; iter != end; ++iter) {
+        iter->~T();
+    }
+    deallocate_array(allocator, old_storage, old_bytes);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::move_out_of_place(Allocator& allocator, std::uint8_t new_log2_capacity) {
+    assert(storage == IN_PLACE);
+    assert((std::size_t(1) << new_log2_capacity) > in_place_capacity);
+    const std::size_t size = log2_capacity;
+    char *const new_storage = allocate_array(allocator, new_log2_capacity);
+    for (std::size_t i = 0; i < size; ++i) {
+        new (new_storage + i * sizeof(T)) T(std::move(in_place[i]));
+    }
+    detail::count(&TreeCounters::reallocations);
+    detail::count(&TreeCounters::bytes_moved, size * sizeof(T));
+    // Maybe at the end of this function, and maybe if `~T()` throws.
+    // In the latter case, I think it's undefined behavior to assign to
+    // `allocated`, but I bet it's fine.
+    const auto guard = detail::on_scope_exit([&, this]() {
+        storage = ALLOCATED;
+        log2_capacity = new_log2_capacity;
+        allocated = new_storage;
+    });
+    std::destroy_n(in_place, size);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::move_back_in_place(Allocator& allocator, std::size_t count) {
+    assert(storage == ALLOCATED);
+    assert(count <= in_place_capacity);
+    // Moving can't throw (see `TreeNodeValue`). Moving into `in_place`
+    // overwrites `allocated`, so remember it first.
+    char *const old_storage = allocated;
+    const std::size_t old_bytes = allocated_bytes();
+    T *const begin = std::launder(reinterpret_cast<T*>(old_storage));
+    for (std::size_t i = 0; i < count; ++i) {
+        new (&in_place[i]) T(std::move(begin[i]));
+    }
+    storage = IN_PLACE;
+    log2_capacity = count;
+    detail::count(&TreeCounters::reallocations);
+    detail::count(&TreeCounters::bytes_moved, count * sizeof(T));
+    std::destroy_n(begin, count);
+    deallocate_array(allocator, old_storage, old_bytes);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::reserve(Allocator& allocator, std::size_t count) {
+    unshare_values(allocator);
+    if (counted || count <= (storage == IN_PLACE ? in_place_capacity : std::size_t(1) << log2_capacity)) {
+        return;
+    }
+    const std::uint8_t new_log2_capacity = std::bit_width(count - 1);
+    if (storage == ALLOCATED) {
+        reallocate(allocator, new_log2_capacity);
+        return;
+    }
+    move_out_of_place(allocator, new_log2_capacity);
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::pop_back(Allocator& allocator) {
+    const std::size_t new_size = size() - 1;
+    assert(new_size > 0);
+    unshare_values(allocator);
+    if constexpr (counted) {
+        --weight;
+        update_aggregate();
+        return;
+    }
+    if (storage == IN_PLACE) {
+        --weight;
+        --log2_capacity;
+        in_place[new_size].~T();
+        update_aggregate();
+        return;
+    }
+    T *const begin = std::launder(reinterpret_cast<T*>(allocated));
+    // Decrement `weight` first, so that if `~T()` throws, the element is at
+    // least no longer visible.
+    --weight;
+    begin[new_size].~T();
+
+    if (new_size <= in_place_capacity) {
+        // Move the remaining elements back into `in_place`.
+        move_back_in_place(allocator, new_size);
+        update_aggregate();
+        return;
+    }
+
+    // Halve the storage once it's only a quarter full. That's only an
+    // optimization, and the element is already gone, so if allocating the
+    // smaller storage fails, keep the larger. `reallocate` changes nothing
+    // if allocating throws.
+    if (new_size <= (std::size_t(1) << log2_capacity) / 4) {
+        try {
+            reallocate(allocator, log2_capacity - 1);
+        } catch (...) {
+        }
+    }
+    update_aggregate();
+}
+
+template <TreeNodeValue T, typename Aggregate, typename Duplicates, typename CachedKey, typename Versions>
+template <typename Allocator>
+void TreeNode<T, Aggregate, Duplicates, CachedKey, Versions>::truncate(Allocator& allocator, std::size_t new_size) {
+    const std::size_t old_size = size();
+    assert(new_size > 0 && new_size <= old_size);
+    if (new_size == old_size) {
+        return;
+    }
+    unshare_values(allocator);
+    weight -= old_size - new_size;
+    if constexpr (counted) {
+        update_aggregate();
+        return;
+    }
+    if (storage == IN_PLACE) {
+        std::destroy(in_place + new_size, in_place + old_size);
+        log2_capacity = new_size;
+        update_aggregate();
+        return;
+    }
+    T *const begin = std::launder(reinterpret_cast<T*>(allocated));
+    for (std::size_t i = old_size; i-- > new_size;) {
+        begin[i].~T();
+    }
+    if (new_size <= in_place_capacity) {
+        // As in `pop_back`.
+        move_back_in_place(allocator, new_size);
+    }
+    update_aggregate();
+}
+
+// `sorted_equivalent` is a tag indicating that a range of elements is already
+// sorted by key, where elements having the same key are in insertion order.
+struct sorted_equivalent_t {
+    explicit sorted_equivalent_t() = default;
+};
+
+inline constexpr sorted_equivalent_t sorted_equivalent{};
+
+// `snapshot_of` is a tag indicating that a `Tree` is to be constructed as a
+// snapshot of another. See `Tree::snapshot`.
+struct snapshot_of_t {
+    explicit snapshot_of_t() = default;
+};
+
+inline constexpr snapshot_of_t snapshot_of{};
+
+// `TreeStats` describes the shape and memory use of a `Tree`. See
+// `Tree::stats`.
+struct TreeStats {
+    // The number of elements.
+    std::size_t size = 0;
+    // The number of nodes, which is the number of distinct keys.
+    std::size_t distinct_keys = 0;
+    // The number of nodes on the longest path from the root to a leaf.
+    std::size_t height = 0;
+    // `duplicates[i]` is the number of keys having at least `2**i` and fewer
+    // than `2**(i+1)` elements.
+    std::vector<std::size_t> duplicates;
+    // The bytes of the nodes themselves, which include `in_place` elements.
+    std::size_t node_bytes = 0;
+    // The number of nodes whose elements are in `allocated` storage, the
+    // bytes of that storage, and how many of those bytes hold elements. The
+    // difference is the cost of rounding capacities up to powers of two.
+    std::size_t allocated_arrays = 0;
+    std::size_t array_bytes_allocated = 0;
+    std::size_t array_bytes_used = 0;
+};
+
+// `Tree` orders its elements by their `GetKey` keys, as compared by the
+// comparator `Compare` (see `compare.h`). "`GetKey` order" below means that
+// order.
+template <typename T, typename GetKey = std::identity, typename Allocator = HeapAllocator, typename Aggregate = NoAggregate, typename Duplicates = StoreCopies, typename Keys = ComputeKeys, typename Compare = std::less<>, typename Versions = Ephemeral>
 class Tree {
-    using Node = TreeNode<T>;
+    using Node = TreeNode<T, Aggregate, Duplicates, std::conditional_t<std::is_same_v<Keys, CacheKeys>, GetKey, void>, Versions>;
+    static_assert(!Node::counted || std::is_same_v<GetKey, std::identity>,
+        "StoreCounts requires elements to be their own keys");
+    // A snapshot can free nodes on another thread, and can outlive the tree.
+    static_assert(!Node::persistent || std::is_same_v<Allocator, HeapAllocator>,
+        "Persistent requires HeapAllocator");
     Node *root;
+    // `allocator` provides the storage for nodes and for their value arrays.
+    [[no_unique_address]] Allocator allocator;
+
+    // A percentile that `track_percentile` asked us to maintain: the node
+    // containing the element at the percentile's rank, and that element's
+    // index among the node's values. `node` is null when the position has
+    // to be found again by descending from the root. The rank is
+    // `percent * size() / 100` (except at 100%), and `remainder` is what
+    // that division leaves over, so that an insertion can tell whether the
+    // rank grows without dividing. `node_size` is `node->size()`, which
+    // would otherwise require visiting the node's children.
+    struct Cursor {
+        std::size_t percent;
+        const Node *node;
+        std::size_t offset;
+        std::size_t node_size;
+        std::size_t remainder;
+    };
+    mutable std::vector<Cursor> cursors;
+
+    // Whether any of our nodes might be shared with another tree, because a
+    // snapshot was taken of this tree or this tree is a snapshot. Until
+    // then, a `Persistent` tree needn't look for nodes to copy.
+    [[no_unique_address]] mutable std::conditional_t<Node::persistent, bool, detail::NotPersistent> shared{};
 
  public:
     Tree();
+    explicit Tree(const Allocator&);
+
+    // Create a tree that is a snapshot of the specified `other` tree. See
+    // `snapshot`.
+    Tree(snapshot_of_t, const Tree& other);
+
+    // Create a tree containing the elements of the specified range. See
+    // `assign`.
+    template <std::input_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+    Tree(Iterator first, Sentinel last);
+    template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+    Tree(sorted_equivalent_t, Iterator first, Sentinel last);
+
     ~Tree();
 
     Tree(const Tree&) = delete;
@@ -283,13 +1066,104 @@ class Tree {
     Tree& operator=(const Tree&) = delete;
     Tree& operator=(Tree&&) = delete;
 
+    // Return a tree having the same elements as this tree, which shares this
+    // tree's nodes, in O(1) time. Only a tree that uses `Persistent` can do
+    // this. Changing either tree afterward doesn't change the other (see
+    // `Persistent`). The snapshot can be queried, changed and destroyed on
+    // another thread than this tree's, but `snapshot` mustn't be called
+    // concurrently with changes to this tree. The snapshot can also be
+    // constructed in place, such as by
+    // `std::make_shared<const Tree>(snapshot_of, tree)`.
+    Tree snapshot() const;
+
+    // All elements having the same key, in order of insertion. This is a
+    // `std::span<const T>`, unless `Duplicates` is `StoreCounts`, in which
+    // case it's a `Repeated<T>`.
+    using values_type = typename Node::values_type;
+
     // Add the specified value to the tree.
     void insert(const T&);
     void insert(T&&);
 
+    // Add the specified `count` copies of the specified `value` to the tree,
+    // in O(log n) time. Only a tree that uses `StoreCounts` can do this.
+    void insert(const T& value, std::size_t count);
+
+    // Remove all elements whose `GetKey` key is the same as the key of the
+    // specified `value`. Return the number of elements removed.
+    std::size_t erase(const T& value);
+
+    // Remove the most recently inserted element whose `GetKey` key is the
+    // specified `key`. Return whether an element was removed.
+    template <typename Key>
+    bool erase_one_by_key(const Key& key);
+
     // Remove all values from the tree.
     void clear();
 
+    // Move the elements whose `GetKey` key is not less than the specified
+    // `key` into the specified `upper` tree, which must be empty. `upper`
+    // takes a copy of this tree's allocator. This takes O(log n) time and
+    // doesn't throw.
+    template <typename Key>
+    void split_at_key(const Key& key, Tree& upper);
+
+    // Move the elements whose zero-based `GetKey`-order index is at least
+    // the specified `rank` into the specified `upper` tree, which must be
+    // empty. `upper` takes a copy of this tree's allocator. If `rank` falls
+    // among elements having the same key, then those elements are divided
+    // between the trees, which requires allocating a node. This takes
+    // O(log n) time. If an exception is thrown, then neither tree is
+    // changed.
+    void split_at_rank(std::size_t rank, Tree& upper);
+
+    // Move all elements of the specified `upper` tree into this tree,
+    // leaving `upper` empty. No key in `upper` may be less than a key in this
+    // tree. If the trees' allocators are equal, then this takes O(log n)
+    // time. Otherwise, it's the same as `merge`. If an exception is thrown,
+    // then neither tree's elements are changed.
+    void join(Tree&& upper);
+
+    // Move all elements of the specified `other` tree into this tree,
+    // leaving `other` empty. Elements of `other` come after elements of this
+    // tree having the same key. If the trees' allocators are equal, then
+    // `other`'s nodes are linked into this tree without copying or moving
+    // their elements (except to append them to a node having the same key),
+    // and merging trees of sizes `m <= n` takes O(m log(n/m + 1)) time.
+    // Otherwise, the elements are copied as by `insert_batch` (or, with
+    // `StoreCounts`, each distinct element is copied once, with its count),
+    // and then `other` is cleared. If an exception is thrown, then neither tree's
+    // elements are changed.
+    void merge(Tree&& other);
+
+    // Replace the contents of the tree with the elements of the specified
+    // range, in O(n log n) time to sort them (stably, so that elements having
+    // the same key remain in order) plus O(n) time to build a perfectly
+    // balanced tree. If the range is tagged `sorted_equivalent`, then it must
+    // already be so sorted, and the elements are copied straight into the
+    // tree in O(n) time. The tree is cleared first, so if an exception is
+    // thrown, then the tree is left empty (basic exception guarantee).
+    template <std::input_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+    void assign(Iterator first, Sentinel last);
+    template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+    void assign(sorted_equivalent_t, Iterator first, Sentinel last);
+
+    // Replace the contents of the tree with the elements of the specified
+    // range of `{element, count}` pairs, which must be sorted by key and have
+    // positive counts, in O(k) time for `k` pairs. Only a tree that uses
+    // `StoreCounts` can do this.
+    template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+    void assign_counts(sorted_equivalent_t, Iterator first, Sentinel last);
+
+    // Add the elements of the specified range to the tree. The batch is
+    // sorted (stably, so that elements having the same key keep their
+    // relative order) and then split down the tree, so that each subtree is
+    // visited at most once and each distinct key in the batch costs a single
+    // append, rather than each element costing a descent from the root. If
+    // an exception is thrown, then the tree's elements are unchanged.
+    template <std::ranges::input_range Range>
+    void insert_batch(Range&& values);
+
     std::size_t size() const;
     std::size_t empty() const;
     
@@ -317,135 +1191,1339 @@ class Tree {
     // - `nth_elements(k) is [D0, D1, D2, D3] for k in 4, 5, 6, 7`
     // - `nth_elements(8) is [E0]`
     // - `nth_elements(9) is [F0]`
-    std::span<const T> nth_elements(std::size_t rank) const;
+    values_type nth_elements(std::size_t rank) const;
 
     // Return all elements whose `GetKey` key is in the specified percentile.
     // `percent` is between 1 and 100, inclusive.
     // The n'th percentile is the smallest key `k` such that the keys of at
     // least n% of elements are less than or equal to `k`.
-    std::span<const T> percentile(std::size_t percent) const;
+    values_type percentile(std::size_t percent) const;
 
     // Return the `{min, max}` of possible zero-based positions of the `value`
     // in `GetKey`-order sequence. The behavior is undefined unless `value` is
     // in the tree.
     std::pair<std::size_t, std::size_t> rank(const T& value) const;
+
+    // Start maintaining the position of the specified percentile, and return
+    // an index with which to query it using `tracked_percentile`. `percent`
+    // is between 1 and 100, inclusive.
+    std::size_t track_percentile(std::size_t percent);
+
+    // Return the same elements as `percentile(percent)`, where `percent` was
+    // given to the `track_percentile` call that returned the specified
+    // `index`. Each `insert` adjusts the tracked position in O(1) time, so
+    // this takes O(1) time, unless an insertion moved the percentile into a
+    // different node, or the tree was changed other than by `insert`, since
+    // the previous query. Then the position is found again in O(log n) time.
+    // Since that updates the tracked position, this must not be called
+    // concurrently with itself, even though it's `const`. The behavior is
+    // undefined if the tree is empty.
+    values_type tracked_percentile(std::size_t index) const;
     
     // Return all elements whose `GetKey` key is the same as the key of the
     // specified `value`.
-    std::span<const T> equal_range(const T& value) const;
+    values_type equal_range(const T& value) const;
+
+    // These are like `rank` and `equal_range`, but take a key rather than an
+    // element, and allow the key to be absent. `Key` is any type that
+    // `Compare` can compare with `GetKey` keys in either order, such as
+    // `std::string_view` for `std::string` keys, and it's compared as is,
+    // without conversion. `rank_of_key` returns the number of elements whose
+    // keys are less than the specified `key`, which is the rank of the first
+    // element having `key`, or the rank that an element having `key` would
+    // have if inserted. `count_of_key` returns the number of elements having
+    // `key`, and `equal_range_of_key` returns them. Each takes O(log n) time.
+    template <typename Key>
+    std::size_t rank_of_key(const Key& key) const;
+    template <typename Key>
+    std::size_t count_of_key(const Key& key) const;
+    template <typename Key>
+    values_type equal_range_of_key(const Key& key) const;
+
+    // Iterators visit the elements in `GetKey` order, where elements having
+    // the same key are in order of insertion. They are bidirectional, and
+    // each step takes amortized O(1) time. Any change to the tree
+    // invalidates all of its iterators.
+    class const_iterator;
+    using iterator = const_iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // Return an iterator to the first element whose `GetKey` key is not less
+    // than (`lower_bound`) or greater than (`upper_bound`) the specified
+    // `key`, or `end()` if there is no such element. This takes O(log n)
+    // time.
+    template <typename Key>
+    const_iterator lower_bound(const Key& key) const;
+    template <typename Key>
+    const_iterator upper_bound(const Key& key) const;
+
+    // Return the elements whose zero-based `GetKey`-order index is at least
+    // the specified `rank_lo` and less than the specified `rank_hi`, where
+    // `rank_lo <= rank_hi <= size()`. Finding the ends takes O(log n) time,
+    // and visiting the `k` elements between them takes O(k) time.
+    std::ranges::subrange<const_iterator> range(std::size_t rank_lo, std::size_t rank_hi) const;
+
+    // Return the `Aggregate` summary of the elements whose zero-based
+    // `GetKey`-order index is at least the specified `rank_lo` and less than
+    // the specified `rank_hi`, where `rank_lo <= rank_hi <= size()`. This
+    // takes O(log n) time. For example, with `KeySums`, the mean of the
+    // elements from the 99th percentile up is
+    // `sum_by_rank(r, size()).sum / (size() - r)`, where
+    // `r = 99 * size() / 100`.
+    typename Aggregate::value_type sum_by_rank(std::size_t rank_lo, std::size_t rank_hi) const;
+
+    // Return a description of this tree's shape and memory use. This visits
+    // every node, so it takes time proportional to the number of distinct
+    // keys.
+    TreeStats stats() const;
     
     // Please don't.
     Node *get_root_for_testing() const;
 
  private:
+    // Add `count` elements like `value`, which is just `value` unless
+    // `Duplicates` is `StoreCounts`.
     template <typename U>
-    void generic_insert(U&& value);
-    
-    template <typename U>
-    static Node *generic_insert(Node *into, U&& value);
+    void generic_insert(U&& value, std::size_t count = 1);
+
+    // Adjust each tracked percentile's position for the insertion of an
+    // element having the specified `key`, which is about to happen.
+    template <typename Key>
+    void advance_cursors(const Key& key);
+
+    // Mark every tracked percentile's position as needing to be found again.
+    void forget_cursors() const;
+
+    // If the specified `node` is shared with another tree, then replace our
+    // reference to it with a reference to a copy of it, and return the copy.
+    // Otherwise, return `node`. This does nothing unless `Persistent`.
+    Node *unshare(Node *node);
+
+    // Copy every node, and every node's `allocated` elements, that we share
+    // with another tree, so that nothing we have is shared.
+    void unshare_all();
+    void unshare_subtree(Node *&link);
+
+    // Copy the nodes that erasing one element (or all elements, if `all` is
+    // true) having the specified `key` would change, if they're shared, so
+    // that the erasure itself doesn't have to.
+    template <typename Key>
+    void unshare_for_erase(const Key& key, bool all);
+
+    // Give up our reference to the specified `node`. If it was the last, then
+    // destroy `node`, and give up its references to its children.
+    void release(Node *node);
     
+    // The height of a node fits in six bits, so no path from the root to a
+    // leaf has more nodes than this.
+    static constexpr std::size_t max_height = 63;
+
+    // Remove one element (or all elements, if `all` is true) having the
+    // specified `key` from the subtree rooted at `node`. Add the number of
+    // elements removed to `removed` and return the new root of the subtree.
+    template <typename Key>
+    Node *erase(Node *node, const Key& key, bool all, std::size_t& removed);
+
+    // Destroy the specified `node` and return the subtree that replaces it.
+    Node *unlink(Node *node);
+
+    // Detach the leftmost node of the subtree rooted at `node`, storing it in
+    // `min`. Return the new root of the subtree.
+    static Node *detach_min(Node *node, Node *&min);
+
+    // Implement `assign(sorted_equivalent, first, last)`, moving the
+    // elements out of the range if `move` is true, or `assign_counts` if
+    // `counts` is true.
+    template <bool move, bool counts, typename Iterator, typename Sentinel>
+    void assign_sorted(Iterator first, Sentinel last);
+
+    // Link the specified `nodes`, which are in key order and have no
+    // children, into a perfectly balanced tree, and return its root.
+    static Node *link_balanced(std::span<Node*> nodes);
+
+    // A run of elements in a sorted batch that have the same key, as the
+    // indices `[begin, end)` into the batch.
+    struct Run {
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    // Return how many of the specified `runs` have keys less than the key of
+    // the specified `node`, and whether the run after those has `node`'s key.
+    // A run that has been moved into a node in `created` is keyed by that
+    // node.
+    static std::pair<std::size_t, bool> split_runs(
+        const Node *node, std::span<const Run> runs, std::span<const T> batch, std::span<Node *const> created);
+
+    // Do everything in `insert_batch` that can throw, without changing the
+    // tree's elements or structure: make room in each node of the subtree
+    // rooted at `node` for its run of the `batch`, and move each run that
+    // has no node into a new node in `created`, which parallels `runs`.
+    void prepare_batch(Node *node, std::span<const Run> runs, std::span<T> batch, std::span<Node*> created);
+
+    // Finish `insert_batch` after `prepare_batch`: append each run to its
+    // node and join the `created` nodes into the subtree rooted at `node`.
+    // Return the new root of the subtree. This doesn't throw.
+    Node *attach_batch(Node *node, std::span<const Run> runs, std::span<T> batch, std::span<Node*> created);
+
+    // Make room in each node of this tree for the elements of the node of
+    // the specified `other` tree having the same key, if any. This searches
+    // the larger tree for the keys of the smaller tree in increasing order,
+    // resuming each search from where the previous one left off.
+    void reserve_for_merge(const Tree& other);
+
+    // Return a tree of the nodes of the subtrees `ours` and `theirs`, where
+    // `ours` has room for the elements of each node of `theirs` having the
+    // same key as one of its nodes. Those elements are appended to that
+    // node, and their node is destroyed. This doesn't throw.
+    Node *unite(Node *ours, Node *theirs);
+
+    // Split the subtree rooted at `node` into a tree of the nodes whose keys
+    // are less than the specified `key`, the node having `key` (or null),
+    // with its children removed, and a tree of the nodes whose keys are
+    // greater. This takes O(log n) time.
+    template <typename Key>
+    static std::tuple<Node*, Node*, Node*> split(Node *node, const Key& key);
+
+    // Move the elements of the specified `node` after the first `offset`
+    // into a new node, and return the new node. `offset` is between 1 and
+    // `node->size() - 1`, inclusive. Weights of `node`'s ancestors are left
+    // for the caller to update. If an exception is thrown, then `node` is
+    // unchanged.
+    Node *split_node(Node *node, std::size_t offset);
+
+    // Remove the children of the specified `node`, which keeps its elements.
+    static void detach_children(Node *node);
+
+    // Call the specified `visit` with each node of the subtree rooted at
+    // `node`, in key order.
+    template <typename Visit>
+    static void for_each_node(Node *node, Visit&& visit);
+
+    // Return a balanced tree containing the subtree `left`, then the
+    // childless node `middle`, and then the subtree `right`, where the keys
+    // are in that order. This takes time proportional to the difference in
+    // the heights of `left` and `right`.
+    static Node *join_nodes(Node *left, Node *middle, Node *right);
+
+    // Return the `GetKey` key of the elements of the specified `node`.
+    static decltype(auto) key_of(const Node *node);
+
     static Node *balance(Node*);
     static Node *rotate_left(Node*);
     static Node *rotate_right(Node*);
-    static void dispose(Node*);
 
-    std::pair<std::span<const T>, std::size_t> get(std::size_t rank) const;
+    template <typename U>
+    Node *create_node(U&& value);
+    void destroy_node(Node*);
+
+    // Destroy every node in the subtree rooted at `node`. If `deallocate` is
+    // false, then destroy the nodes' values but don't give the nodes' storage
+    // back to the allocator. `dispose` uses constant stack space, but
+    // clobbers the tree structure as it goes.
+    void dispose(Node *node, bool deallocate);
+
+    std::pair<values_type, std::size_t> get(std::size_t rank) const;
     
     template <typename Key>
     static const Node *find(const Node *node, const Key& key);
 
+    // Return the number of elements in the subtree rooted at `node` whose
+    // keys are less than the specified `key`, and the node having `key`, or
+    // null if there is none.
     template <typename Key>
-    static std::pair<std::size_t, std::size_t> rank(const Node *node, const Key& key, std::size_t weight_behind);
+    static std::pair<std::size_t, const Node*> search(const Node *node, const Key& key);
+
+    // Return the summary of the first `count` elements of the subtree rooted
+    // at `node` (`aggregate_prefix`), or of the elements from the `rank`th
+    // on (`aggregate_suffix`).
+    static typename Aggregate::value_type aggregate_prefix(const Node *node, std::size_t count);
+    static typename Aggregate::value_type aggregate_suffix(const Node *node, std::size_t rank);
+
+    // Return an iterator to the element whose zero-based `GetKey`-order
+    // index is the specified `rank`, or `end()` if `rank` is `size()`.
+    const_iterator seek(std::size_t rank) const;
+
+    // Implement `lower_bound`, or `upper_bound` if `or_equal`.
+    template <bool or_equal, typename Key>
+    const_iterator bound(const Key& key) const;
 };
 
-template <typename T, typename GetKey>
-Tree<T, GetKey>::Tree()
+// `CountedTree` is a `Tree` of elements that are their own keys, such as
+// integer latencies, that stores each distinct element once along with its
+// count. See `StoreCounts`.
+template <typename T, typename Allocator = HeapAllocator, typename Aggregate = NoAggregate>
+using CountedTree = Tree<T, std::identity, Allocator, Aggregate, StoreCounts>;
+
+// `PersistentTree` is a `Tree` that can take O(1) snapshots of itself, for
+// readers that need a view of the tree that doesn't change while the tree
+// does. See `Persistent`.
+template <typename T, typename GetKey = std::identity, typename Aggregate = NoAggregate, typename Duplicates = StoreCopies>
+using PersistentTree = Tree<T, GetKey, HeapAllocator, Aggregate, Duplicates, ComputeKeys, std::less<>, Persistent>;
+
+// Nodes don't point to their parents, so an iterator remembers the path from
+// the root to its node, which is how it finds the next node.
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+class Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator {
+    friend class Tree;
+
+    const Node *root;
+    // `path[0]` is `root`, and the current element is the `offset`th value
+    // of `path[depth - 1]`. The iterator is at the end if `depth` is zero.
+    const Node *path[max_height];
+    std::size_t depth;
+    std::size_t offset;
+
+    explicit const_iterator(const Node *root);
+
+    // Extend `path` from its last node to that node's leftmost (rightmost)
+    // descendant.
+    void descend_left();
+    void descend_right();
+
+ public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    const_iterator();
+    // Copying copies only the used part of `path`.
+    const_iterator(const const_iterator&);
+    const_iterator& operator=(const const_iterator&);
+
+    reference operator*() const;
+    pointer operator->() const;
+
+    const_iterator& operator++();
+    const_iterator operator++(int);
+    // Decrementing `end()` moves to the last element.
+    const_iterator& operator--();
+    const_iterator operator--(int);
+
+    bool operator==(const const_iterator&) const;
+};
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Tree()
 : root(nullptr) {}
 
-template <typename T, typename GetKey>
-void Tree<T, GetKey>::dispose(Node *node) {
-    Node *left = node->left;
-    Node *right = node->right;
-    delete node;
-    if (left) {
-        dispose(left);
-    }
-    if (right) {
-        dispose(right);
-    }
-}
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Tree(const Allocator& allocator)
+: root(nullptr)
+, allocator(allocator) {}
 
-template <typename T, typename GetKey>
-Tree<T, GetKey>::~Tree() {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Tree(snapshot_of_t, const Tree& other)
+: root(other.root)
+, allocator(other.allocator) {
+    static_assert(Node::persistent, "only a Persistent tree has snapshots");
     if (root) {
-        dispose(root);
+        root->refs.fetch_add(1, std::memory_order_relaxed);
+        shared = other.shared = true;
     }
 }
 
-template <typename T, typename GetKey>
-std::size_t Tree<T, GetKey>::size() const {
-    return root ? root->weight : 0;
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::snapshot() const {
+    return Tree(snapshot_of, *this);
 }
 
-template <typename T, typename GetKey>
-std::size_t Tree<T, GetKey>::empty() const {
-    return size() == 0;
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::input_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Tree(Iterator first, Sentinel last)
+: Tree() {
+    assign(first, last);
 }
 
-template <typename T, typename GetKey>
-void Tree<T, GetKey>::insert(const T& value) {
-    generic_insert(value);
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Tree(sorted_equivalent_t, Iterator first, Sentinel last)
+: Tree() {
+    assign(sorted_equivalent, first, last);
 }
 
-template <typename T, typename GetKey>
-void Tree<T, GetKey>::insert(T&& value) {
-    generic_insert(std::move(value));
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::input_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::assign(Iterator first, Sentinel last) {
+    std::vector<T> sorted;
+    if constexpr (std::sized_sentinel_for<Sentinel, Iterator>) {
+        sorted.reserve(last - first);
+    }
+    for (; first != last; ++first) {
+        sorted.push_back(*first);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const T& left, const T& right) {
+        return detail::less<Compare>(GetKey()(left), GetKey()(right));
+    });
+    assign_sorted<true, false>(sorted.begin(), sorted.end());
 }
 
-template <typename T, typename GetKey>
-template <typename U>
-void Tree<T, GetKey>::generic_insert(U&& value) {
-    root = generic_insert(root, std::forward<U>(value));
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::assign(sorted_equivalent_t, Iterator first, Sentinel last) {
+    assign_sorted<false, false>(first, last);
 }
 
-template <typename T, typename GetKey>
-void Tree<T, GetKey>::clear() {
-    if (root) {
-        dispose(root);
-        root = nullptr;
-    }
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::forward_iterator Iterator, std::sentinel_for<Iterator> Sentinel>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::assign_counts(sorted_equivalent_t, Iterator first, Sentinel last) {
+    static_assert(Node::counted);
+    assign_sorted<false, true>(first, last);
 }
 
-template <typename T, typename GetKey>
-template <typename U>
-TreeNode<T> *Tree<T, GetKey>::generic_insert(TreeNode<T> *into, U&& value) {
-    if (into == nullptr) {
-        return new Node(std::forward<U>(value));
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <bool move, bool counts, typename Iterator, typename Sentinel>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::assign_sorted(Iterator first, Sentinel last) {
+    const auto element = [](Iterator iter) -> decltype(auto) {
+        if constexpr (counts) {
+            return (iter->first);
+        } else if constexpr (move) {
+            return std::move(*iter);
+        } else {
+            return *iter;
+        }
+    };
+    const auto key = [](Iterator iter) -> decltype(auto) {
+        if constexpr (counts) {
+            return GetKey()(iter->first);
+        } else {
+            return GetKey()(*iter);
+        }
+    };
+    const auto count = [](Iterator iter) -> std::size_t {
+        if constexpr (counts) {
+            return iter->second;
+        } else {
+            return 1;
+        }
+    };
+    clear();
+
+    // Create one childless node per distinct key, in order. If anything
+    // throws, destroy the nodes created so far. A node's slot is added before
+    // the node is created, so that the node is never lost.
+    std::vector<Node*> nodes;
+    const auto guard = detail::on_scope_exit([&, this]() {
+        if (root) {
+            return;
+        }
+        for (Node *const node : nodes) {
+            if (node) {
+                destroy_node(node);
+            }
+        }
+    });
+    while (first != last) {
+        // Find the end of the run of elements having `*first`'s key, so that
+        // the node can be allocated at its final size.
+        Iterator run_end = std::next(first);
+        std::size_t run_size = count(first);
+        while (run_end != last && !detail::less<Compare>(key(first), key(run_end))) {
+            assert(!detail::less<Compare>(key(run_end), key(first)));
+            run_size += count(run_end);
+            ++run_end;
+        }
+        nodes.push_back(nullptr);
+        Node *const node = create_node(element(first));
+        nodes.back() = node;
+        if constexpr (Node::counted) {
+            node->add_copies(run_size - 1);
+            first = run_end;
+            continue;
+        }
+        node->reserve(allocator, run_size);
+        for (++first; first != run_end; ++first) {
+            node->insert(allocator, element(first));
+        }
     }
 
+    if (!nodes.empty()) {
+        root = link_balanced(nodes);
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::link_balanced(std::span<Node*> nodes) {
+    if (nodes.empty()) {
+        return nullptr;
+    }
+    // Splitting at the middle makes the heights of the two sides differ by at
+    // most one. The recursion is only O(log n) deep.
+    const std::size_t middle = nodes.size() / 2;
+    Node *const node = nodes[middle];
+    node->replace_children(link_balanced(nodes.first(middle)), link_balanced(nodes.subspan(middle + 1)));
+    return node;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <std::ranges::input_range Range>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::insert_batch(Range&& values) {
+    forget_cursors();
+    std::vector<T> batch;
+    if constexpr (std::ranges::sized_range<Range>) {
+        batch.reserve(std::ranges::size(values));
+    }
+    for (auto&& value : values) {
+        // Elements of a range that we were given to consume can be moved.
+        if constexpr (std::is_rvalue_reference_v<Range&&> && !std::ranges::borrowed_range<Range>) {
+            batch.push_back(std::move(value));
+        } else {
+            batch.push_back(std::forward<decltype(value)>(value));
+        }
+    }
+    if (batch.empty()) {
+        return;
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const T& left, const T& right) {
+        return detail::less<Compare>(GetKey()(left), GetKey()(right));
+    });
+
+    std::vector<Run> runs;
+    for (std::size_t begin = 0; begin < batch.size();) {
+        std::size_t end = begin + 1;
+        while (end < batch.size() && !detail::less<Compare>(GetKey()(batch[begin]), GetKey()(batch[end]))) {
+            ++end;
+        }
+        runs.push_back(Run{begin, end});
+        begin = end;
+    }
+
+    // If preparation throws, destroy the nodes created so far. Nodes that
+    // were already in the tree might keep extra capacity, or have been
+    // copied from shared ones, but nothing else about the tree changes.
+    unshare_all();
+    std::vector<Node*> created(runs.size(), nullptr);
+    bool prepared = false;
+    const auto guard = detail::on_scope_exit([&, this]() {
+        if (prepared) {
+            return;
+        }
+        for (Node *const node : created) {
+            if (node) {
+                destroy_node(node);
+            }
+        }
+    });
+    prepare_batch(root, runs, batch, created);
+    prepared = true;
+    root = attach_batch(root, runs, batch, created);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::pair<std::size_t, bool> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::split_runs(
+    const Node *node, std::span<const Run> runs, std::span<const T> batch, std::span<Node *const> created) {
+    const auto first_of = [&](std::size_t i) -> const T& {
+        return created[i] ? created[i]->values()[0] : batch[runs[i].begin];
+    };
+    const auto& key = key_of(node);
+    // Binary search for the first run whose key isn't less than `key`.
+    std::size_t below = 0;
+    std::size_t count = runs.size();
+    while (count) {
+        const std::size_t half = count / 2;
+        if (detail::less<Compare>(GetKey()(first_of(below + half)), key)) {
+            below += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    const bool equal = below < runs.size() && !detail::less<Compare>(key, GetKey()(first_of(below)));
+    return {below, equal};
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::prepare_batch(
+    Node *node, std::span<const Run> runs, std::span<T> batch, std::span<Node*> created) {
+    if (runs.empty()) {
+        return;
+    }
+    if (!node) {
+        for (std::size_t i = 0; i < runs.size(); ++i) {
+            const auto [begin, end] = runs[i];
+            Node *const new_node = created[i] = create_node(std::move(batch[begin]));
+            new_node->reserve(allocator, end - begin);
+            for (std::size_t j = begin + 1; j < end; ++j) {
+                new_node->insert(allocator, std::move(batch[j]));
+            }
+        }
+        return;
+    }
+    const auto [below, equal] = split_runs(node, runs, batch, created);
+    if (equal) {
+        node->reserve(allocator, node->size() + (runs[below].end - runs[below].begin));
+    }
+    prepare_batch(node->left, runs.first(below), batch, created.first(below));
+    prepare_batch(node->right, runs.subspan(below + equal), batch, created.subspan(below + equal));
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::attach_batch(
+    Node *node, std::span<const Run> runs, std::span<T> batch, std::span<Node*> created) {
+    if (runs.empty()) {
+        return node;
+    }
+    if (!node) {
+        return link_balanced(created);
+    }
+    const auto [below, equal] = split_runs(node, runs, batch, created);
+    if (equal) {
+        // `prepare_batch` reserved room for these, so appending can't throw.
+        for (std::size_t j = runs[below].begin; j < runs[below].end; ++j) {
+            node->insert(allocator, std::move(batch[j]));
+        }
+    }
+    const std::size_t size = node->size();
+    Node *const left = attach_batch(node->left, runs.first(below), batch, created.first(below));
+    Node *const right =
+        attach_batch(node->right, runs.subspan(below + equal), batch, created.subspan(below + equal));
+    node->left = node->right = nullptr;
+    node->weight = size;
+    node->height = 1;
+    node->update_aggregate();
+    return join_nodes(left, node, right);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::merge(Tree&& other) {
+    assert(&other != this);
+    forget_cursors();
+    other.forget_cursors();
+    if (!other.root) {
+        return;
+    }
+    if (!(allocator == other.allocator)) {
+        if constexpr (Node::counted) {
+            // Copy each distinct element, with its count, into a tree that
+            // shares our allocator, rather than copying every element.
+            Tree copies(allocator);
+            for_each_node(other.root, [&](const Node *node) {
+                copies.insert(node->values()[0], node->size());
+            });
+            merge(std::move(copies));
+            other.clear();
+            return;
+        }
+        std::vector<T> copies;
+        copies.reserve(other.size());
+        for_each_node(other.root, [&](const Node *node) {
+            copies.insert(copies.end(), node->values().begin(), node->values().end());
+        });
+        insert_batch(std::move(copies));
+        other.clear();
+        return;
+    }
+    unshare_all();
+    other.unshare_all();
+    reserve_for_merge(other);
+    root = unite(root, other.root);
+    other.root = nullptr;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::reserve_for_merge(const Tree& other) {
+    const bool ours_smaller = size() <= other.size();
+    Node *const smaller = ours_smaller ? root : other.root;
+    Node *const larger = ours_smaller ? other.root : root;
+
+    // `path` is the path from `larger` to where the previous search ended.
+    // Each step's `bound` is the nearest ancestor whose key is greater than
+    // all keys in the step's subtree, or null if there is none.
+    struct Step {
+        Node *node;
+        const Node *bound;
+    };
+    Step path[max_height];
+    std::size_t depth = 0;
+    for_each_node(smaller, [&](Node *node) {
+        const auto& key = key_of(node);
+        // Keys arrive in increasing order, so back up the path only until
+        // `key` is less than the step's bound.
+        while (depth && path[depth - 1].bound && !detail::less<Compare>(key, key_of(path[depth - 1].bound))) {
+            --depth;
+        }
+        Node *match = depth ? path[depth - 1].node : larger;
+        const Node *bound = depth ? path[depth - 1].bound : nullptr;
+        if (depth) {
+            --depth;
+        }
+        while (match) {
+            path[depth++] = Step{match, bound};
+            const auto order = detail::compare<Compare>(key, key_of(match));
+            if (order < 0) {
+                bound = match;
+                match = match->left;
+            } else if (order > 0) {
+                match = match->right;
+            } else {
+                break;
+            }
+        }
+        if (match) {
+            Node *const ours = ours_smaller ? node : match;
+            Node *const theirs = ours_smaller ? match : node;
+            ours->reserve(allocator, ours->size() + theirs->size());
+        }
+    });
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unite(Node *ours, Node *theirs) {
+    if (!theirs) {
+        return ours;
+    }
+    if (!ours) {
+        return theirs;
+    }
+    Node *const their_left = theirs->left;
+    Node *const their_right = theirs->right;
+    detach_children(theirs);
+    auto [less, same, greater] = split(ours, key_of(theirs));
+    Node *const left = unite(less, their_left);
+    Node *const right = unite(greater, their_right);
+    if (!same) {
+        return join_nodes(left, theirs, right);
+    }
+    // `reserve_for_merge` made room, so appending can't throw.
+    same->append(allocator, *theirs);
+    destroy_node(theirs);
+    return join_nodes(left, same, right);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+std::tuple<typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node*, typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node*, typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node*> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::split(Node *node, const Key& key) {
+    if (!node) {
+        return {nullptr, nullptr, nullptr};
+    }
+    Node *const left = node->left;
+    Node *const right = node->right;
+    detach_children(node);
+    const auto order = detail::compare<Compare>(key, key_of(node));
+    if (order < 0) {
+        const auto [less, same, greater] = split(left, key);
+        return {less, same, join_nodes(greater, node, right)};
+    }
+    if (order > 0) {
+        const auto [less, same, greater] = split(right, key);
+        return {join_nodes(left, node, less), same, greater};
+    }
+    return {left, node, right};
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::split_at_key(const Key& key, Tree& upper) {
+    assert(&upper != this);
+    assert(upper.empty());
+    forget_cursors();
+    upper.forget_cursors();
+    upper.allocator = allocator;
+    unshare_all();
+    const auto [less, same, greater] = split(root, key);
+    root = less;
+    upper.root = same ? join_nodes(nullptr, same, greater) : greater;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::split_at_rank(std::size_t rank, Tree& upper) {
+    assert(&upper != this);
+    assert(upper.empty());
+    assert(rank <= size());
+    forget_cursors();
+    upper.forget_cursors();
+    upper.allocator = allocator;
+    if (rank == size()) {
+        return;
+    }
+    unshare_all();
+    const auto [found, offset] = Node::get(*root, rank);
+    Node *const node = const_cast<Node*>(found);
+    // Copy the key, since dividing `node` can move its first element back
+    // into place and free the storage that a reference would point into.
+    const auto key = key_of(node);
+    if (offset == 0) {
+        split_at_key(key, upper);
+        return;
+    }
+
+    // Divide `node` first, since that's the only thing that can throw. Then
+    // the nodes above it need to lose the weight that it lost.
+    Node *const divided = split_node(node, offset);
+    const std::size_t moved = divided->size();
+    for (Node *ancestor = root; ancestor != node;) {
+        ancestor->weight -= moved;
+        ancestor = detail::less<Compare>(key, key_of(ancestor)) ? ancestor->left : ancestor->right;
+    }
+    const auto [less, same, greater] = split(root, key);
+    assert(same == node);
+    root = join_nodes(less, same, nullptr);
+    upper.root = join_nodes(nullptr, divided, greater);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::join(Tree&& upper) {
+    assert(&upper != this);
+    forget_cursors();
+    upper.forget_cursors();
+    if (!upper.root) {
+        return;
+    }
+    if (!(allocator == upper.allocator)) {
+        merge(std::move(upper));
+        return;
+    }
+    unshare_all();
+    upper.unshare_all();
+    if (!root) {
+        root = upper.root;
+        upper.root = nullptr;
+        return;
+    }
+
+    // Our greatest key might be `upper`'s least key, in which case those
+    // nodes combine. Make room for that first, since that's the only thing
+    // that can throw.
+    Node *greatest = root;
+    while (greatest->right) {
+        greatest = greatest->right;
+    }
+    Node *least = upper.root;
+    while (least->left) {
+        least = least->left;
+    }
+    const auto& greatest_key = key_of(greatest);
+    assert(!detail::less<Compare>(key_of(least), greatest_key));
+    const bool combine = !detail::less<Compare>(greatest_key, key_of(least));
+    if (combine) {
+        greatest->reserve(allocator, greatest->size() + least->size());
+    }
+
+    Node *middle;
+    Node *rest = detach_min(upper.root, middle);
+    upper.root = nullptr;
+    if (combine) {
+        // Append `middle`'s elements to `greatest`, and then account for
+        // them in the weights along the right spine.
+        const std::size_t added = middle->size();
+        greatest->append(allocator, *middle);
+        // The added elements come last in every subtree on the spine, so
+        // they can be combined onto the end of each subtree's aggregate.
+        const auto added_aggregate = Aggregate::of(greatest->values()[0], added);
+        for (Node *node = root; node != greatest; node = node->right) {
+            node->weight += added;
+            node->aggregate = Aggregate::combine(node->aggregate, added_aggregate);
+        }
+        // `middle`'s right child is now in `rest`, so stop counting it, or
+        // `middle` would destroy more elements than it has.
+        middle->weight -= middle->right_weight();
+        middle->right = nullptr;
+        destroy_node(middle);
+        if (!rest) {
+            return;
+        }
+        rest = detach_min(rest, middle);
+    }
+    // `detach_min` leaves `middle`'s right child, which is now in `rest`.
+    middle->weight -= middle->right_weight();
+    middle->right = nullptr;
+    middle->height = 1;
+    root = join_nodes(root, middle, rest);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::split_node(Node *node, std::size_t offset) {
+    const std::size_t old_size = node->size();
+    assert(offset > 0 && offset < old_size);
+    if constexpr (Node::counted) {
+        // Copy the one element, and divide the count.
+        Node *const divided = create_node(node->values()[0]);
+        divided->add_copies(old_size - offset - 1);
+        node->truncate(allocator, offset);
+        return divided;
+    } else {
+        // The elements aren't `const`, only our view of them is.
+        T *const values = const_cast<T*>(node->values().data());
+        // If allocating the new node throws, nothing has been moved yet.
+        Node *const divided = create_node(std::move(values[offset]));
+        try {
+            divided->reserve(allocator, old_size - offset);
+        } catch (...) {
+            // Put back the one element that was moved.
+            T& first = const_cast<T&>(divided->values()[0]);
+            values[offset].~T();
+            new (&values[offset]) T(std::move(first));
+            destroy_node(divided);
+            throw;
+        }
+        for (std::size_t i = offset + 1; i < old_size; ++i) {
+            divided->insert(allocator, std::move(values[i]));
+        }
+        node->truncate(allocator, offset);
+        return divided;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::detach_children(Node *node) {
+    node->weight = node->size();
+    node->height = 1;
+    node->left = node->right = nullptr;
+    node->update_aggregate();
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Visit>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::for_each_node(Node *node, Visit&& visit) {
+    while (node) {
+        for_each_node(node->left, visit);
+        visit(node);
+        node = node->right;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::join_nodes(Node *left, Node *middle, Node *right) {
+    assert(middle && !middle->left && !middle->right);
+    const int left_height = left ? left->height : 0;
+    const int right_height = right ? right->height : 0;
+    // If one side is too tall for `middle` to be their parent, then descend
+    // into that side along its edge facing the other side, and rebalance on
+    // the way back up, as an insertion would.
+    if (left_height > right_height + 1) {
+        const std::size_t size = left->size();
+        left->right = join_nodes(left->right, middle, right);
+        left->weight = size + left->left_weight() + left->right_weight();
+        left->height = 1 + std::max(left->left_height(), left->right_height());
+        left->update_aggregate();
+        return balance(left);
+    }
+    if (right_height > left_height + 1) {
+        const std::size_t size = right->size();
+        right->left = join_nodes(left, middle, right->left);
+        right->weight = size + right->left_weight() + right->right_weight();
+        right->height = 1 + std::max(right->left_height(), right->right_height());
+        right->update_aggregate();
+        return balance(right);
+    }
+    middle->replace_children(left, right);
+    return middle;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename U>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::create_node(U&& value) {
+    void *const storage = allocator.allocate(sizeof(Node));
+    // `Node`'s constructor can throw only if copying `value` throws.
+    try {
+        return new (storage) Node(std::forward<U>(value));
+    } catch (...) {
+        allocator.deallocate(storage, sizeof(Node));
+        throw;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::destroy_node(Node *node) {
+    node->destroy_values(allocator);
+    node->~Node();
+    allocator.deallocate(node, sizeof(Node));
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::dispose(Node *node, bool deallocate) {
+    // Rotate right until there is no left child, and then destroy the node
+    // and continue with its right child. This way, every node is visited
+    // without recursion or an explicit stack. Rotations here don't bother
+    // maintaining `height`, but they do maintain `weight`, because a node's
+    // `size()` depends on it.
+    while (node) {
+        if (Node *const left = node->left) {
+            const std::size_t total_weight = node->weight;
+            node->weight = total_weight - left->weight + left->right_weight();
+            node->left = left->right;
+            left->weight = total_weight;
+            left->right = node;
+            node = left;
+            continue;
+        }
+        Node *const right = node->right;
+        if (deallocate) {
+            destroy_node(node);
+        } else {
+            node->destroy_values(allocator);
+            node->~Node();
+        }
+        node = right;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::~Tree() {
+    clear();
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::size() const {
+    return root ? root->weight : 0;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::empty() const {
+    return size() == 0;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::insert(const T& value) {
+    generic_insert(value);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::insert(T&& value) {
+    generic_insert(std::move(value));
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::insert(const T& value, std::size_t count) {
+    static_assert(Node::counted);
+    if (count) {
+        generic_insert(value, count);
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename U>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::generic_insert(U&& value, std::size_t count) {
+    // Adjust the tracked percentiles now, while `value`'s key is intact. If
+    // the insertion fails, then forget them instead. Cursors advance one
+    // element at a time, so forget them if there's more than one.
+    const std::size_t old_size = size();
+    if (count == 1) {
+        advance_cursors(GetKey()(value));
+    } else {
+        forget_cursors();
+    }
+    const auto guard = detail::on_scope_exit([&, this]() {
+        if (size() == old_size) {
+            forget_cursors();
+        }
+    });
+
+    // Descend from the root, remembering each link followed, until we find
+    // either the node having `value`'s key or the null link where a new node
+    // belongs.
+    Node **path[max_height];
+    std::size_t depth = 0;
+    Node **link = &root;
     const auto& value_key = GetKey()(value);
-    const auto& node_key = GetKey()(into->values()[0]);
-    if (value_key < node_key) {
-        const std::size_t size = into->size();
-        into->left = generic_insert(into->left, std::forward<U>(value));
-        into->weight = size + into->left_weight() + into->right_weight();
-        into->height = 1 + std::max(into->left_height(), into->right_height());
-    } else if (node_key < value_key) {
-        const std::size_t size = into->size();
-        into->right = generic_insert(into->right, std::forward<U>(value));
-        into->weight = size + into->left_weight() + into->right_weight();
-        into->height = 1 + std::max(into->left_height(), into->right_height());
+    // The summary to combine into each ancestor's aggregate, computed before
+    // `value` is moved.
+    const auto added = Aggregate::of(value, count);
+    detail::count(&TreeCounters::descents);
+    while (*link) {
+        // Every node on the path changes, so we need our own copy of it.
+        // Rotations on the way back up involve only nodes on the path.
+        Node *const node = *link = unshare(*link);
+        const auto order = detail::counted_compare<Compare>(value_key, key_of(node));
+        if (order < 0) {
+            path[depth++] = link;
+            link = &node->left;
+        } else if (order > 0) {
+            path[depth++] = link;
+            link = &node->right;
+        } else {
+            if constexpr (Node::counted) {
+                node->add_copies(count);
+            } else {
+                node->insert(allocator, std::forward<U>(value));
+            }
+            // `insert` takes care of increasing `weight`, and no `height`
+            // changes.
+            for (std::size_t i = 0; i < depth; ++i) {
+                (*path[i])->weight += count;
+                (*path[i])->aggregate = Aggregate::combine((*path[i])->aggregate, added);
+            }
+            return;
+        }
+    }
+    assert(depth < max_height);
+    *link = create_node(std::forward<U>(value));
+    if constexpr (Node::counted) {
+        (*link)->add_copies(count - 1);
+    }
+
+    // Walk back up the path, updating `weight` and `height` and rebalancing.
+    // Once a subtree's height stops changing, the only thing left to update
+    // above it is `weight`.
+    while (depth) {
+        Node **const parent_link = path[--depth];
+        Node *const node = *parent_link;
+        node->weight += count;
+        node->aggregate = Aggregate::combine(node->aggregate, added);
+        const std::uint8_t old_height = node->height;
+        node->height = 1 + std::max(node->left_height(), node->right_height());
+        *parent_link = balance(node);
+        if ((*parent_link)->height == old_height) {
+            break;
+        }
+    }
+    while (depth) {
+        Node *const node = *path[--depth];
+        node->weight += count;
+        node->aggregate = Aggregate::combine(node->aggregate, added);
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::clear() {
+    forget_cursors();
+    if (!root) {
+        return;
+    }
+    if constexpr (Node::persistent) {
+        release(root);
+        root = nullptr;
+        shared = false;
+        return;
+    }
+    // If no other tree shares our allocator, then we can free all of the
+    // nodes at once instead of one at a time. We still have to visit each
+    // node to destroy its values and its cached key, unless destroying them
+    // does nothing.
+    if (allocator.can_release_all()) {
+        if constexpr (!std::is_trivially_destructible_v<T> ||
+                      !std::is_trivially_destructible_v<typename Node::cached_key_type>) {
+            dispose(root, false);
+        }
+        allocator.release_all();
     } else {
-        into->insert(std::forward<U>(value));
-        // `insert` takes care of increasing `weight`, and `height` doesn't
+        dispose(root, true);
+    }
+    root = nullptr;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::erase(const T& value) {
+    forget_cursors();
+    std::size_t removed = 0;
+    unshare_for_erase(GetKey()(value), true);
+    detail::count(&TreeCounters::descents);
+    root = erase(root, GetKey()(value), true, removed);
+    return removed;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+bool Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::erase_one_by_key(const Key& key) {
+    forget_cursors();
+    std::size_t removed = 0;
+    unshare_for_erase(key, false);
+    detail::count(&TreeCounters::descents);
+    root = erase(root, key, false, removed);
+    return removed;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::erase(Node *node, const Key& key, bool all, std::size_t& removed) {
+    if (node == nullptr) {
+        return node;
+    }
+
+    const auto order = detail::counted_compare<Compare>(key, key_of(node));
+    if (order < 0) {
+        const std::size_t size = node->size();
+        node->left = erase(node->left, key, all, removed);
+        node->weight = size + node->left_weight() + node->right_weight();
+        node->height = 1 + std::max(node->left_height(), node->right_height());
+        node->update_aggregate();
+    } else if (order > 0) {
+        const std::size_t size = node->size();
+        node->right = erase(node->right, key, all, removed);
+        node->weight = size + node->left_weight() + node->right_weight();
+        node->height = 1 + std::max(node->left_height(), node->right_height());
+        node->update_aggregate();
+    } else if (!all && node->size() > 1) {
+        node->pop_back(allocator);
+        // `pop_back` takes care of decreasing `weight`, and `height` doesn't
         // change.
+        ++removed;
+        return node;
+    } else {
+        removed += node->size();
+        return unlink(node);
     }
 
-    return balance(into);
+    return balance(node);
 }
 
-template <typename T, typename GetKey>
-TreeNode<T> *Tree<T, GetKey>::balance(TreeNode<T> *node) {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unlink(Node *node) {
+    Node *const left = node->left;
+    Node *const right = node->right;
+    destroy_node(node);
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    // Replace `node` with its in-order successor.
+    Node *successor;
+    Node *const new_right = detach_min(right, successor);
+    successor->replace_children(left, new_right);
+    return balance(successor);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::detach_min(Node *node, Node *&min) {
+    if (!node->left) {
+        min = node;
+        return node->right;
+    }
+    const std::size_t size = node->size();
+    node->left = detach_min(node->left, min);
+    node->weight = size + node->left_weight() + node->right_weight();
+    node->height = 1 + std::max(node->left_height(), node->right_height());
+    node->update_aggregate();
+    return balance(node);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unshare(Node *node) {
+    if constexpr (!Node::persistent) {
+        return node;
+    } else {
+        if (!shared || !node || node->refs.load(std::memory_order_acquire) == 1) {
+            return node;
+        }
+        void *const storage = allocator.allocate(sizeof(Node));
+        Node *copy;
+        try {
+            copy = new (storage) Node(*node);
+        } catch (...) {
+            allocator.deallocate(storage, sizeof(Node));
+            throw;
+        }
+        for (Node *const child : {copy->left, copy->right}) {
+            if (child) {
+                child->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        detail::count(&TreeCounters::node_copies);
+        // The other tree might have let go of `node` meanwhile, in which case
+        // this destroys it.
+        release(node);
+        // Cursors might point into the nodes that are now only the other
+        // tree's.
+        forget_cursors();
+        return copy;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unshare_all() {
+    if constexpr (Node::persistent) {
+        if (!shared) {
+            return;
+        }
+        unshare_subtree(root);
+        shared = false;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unshare_subtree(Node *&link) {
+    // Copying replaces one link at a time, so if it throws, the tree is still
+    // whole, and has the same elements.
+    link = unshare(link);
+    if (!link) {
+        return;
+    }
+    link->unshare_values(allocator);
+    unshare_subtree(link->left);
+    unshare_subtree(link->right);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::unshare_for_erase(const Key& key, bool all) {
+    if constexpr (Node::persistent) {
+        if (!shared) {
+            return;
+        }
+        const Node *const found = find(root, key);
+        if (!found) {
+            return;
+        }
+        // Removing one of a node's elements changes only the nodes on the
+        // path to it. Removing the node changes also the nodes on the path
+        // from there to its successor, and the rebalancing of both paths
+        // rotates the siblings of their nodes, and those siblings' children.
+        // So copy the children and grandchildren of each node on the paths.
+        const bool unlinks = all || found->size() == 1;
+        const auto unshare_family = [this](Node *node) {
+            for (Node **const link : {&node->left, &node->right}) {
+                if (Node *const child = *link = unshare(*link)) {
+                    child->left = unshare(child->left);
+                    child->right = unshare(child->right);
+                }
+            }
+        };
+        Node **link = &root;
+        for (;;) {
+            Node *const node = *link = unshare(*link);
+            if (unlinks) {
+                unshare_family(node);
+            }
+            const auto order = detail::compare<Compare>(key, key_of(node));
+            if (order < 0) {
+                link = &node->left;
+            } else if (order > 0) {
+                link = &node->right;
+            } else {
+                break;
+            }
+        }
+        if (!unlinks) {
+            return;
+        }
+        for (Node *node = (*link)->right; node; node = node->left) {
+            unshare_family(node);
+        }
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::release(Node *node) {
+    if constexpr (Node::persistent) {
+        if (!node || node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        // Destroying the node's values needs its children's weights.
+        Node *const left = node->left;
+        Node *const right = node->right;
+        destroy_node(node);
+        release(left);
+        release(right);
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+decltype(auto) Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::key_of(const Node *node) {
+    if constexpr (std::is_same_v<Keys, CacheKeys>) {
+        return (node->cached_key);
+    } else {
+        return GetKey()(node->values()[0]);
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::balance(Node *node) {
     assert(node);
     switch (const int diff = node->right_height() - node->left_height()) {
     case 2: {
@@ -455,6 +2533,7 @@ TreeNode<T> *Tree<T, GetKey>::balance(TreeNode<T> *node) {
       // left-heavy. First we might have to rotate the right side to the right.
       if (const int diff = node->right->left_height() - node->right->right_height(); diff > 0) {
           assert(diff == 1);
+          detail::count(&TreeCounters::right_left_rotations);
           node->right = rotate_right(node->right);
       }
       return rotate_left(node);
@@ -466,6 +2545,7 @@ TreeNode<T> *Tree<T, GetKey>::balance(TreeNode<T> *node) {
       // right-heavy. First we might have to rotate the left side to the left.
       if (const int diff = node->left->left_height() - node->left->right_height(); diff < 0) {
           assert(diff == -1);
+          detail::count(&TreeCounters::left_right_rotations);
           node->left = rotate_left(node->left);
       }
       return rotate_right(node);
@@ -476,14 +2556,15 @@ TreeNode<T> *Tree<T, GetKey>::balance(TreeNode<T> *node) {
     }
 }
 
-template <typename T, typename GetKey>
-TreeNode<T> *Tree<T, GetKey>::rotate_left(TreeNode<T> *node) {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::rotate_left(Node *node) {
     //         B                     A
     //       ./ \.                 ./ \.
     //     low   A        →        B  high
     //         ./ \.             ./ \.
     //     middle  high        low  middle
     //
+    detail::count(&TreeCounters::left_rotations);
     Node* B = node;
     assert(B);
     Node* low = B->left;
@@ -498,8 +2579,8 @@ TreeNode<T> *Tree<T, GetKey>::rotate_left(TreeNode<T> *node) {
     return A;
 }
 
-template <typename T, typename GetKey>
-TreeNode<T> *Tree<T, GetKey>::rotate_right(TreeNode<T> *node) {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::rotate_right(Node *node) {
     //
     //           A                 B
     //         ./ \.             ./ \.
@@ -507,6 +2588,7 @@ TreeNode<T> *Tree<T, GetKey>::rotate_right(TreeNode<T> *node) {
     //       ./ \.                 ./ \.
     //     low  middle         middle  high
     //
+    detail::count(&TreeCounters::right_rotations);
     Node* A = node;
     assert(A);
     Node* B    = A->left;
@@ -521,77 +2603,468 @@ TreeNode<T> *Tree<T, GetKey>::rotate_right(TreeNode<T> *node) {
     return B;
 }
 
-template <typename T, typename GetKey>
-TreeNode<T> *Tree<T, GetKey>::get_root_for_testing() const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+TreeStats Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::stats() const {
+    TreeStats result;
+    result.size = size();
+    result.height = root ? root->height : 0;
+    for_each_node(root, [&](const Node *node) {
+        ++result.distinct_keys;
+        const std::size_t count = node->size();
+        const std::size_t bucket = std::bit_width(count) - 1;
+        if (bucket >= result.duplicates.size()) {
+            result.duplicates.resize(bucket + 1);
+        }
+        ++result.duplicates[bucket];
+        if (node->storage == Node::ALLOCATED) {
+            ++result.allocated_arrays;
+            result.array_bytes_allocated += node->capacity() * sizeof(T);
+            result.array_bytes_used += count * sizeof(T);
+        }
+    });
+    result.node_bytes = result.distinct_keys * sizeof(Node);
+    return result;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::get_root_for_testing() const {
     return root;
 }
 
-template <typename T, typename GetKey>
-std::pair<std::span<const T>, std::size_t> Tree<T, GetKey>::get(std::size_t rank) const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::pair<typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type, std::size_t> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::get(std::size_t rank) const {
     assert(root);
     const auto [node, offset] = Node::get(*root, rank);
     return {node->values(), offset};
 }
 
-template <typename T, typename GetKey>
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
 template <typename Key>
-const TreeNode<T> *Tree<T, GetKey>::find(const TreeNode<T> *node, const Key& key) {
-    if (!node) {
-        return node;
-    }
-    const Key their_key = GetKey()(node->values()[0]);
-    if (key < their_key) {
-        return find(node->left, key);
-    }
-    if (their_key < key) {
-        return find(node->right, key);
+const typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::find(const Node *node, const Key& key) {
+    detail::count(&TreeCounters::descents);
+    while (node) {
+        const auto order = detail::counted_compare<Compare>(key, key_of(node));
+        if (order < 0) {
+            node = node->left;
+        } else if (order > 0) {
+            node = node->right;
+        } else {
+            break;
+        }
     }
     return node;
 }
 
-template <typename T, typename GetKey>
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
 template <typename Key>
-std::pair<std::size_t, std::size_t> Tree<T, GetKey>::rank(const Node *node, const Key& key, std::size_t weight_behind) {
-    assert(node);
-    const Key their_key = GetKey()(node->values()[0]);
-    if (key < their_key) {
-        return rank(node->left, key, weight_behind);
-    }
-    if (their_key < key) {
-        return rank(node->right, key, weight_behind + node->left_weight() + node->size());
+std::pair<std::size_t, const typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::Node*> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::search(const Node *node, const Key& key) {
+    std::size_t weight_behind = 0;
+    detail::count(&TreeCounters::descents);
+    while (node) {
+        const auto order = detail::counted_compare<Compare>(key, key_of(node));
+        if (order < 0) {
+            node = node->left;
+        } else if (order > 0) {
+            weight_behind += node->weight - node->right_weight();
+            node = node->right;
+        } else {
+            return {weight_behind + node->left_weight(), node};
+        }
     }
-    return {weight_behind + node->left_weight(), weight_behind + node->left_weight() + node->size() - 1};
+    return {weight_behind, nullptr};
 }
 
-template <typename T, typename GetKey>
-const T& Tree<T, GetKey>::nth_element(std::size_t rank) const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+const T& Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::nth_element(std::size_t rank) const {
     const auto [values, offset] = get(rank);
     return values[offset];
 }
     
-template <typename T, typename GetKey>
-std::span<const T> Tree<T, GetKey>::nth_elements(std::size_t rank) const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::nth_elements(std::size_t rank) const {
     const auto [values, _] = get(rank);
     return values;
 }
 
-template <typename T, typename GetKey>
-std::span<const T> Tree<T, GetKey>::percentile(std::size_t percent) const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::percentile(std::size_t percent) const {
     const std::size_t rank = std::min(percent * size() / 100, size() - 1);
     return nth_elements(rank);
 }
 
-template <typename T, typename GetKey>
-std::pair<std::size_t, std::size_t> Tree<T, GetKey>::rank(const T& value) const {
-    return rank(root, GetKey()(value), 0);
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::pair<std::size_t, std::size_t> Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::rank(const T& value) const {
+    const auto [below, node] = search(root, GetKey()(value));
+    assert(node);
+    return {below, below + node->size() - 1};
 }
 
-template <typename T, typename GetKey>
-std::span<const T> Tree<T, GetKey>::equal_range(const T& value) const {
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::track_percentile(std::size_t percent) {
+    assert(percent >= 1 && percent <= 100);
+    cursors.push_back(Cursor{percent, nullptr, 0, 0, 0});
+    return cursors.size() - 1;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::tracked_percentile(std::size_t index) const {
+    Cursor& cursor = cursors[index];
+    if (!cursor.node) {
+        const std::size_t rank = std::min(cursor.percent * size() / 100, size() - 1);
+        std::tie(cursor.node, cursor.offset) = Node::get(*root, rank);
+        cursor.node_size = cursor.node->size();
+        cursor.remainder = cursor.percent * size() % 100;
+    }
+    return cursor.node->values();
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::advance_cursors(const Key& key) {
+    for (Cursor& cursor : cursors) {
+        if (!cursor.node) {
+            continue;
+        }
+        // The percentile's rank grows by zero or one. If the new element
+        // goes before the cursor's node, then so does the rank of every
+        // element in the node. The net change in `offset` is -1, 0, or 1,
+        // and if that takes it out of the node, then let the next query
+        // find the new node. At 100%, the rank is `size() - 1`, which always
+        // grows, and `remainder` is always zero, so it always carries.
+        cursor.remainder += cursor.percent;
+        const bool carry = cursor.remainder >= 100;
+        cursor.remainder -= carry ? 100 : 0;
+        const auto order = detail::compare<Compare>(key, key_of(cursor.node));
+        const bool before = order < 0;
+        cursor.node_size += !before && !(order > 0);
+        const std::size_t offset = cursor.offset + carry;
+        if (offset < std::size_t(before) || offset - before >= cursor.node_size) {
+            cursor.node = nullptr;
+        } else {
+            cursor.offset = offset - before;
+        }
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::forget_cursors() const {
+    for (Cursor& cursor : cursors) {
+        cursor.node = nullptr;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::equal_range(const T& value) const {
     if (const Node *const node = find(root, GetKey()(value))) {
         return node->values();
     }
     return {};
 }
 
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::rank_of_key(const Key& key) const {
+    return search(root, key).first;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+std::size_t Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::count_of_key(const Key& key) const {
+    const Node *const node = find(root, key);
+    return node ? node->size() : 0;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::values_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::equal_range_of_key(const Key& key) const {
+    if (const Node *const node = find(root, key)) {
+        return node->values();
+    }
+    return {};
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::const_iterator()
+: const_iterator(nullptr) {}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::const_iterator(const Node *root)
+: root(root)
+, depth(0)
+, offset(0) {}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::const_iterator(const const_iterator& other)
+: root(other.root)
+, depth(other.depth)
+, offset(other.offset) {
+    std::copy_n(other.path, depth, path);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator&
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator=(const const_iterator& other) {
+    root = other.root;
+    depth = other.depth;
+    offset = other.offset;
+    std::copy_n(other.path, depth, path);
+    return *this;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::descend_left() {
+    while (const Node *const left = path[depth - 1]->left) {
+        assert(depth < max_height);
+        path[depth++] = left;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+void Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::descend_right() {
+    while (const Node *const right = path[depth - 1]->right) {
+        assert(depth < max_height);
+        path[depth++] = right;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+const T& Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator*() const {
+    assert(depth);
+    return path[depth - 1]->values()[offset];
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+const T *Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator->() const {
+    return &**this;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator& Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator++() {
+    assert(depth);
+    const Node *node = path[depth - 1];
+    if (++offset < node->size()) {
+        return *this;
+    }
+    offset = 0;
+    if (node->right) {
+        path[depth++] = node->right;
+        descend_left();
+        return *this;
+    }
+    // Go up until we leave a left subtree. If there's none, then we were at
+    // the last node, and `depth` is now zero.
+    do {
+        node = path[--depth];
+    } while (depth && path[depth - 1]->right == node);
+    return *this;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator++(int) {
+    const_iterator old = *this;
+    ++*this;
+    return old;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator& Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator--() {
+    if (!depth) {
+        assert(root);
+        path[depth++] = root;
+        descend_right();
+    } else if (offset) {
+        --offset;
+        return *this;
+    } else if (const Node *const left = path[depth - 1]->left) {
+        path[depth++] = left;
+        descend_right();
+    } else {
+        // Go up until we leave a right subtree. There must be one, since
+        // decrementing the first element is not allowed.
+        const Node *node;
+        do {
+            node = path[--depth];
+            assert(depth);
+        } while (path[depth - 1]->left == node);
+    }
+    offset = path[depth - 1]->size() - 1;
+    return *this;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator--(int) {
+    const_iterator old = *this;
+    --*this;
+    return old;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+bool Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator::operator==(const const_iterator& other) const {
+    if (depth != other.depth) {
+        return false;
+    }
+    return !depth || (path[depth - 1] == other.path[depth - 1] && offset == other.offset);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::begin() const {
+    const_iterator result(root);
+    if (root) {
+        result.path[result.depth++] = root;
+        result.descend_left();
+    }
+    return result;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::end() const {
+    return const_iterator(root);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::lower_bound(const Key& key) const {
+    return bound<false>(key);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <typename Key>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::upper_bound(const Key& key) const {
+    return bound<true>(key);
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+template <bool or_equal, typename Key>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::bound(const Key& key) const {
+    // Descend as if searching for `key`, remembering the deepest node where
+    // we went left. That node is the answer, and the path to it is a prefix
+    // of the path followed.
+    const_iterator result(root);
+    std::size_t answer_depth = 0;
+    detail::count(&TreeCounters::descents);
+    for (const Node *node = root; node;) {
+        result.path[result.depth++] = node;
+        const auto& node_key = key_of(node);
+        const bool go_left = or_equal ? detail::counted_less<Compare>(key, node_key) : !detail::counted_less<Compare>(node_key, key);
+        if (go_left) {
+            answer_depth = result.depth;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    result.depth = answer_depth;
+    return result;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::seek(std::size_t rank) const {
+    assert(rank <= size());
+    const_iterator result(root);
+    if (rank == size()) {
+        return result;
+    }
+    // This is the same descent as `TreeNode::get`, but remembering the path.
+    const Node *node = root;
+    for (;;) {
+        result.path[result.depth++] = node;
+        const std::size_t left_weight = node->left_weight();
+        if (rank < left_weight) {
+            node = node->left;
+            continue;
+        }
+        rank -= left_weight;
+        const std::size_t size = node->weight - left_weight - node->right_weight();
+        if (rank < size) {
+            result.offset = rank;
+            return result;
+        }
+        rank -= size;
+        node = node->right;
+    }
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+std::ranges::subrange<typename Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::const_iterator>
+Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::range(std::size_t rank_lo, std::size_t rank_hi) const {
+    assert(rank_lo <= rank_hi);
+    return {seek(rank_lo), seek(rank_hi)};
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Aggregate::value_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::sum_by_rank(std::size_t rank_lo, std::size_t rank_hi) const {
+    assert(rank_lo <= rank_hi && rank_hi <= size());
+    // Descend until the range isn't entirely on one side of a node. Then the
+    // range is a suffix of the left subtree, some of the node's elements,
+    // and a prefix of the right subtree.
+    const Node *node = root;
+    while (rank_lo < rank_hi) {
+        const std::size_t left_weight = node->left_weight();
+        const std::size_t size = node->weight - left_weight - node->right_weight();
+        if (rank_hi <= left_weight) {
+            node = node->left;
+            continue;
+        }
+        if (rank_lo >= left_weight + size) {
+            rank_lo -= left_weight + size;
+            rank_hi -= left_weight + size;
+            node = node->right;
+            continue;
+        }
+        const std::size_t own_lo = std::max(rank_lo, left_weight);
+        const std::size_t own_hi = std::min(rank_hi, left_weight + size);
+        auto result = Aggregate::of(node->values()[0], own_hi - own_lo);
+        if (rank_lo < left_weight) {
+            result = Aggregate::combine(aggregate_suffix(node->left, rank_lo), result);
+        }
+        if (rank_hi > left_weight + size) {
+            result = Aggregate::combine(result, aggregate_prefix(node->right, rank_hi - left_weight - size));
+        }
+        return result;
+    }
+    return typename Aggregate::value_type();
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Aggregate::value_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::aggregate_prefix(const Node *node, std::size_t count) {
+    // Accumulate from left to right whatever lies left of the boundary.
+    typename Aggregate::value_type result;
+    while (count) {
+        const std::size_t left_weight = node->left_weight();
+        if (count <= left_weight) {
+            node = node->left;
+            continue;
+        }
+        const std::size_t size = node->weight - left_weight - node->right_weight();
+        result = Aggregate::combine(result, node->left_aggregate());
+        result = Aggregate::combine(result, Aggregate::of(node->values()[0], std::min(count - left_weight, size)));
+        count -= std::min(count, left_weight + size);
+        node = node->right;
+    }
+    return result;
+}
+
+template <typename T, typename GetKey, typename Allocator, typename Aggregate, typename Duplicates, typename Keys, typename Compare, typename Versions>
+typename Aggregate::value_type Tree<T, GetKey, Allocator, Aggregate, Duplicates, Keys, Compare, Versions>::aggregate_suffix(const Node *node, std::size_t rank) {
+    // Accumulate from right to left whatever lies right of the boundary.
+    typename Aggregate::value_type result;
+    while (node && rank < node->weight) {
+        const std::size_t left_weight = node->left_weight();
+        const std::size_t size = node->weight - left_weight - node->right_weight();
+        if (rank >= left_weight + size) {
+            rank -= left_weight + size;
+            node = node->right;
+            continue;
+        }
+        const std::size_t own = left_weight + size - std::max(rank, left_weight);
+        result = Aggregate::combine(node->right_aggregate(), result);
+        result = Aggregate::combine(Aggregate::of(node->values()[0], own), result);
+        if (rank >= left_weight) {
+            break;
+        }
+        node = node->left;
+    }
+    return result;
+}
+
 } // namespace order_statistics